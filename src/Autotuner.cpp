@@ -0,0 +1,248 @@
+
+#include "Autotuner.hpp"
+#include "common/ThreadPool.hpp"
+#include "util/Random.hpp"
+#include "util/Timer.hpp"
+#include <cassert>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+
+// A candidate must beat the default configuration's throughput by this factor to replace it, so
+// that timing noise doesn't lead to caching an arbitrary configuration.
+static const float MIN_IMPROVEMENT = 1.03f;
+
+// Per-worker batch sizes tried for SAMPLES splits, besides the whole share in one batch.
+static const unsigned WORKER_BATCH_SIZES[] = {16, 64, 256};
+
+// Minimum multiply-adds per chunk tried for INTRA_OP splits.
+static const unsigned CHUNK_WORKS[] = {1 << 14, 1 << 16, 1 << 18};
+
+static string cpuModel(void) {
+  ifstream cpuInfo("/proc/cpuinfo");
+  string line;
+  while (getline(cpuInfo, line)) {
+    if (line.compare(0, 10, "model name") == 0 && line.find(':') != string::npos) {
+      return line.substr(line.find(':') + 2);
+    }
+  }
+  return "unknown cpu";
+}
+
+static vector<TrainingSample> randomSamples(unsigned howMany, unsigned numInputs,
+                                            unsigned numOutputs) {
+  PhiloxRng &rng = Random::ThreadStream();
+  vector<TrainingSample> result;
+  for (unsigned i = 0; i < howMany; i++) {
+    Vector input(numInputs), output(numOutputs);
+    rng.FillUniform(input.data(), numInputs, -1.0f, 1.0f);
+    rng.FillUniform(output.data(), numOutputs, 0.0f, 1.0f);
+    result.push_back(TrainingSample{input, output.array().round().matrix()});
+  }
+  return result;
+}
+
+// Gradient throughput in samples per second with the network's current configuration.
+static float samplesPerSecond(Network &network, const TrainingProvider &provider, float seconds) {
+  network.ComputeGradient(provider); // warmup
+
+  Timer timer;
+  timer.Start();
+  unsigned iterations = 0;
+  do {
+    network.ComputeGradient(provider);
+    iterations++;
+    timer.Stop();
+  } while (timer.GetNumElapsedSeconds() < seconds || iterations < 2);
+
+  return iterations * provider.NumSamples() / timer.GetNumElapsedSeconds();
+}
+
+static bool hasNormalization(const Network &network, Normalization normalization) {
+  for (unsigned l = 0; l < network.NumLayers(); l++) {
+    if (network.GetNormalization(l) == normalization) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static vector<TuningResult> candidates(const Network &network, unsigned batchSize) {
+  const unsigned numThreads = ThreadPool::instance().NumThreads();
+  vector<TuningResult> result;
+  vector<unsigned> workerCounts;
+  for (unsigned workers = 1; workers < numThreads; workers *= 2) {
+    workerCounts.push_back(workers);
+  }
+  workerCounts.push_back(numThreads);
+
+  for (unsigned workers : workerCounts) {
+    auto add = [&](GradientSplit split, unsigned workerBatchSize, unsigned chunkWork) {
+      result.push_back(TuningResult{ParallelMode::DATA,
+                                    ExecutionConfig{split, workers, workerBatchSize, chunkWork},
+                                    0.0f, 0.0f});
+    };
+
+    add(GradientSplit::SAMPLES, 0, 0);
+    const unsigned share = (batchSize + workers - 1) / workers;
+    for (unsigned workerBatchSize : WORKER_BATCH_SIZES) {
+      if (workerBatchSize < share) {
+        add(GradientSplit::SAMPLES, workerBatchSize, 0);
+      }
+    }
+
+    // With a single worker every chunk size runs the batch on the calling thread alone.
+    for (unsigned chunkWork : CHUNK_WORKS) {
+      add(GradientSplit::INTRA_OP, 0, chunkWork);
+      if (workers == 1) {
+        break;
+      }
+    }
+  }
+
+  if (numThreads > 1 && network.NumLayers() > 1 &&
+      !hasNormalization(network, Normalization::LAYER)) {
+    result.push_back(TuningResult{ParallelMode::PIPELINE,
+                                  ExecutionConfig{GradientSplit::AUTO, 0, 0, 0}, 0.0f, 0.0f});
+  }
+  return result;
+}
+
+static void apply(Network &network, ParallelMode mode, const ExecutionConfig &execution) {
+  if (network.GetParallelMode() != mode) {
+    network.SetParallelMode(mode);
+  }
+  network.SetExecutionConfig(execution);
+}
+
+static string serialize(const TuningResult &result) {
+  ostringstream out;
+  out << (int) result.parallelMode << " " << (int) result.execution.split << " "
+      << result.execution.maxWorkers << " " << result.execution.workerBatchSize << " "
+      << result.execution.minChunkWork << " " << result.samplesPerSecond << " "
+      << result.defaultSamplesPerSecond;
+  return out.str();
+}
+
+static bool deserialize(const string &line, TuningResult &result) {
+  istringstream in(line);
+  int mode, split;
+  ExecutionConfig &execution = result.execution;
+  if (!(in >> mode >> split >> execution.maxWorkers >> execution.workerBatchSize
+           >> execution.minChunkWork >> result.samplesPerSecond
+           >> result.defaultSamplesPerSecond)) {
+    return false;
+  }
+
+  result.parallelMode = (ParallelMode) mode;
+  execution.split = (GradientSplit) split;
+  return true;
+}
+
+// The cache file holds one line per key: the key, a tab, then the serialized result.
+static vector<pair<string, string>> readCache(const string &cachePath) {
+  vector<pair<string, string>> result;
+  ifstream in(cachePath);
+  string line;
+  while (getline(in, line)) {
+    size_t tab = line.find('\t');
+    if (tab != string::npos) {
+      result.emplace_back(line.substr(0, tab), line.substr(tab + 1));
+    }
+  }
+  return result;
+}
+
+TuningResult Autotuner::Tune(Network &network, unsigned batchSize, float secondsPerCandidate) {
+  assert(batchSize > 0);
+
+  const ExecutionConfig defaultExecution{GradientSplit::AUTO, 0, 0, 0};
+  // Every gradient updates the running statistics, so timing would change the network.
+  if (hasNormalization(network, Normalization::BATCH)) {
+    return TuningResult{ParallelMode::DATA, defaultExecution, 0.0f, 0.0f};
+  }
+
+  const ParallelMode originalMode = network.GetParallelMode();
+  const ExecutionConfig originalExecution = network.GetExecutionConfig();
+
+  vector<unsigned> layerSizes = network.LayerSizes();
+  vector<TrainingSample> samples = randomSamples(batchSize, layerSizes.front(), layerSizes.back());
+  TrainingProvider provider(samples, batchSize, 0);
+
+  apply(network, ParallelMode::DATA, defaultExecution);
+  const float defaultThroughput = samplesPerSecond(network, provider, secondsPerCandidate);
+  TuningResult best{ParallelMode::DATA, defaultExecution, defaultThroughput, defaultThroughput};
+
+  for (const TuningResult &candidate : candidates(network, batchSize)) {
+    apply(network, candidate.parallelMode, candidate.execution);
+    float throughput = samplesPerSecond(network, provider, secondsPerCandidate);
+    if (throughput > max(best.samplesPerSecond, defaultThroughput * MIN_IMPROVEMENT)) {
+      best = candidate;
+      best.samplesPerSecond = throughput;
+      best.defaultSamplesPerSecond = defaultThroughput;
+    }
+  }
+
+  apply(network, originalMode, originalExecution);
+  return best;
+}
+
+TuningResult Autotuner::TuneAndStore(Network &network, unsigned batchSize,
+                                     const string &cachePath) {
+  TuningResult result = Tune(network, batchSize);
+  apply(network, result.parallelMode, result.execution);
+
+  const string key = CacheKey(network, batchSize);
+  vector<pair<string, string>> entries = readCache(cachePath);
+  entries.erase(remove_if(entries.begin(), entries.end(),
+                          [&key](const pair<string, string> &e) { return e.first == key; }),
+                entries.end());
+  entries.emplace_back(key, serialize(result));
+
+  ofstream out(cachePath);
+  for (const auto& entry : entries) {
+    out << entry.first << "\t" << entry.second << "\n";
+  }
+  return result;
+}
+
+bool Autotuner::ApplyCached(Network &network, unsigned batchSize, const string &cachePath) {
+  const ExecutionConfig execution = network.GetExecutionConfig();
+  if (network.GetParallelMode() != ParallelMode::DATA || execution.split != GradientSplit::AUTO ||
+      execution.maxWorkers != 0 || execution.workerBatchSize != 0 || execution.minChunkWork != 0) {
+    return false;
+  }
+
+  const string key = CacheKey(network, batchSize);
+  for (const auto& entry : readCache(cachePath)) {
+    TuningResult result;
+    if (entry.first == key && deserialize(entry.second, result)) {
+      apply(network, result.parallelMode, result.execution);
+      return true;
+    }
+  }
+  return false;
+}
+
+string Autotuner::CacheKey(const Network &network, unsigned batchSize) {
+  static const string cpu = cpuModel();
+
+  ostringstream key;
+  key << cpu << " x" << ThreadPool::instance().NumThreads() << " ";
+  vector<unsigned> layerSizes = network.LayerSizes();
+  for (unsigned i = 0; i < layerSizes.size(); i++) {
+    key << (i > 0 ? "-" : "") << layerSizes[i];
+  }
+
+  // Plain networks keep the keys they had before normalization was added.
+  if (hasNormalization(network, Normalization::BATCH) ||
+      hasNormalization(network, Normalization::LAYER)) {
+    key << " normalization ";
+    for (unsigned l = 0; l < network.NumLayers(); l++) {
+      key << (l > 0 ? "-" : "") << (int) network.GetNormalization(l);
+    }
+  }
+  key << " batch " << batchSize;
+  return key.str();
+}
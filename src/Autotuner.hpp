@@ -0,0 +1,51 @@
+#pragma once
+
+#include "common/Common.hpp"
+#include "neuralnetwork/Network.hpp"
+#include <string>
+
+
+// The fastest training configuration found for a topology and minibatch size, and the throughput
+// of the default configuration for comparison.
+struct TuningResult {
+  ParallelMode parallelMode;
+  ExecutionConfig execution;
+  float samplesPerSecond;
+  float defaultSamplesPerSecond;
+};
+
+// Picks how to parallelise training for a given topology, minibatch size and host by timing the
+// candidate configurations, as the best choice depends on all three: tiny networks lose more to
+// task dispatch than threading gains them, while large ones may do better with fewer, bigger
+// products. Results are kept in a cache file keyed by the topology, batch size and CPU, which
+// the trainers consult when starting, so tuning once benefits every later run on that host.
+namespace Autotuner {
+
+  static const char* const DEFAULT_CACHE_PATH = "vnn_tuning.txt";
+
+  // Times ComputeGradient over a random minibatch of batchSize dense samples for each candidate
+  // for about secondsPerCandidate. The candidates are PIPELINE mode, and DATA mode over 1 up to
+  // all of the threads with SAMPLES splits (over a range of per-worker batch sizes) and INTRA_OP
+  // splits (over a range of chunk sizes). The default configuration is only displaced by a
+  // candidate clearly faster than it. The network's weights are unchanged and its configuration
+  // is restored. Layer normalized networks can't use PIPELINE mode. Batch normalized ones get the
+  // default configuration untimed (zero throughputs), as the split decides which samples share
+  // batch statistics and every gradient would update the running statistics.
+  TuningResult Tune(Network &network, unsigned batchSize, float secondsPerCandidate = 0.05f);
+
+  // Tunes, applies the result to the network and stores it in the cache file, replacing any
+  // earlier result for the same key.
+  TuningResult TuneAndStore(Network &network, unsigned batchSize,
+                            const string &cachePath = DEFAULT_CACHE_PATH);
+
+  // Applies the cached result for the network's topology and the batch size on this host,
+  // returning whether it did. A network no longer on the default configuration (DATA mode, AUTO
+  // with every other field 0) is left as the caller set it.
+  bool ApplyCached(Network &network, unsigned batchSize,
+                   const string &cachePath = DEFAULT_CACHE_PATH);
+
+  // The CPU model and thread pool size, the layer sizes, any layers' normalization and the batch
+  // size.
+  string CacheKey(const Network &network, unsigned batchSize);
+
+}
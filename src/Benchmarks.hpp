@@ -0,0 +1,78 @@
+#pragma once
+
+// Micro-benchmarks for the various execution strategies, selected from the command line.
+namespace Benchmarks {
+
+  // Gradient throughput of the data-parallel vs pipeline-parallel modes on a deep, wide network.
+  void PipelineParallel(void);
+
+  // Gradient throughput of a wide, sparse input layer with the samples held as sparse vs dense
+  // vectors, and the differences between the two in the gradient and in the weights after
+  // DynamicTrainer steps. With momentum, the sparse weights are compared with dense samples
+  // trained with the same lazy momentum.
+  void SparseInputs(void);
+
+  // Latency percentiles and throughput of single-sample requests from many concurrent clients,
+  // with and without dynamic request batching.
+  void InferenceBatching(void);
+
+  // Hit rate and hit vs miss latency of the result cache under a skewed stream of single-sample
+  // requests, against uncached inference, and the cached results being dropped by an update.
+  void ResultCache(void);
+
+  // Training throughput per model of many tiny networks trained one at a time vs packed into a
+  // single EnsembleNetwork.
+  void Ensemble(void);
+
+  // Wall time and best resulting accuracy of a hyperparameter sweep trained one job at a time vs
+  // through the TrainingScheduler, with and without successive halving.
+  void TrainingSweep(void);
+
+  // Accuracy, single-sample and batched inference speed, and weight storage of a network pruned
+  // to increasing sparsities and run through SparseNetwork, relative to the dense network.
+  void Pruning(void);
+
+  // Activation memory of a residual GraphNetwork with and without arena planning, over a range of
+  // batch sizes, and its training speed and accuracy.
+  void GraphMemory(void);
+
+  // Activation memory and gradient throughput over a range of batch sizes with the checkpoint
+  // interval chosen for a fixed memory budget, relative to keeping every layer's activations.
+  void Checkpointing(void);
+
+  // Time of the fused softmax cross entropy kernel vs separate softmax, log and gradient passes
+  // over a range of class counts, and the accuracy on a multi-class task of training with softmax
+  // vs per-output sigmoid cross entropy.
+  void SoftmaxLoss(void);
+
+  // Online learning with weight publication: a stress test of concurrent readers against a writer
+  // publishing distinguishable weights, checking every read saw one whole version and versions
+  // never went backwards; then reader latency percentiles while idle, while training with
+  // published weights, and while training with readers and trainer sharing a mutex instead.
+  void OnlineLearning(void);
+
+  // Memory per sample, batch packing speed, and training throughput and accuracy of a large
+  // training set held as fp32 TrainingSamples vs as a CompressedDataset of uint8 or fp16 features.
+  void CompressedData(void);
+
+  // Training time and iterations to a target balanced accuracy on an imbalanced task (a small
+  // positive region), with minibatches drawn uniformly vs through importance sampling with a range
+  // of importance weight exponents.
+  void ImportanceSampling(void);
+
+  // Training time, iterations and gradient throughput to a target accuracy on the default circle
+  // task with minibatch DynamicTrainer steps vs full-batch LbfgsTrainer steps.
+  void Lbfgs(void);
+
+  // Training time and iterations to a target accuracy on the circle task for a deep sigmoid
+  // network with no, batch or layer normalization on its hidden layers, and the inference time of
+  // each (batch normalization folded into the weights).
+  void Normalization(void);
+
+  // Time for a layer's forward pass, gradient and back-propagation with the weight matrices
+  // holding the bias in column 0 (the layout LayerKernels uses) vs with cache line padded weight
+  // columns, a separate bias vector and the bias add fused into the activation, over a range of
+  // layer shapes (including unaligned ones) and batch sizes.
+  void WeightLayout(void);
+
+}
@@ -0,0 +1,282 @@
+
+#include "CodeGen.hpp"
+#include "util/Random.hpp"
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <string>
+
+
+// Layers with at most this many weights (including biases) are fully unrolled.
+static const unsigned MAX_UNROLLED_WEIGHTS = 256;
+
+// Absolute difference from network.Process tolerated by the self test, allowing for the generated
+// code's exp_approx and scalar sums rounding differently from Eigen's vectorized exp and products.
+static const float SELF_TEST_TOLERANCE = 1e-5f;
+
+// Inferences timed by the self test are scaled to take roughly this many weight multiplies.
+static const double SELF_TEST_TIMING_WORK = 2e8;
+
+// A float literal that reads back as exactly the same value.
+static string floatLiteral(float value) {
+  assert(std::isfinite(value));
+
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%.9g", value);
+
+  string result(buffer);
+  if (result.find_first_of(".e") == string::npos) {
+    result += ".0";
+  }
+  return result + "f";
+}
+
+static string layerName(unsigned layer) {
+  return "L" + to_string(layer);
+}
+
+// The array holding the outputs of the given layer, or the input for -1.
+static string activationName(int layer) {
+  return layer < 0 ? "input" : "a" + to_string(layer);
+}
+
+// Writes an initializer list of count values, wrapped to a reasonable line length.
+template<typename Func>
+static void writeValues(std::ostream &out, unsigned count, Func value, const string &indent) {
+  static const unsigned VALUES_PER_LINE = 6;
+
+  out << "{";
+  for (unsigned i = 0; i < count; i++) {
+    if (i % VALUES_PER_LINE == 0) {
+      out << "\n" << indent << "  ";
+    }
+    out << floatLiteral(value(i)) << (i + 1 < count ? ", " : "");
+  }
+  out << "\n" << indent << "}";
+}
+
+// The bias is kept separately and the weights transposed, so that the inner loop of the product
+// runs over contiguous output rows.
+static void writeLayerConstants(std::ostream &out, unsigned layer, const Matrix &weights) {
+  const unsigned rows = weights.rows();
+  const unsigned inputs = weights.cols() - 1;
+  const string name = layerName(layer);
+
+  out << "constexpr float " << name << "_BIAS[" << rows << "] = ";
+  writeValues(out, rows, [&weights](unsigned r) { return weights(r, 0); }, "");
+  out << ";\n\n";
+
+  out << "constexpr float " << name << "_WEIGHTS[" << inputs << "][" << rows << "] = {";
+  for (unsigned c = 0; c < inputs; c++) {
+    out << "\n  ";
+    writeValues(out, rows, [&weights, c](unsigned r) { return weights(r, c + 1); }, "  ");
+    out << (c + 1 < inputs ? "," : "");
+  }
+  out << "\n};\n\n";
+}
+
+static void writeUnrolledLayer(std::ostream &out, const Matrix &weights,
+                               const string &in, const string &result, bool sigmoid) {
+  for (unsigned r = 0; r < weights.rows(); r++) {
+    out << "  " << result << "[" << r << "] = " << (sigmoid ? "sigmoid(" : "")
+        << floatLiteral(weights(r, 0));
+    for (unsigned c = 1; c < weights.cols(); c++) {
+      if (weights(r, c) != 0.0f) {
+        out << " + " << floatLiteral(weights(r, c)) << " * " << in << "[" << (c - 1) << "]";
+      }
+    }
+    out << (sigmoid ? ")" : "") << ";\n";
+  }
+}
+
+static void writeLoopLayer(std::ostream &out, unsigned layer, const Matrix &weights,
+                           const string &in, const string &result, bool sigmoid) {
+  const string name = layerName(layer);
+  const unsigned rows = weights.rows();
+
+  out << "  for (int r = 0; r < " << rows << "; r++) " << result << "[r] = " << name
+      << "_BIAS[r];\n";
+  out << "  for (int c = 0; c < " << (weights.cols() - 1) << "; c++) {\n";
+  out << "    const float x = " << in << "[c];\n";
+  out << "    for (int r = 0; r < " << rows << "; r++) " << result << "[r] += " << name
+      << "_WEIGHTS[c][r] * x;\n";
+  out << "  }\n";
+  if (sigmoid) {
+    out << "  for (int r = 0; r < " << rows << "; r++) " << result << "[r] = sigmoid(" << result
+        << "[r]);\n";
+  }
+}
+
+// The output layer's activation for losses other than binary cross entropy, applied in place to
+// the logits in output.
+static void writeOutputActivation(std::ostream &out, const Loss &loss, unsigned numOutputs) {
+  if (loss.type != LossType::SOFTMAX_CROSS_ENTROPY) {
+    return;
+  }
+
+  const string loop = "  for (int r = 0; r < " + to_string(numOutputs) + "; r++) ";
+  out << "\n  float maxLogit = output[0];\n";
+  out << loop << "maxLogit = output[r] > maxLogit ? output[r] : maxLogit;\n";
+  out << "  float sum = 0.0f;\n";
+  out << loop << "{\n";
+  out << "    output[r] = exp_approx(output[r] - maxLogit);\n";
+  out << "    sum += output[r];\n";
+  out << "  }\n";
+  out << "  const float scale = 1.0f / sum;\n";
+  out << loop << "output[r] *= scale;\n";
+}
+
+static void writeSelfTest(std::ostream &out, Network &network, const Tensor &weights,
+                          unsigned numTestSamples) {
+  const unsigned numInputs = weights(0).cols() - 1;
+  const unsigned numOutputs = weights(weights.NumLayers() - 1).rows();
+
+  vector<Vector> inputs;
+  vector<Vector> outputs;
+  PhiloxRng &rng = Random::ThreadStream();
+  for (unsigned i = 0; i < numTestSamples; i++) {
+    Vector input(numInputs);
+    rng.FillUniform(input.data(), numInputs, -1.0f, 1.0f);
+    inputs.push_back(input);
+    outputs.push_back(network.Process(input));
+  }
+
+  size_t numWeights = 0;
+  for (unsigned l = 0; l < weights.NumLayers(); l++) {
+    numWeights += weights(l).size();
+  }
+  const unsigned timingIterations = max(1.0, SELF_TEST_TIMING_WORK / numWeights);
+
+  out << "#ifdef VNN_SELF_TEST\n\n";
+  out << "#include <chrono>\n#include <cstdio>\n\n";
+  out << "namespace {\n\n";
+  out << "constexpr int NUM_TEST_SAMPLES = " << numTestSamples << ";\n";
+  out << "constexpr float TOLERANCE = " << floatLiteral(SELF_TEST_TOLERANCE) << ";\n";
+  out << "constexpr int TIMING_ITERATIONS = " << timingIterations << ";\n\n";
+
+  out << "// TEST_OUTPUTS are the outputs of Network::Process for TEST_INPUTS.\n";
+  for (const string &name : {string("TEST_INPUTS"), string("TEST_OUTPUTS")}) {
+    const vector<Vector> &values = name == "TEST_INPUTS" ? inputs : outputs;
+    const unsigned size = name == "TEST_INPUTS" ? numInputs : numOutputs;
+
+    out << "constexpr float " << name << "[" << numTestSamples << "][" << size << "] = {";
+    for (unsigned i = 0; i < numTestSamples; i++) {
+      out << "\n  ";
+      writeValues(out, size, [&values, i](unsigned j) { return values[i](j); }, "  ");
+      out << (i + 1 < numTestSamples ? "," : "");
+    }
+    out << "\n};\n\n";
+  }
+  out << "}\n\n";
+
+  out << "int main() {\n";
+  out << "  float output[INFER_NUM_OUTPUTS];\n";
+  out << "  float maxError = 0.0f;\n";
+  out << "  for (int i = 0; i < NUM_TEST_SAMPLES; i++) {\n";
+  out << "    infer(TEST_INPUTS[i], output);\n";
+  out << "    for (int j = 0; j < INFER_NUM_OUTPUTS; j++) {\n";
+  out << "      maxError = std::fmax(maxError, std::fabs(output[j] - TEST_OUTPUTS[i][j]));\n";
+  out << "    }\n";
+  out << "  }\n\n";
+  out << "  // Each inference reads the previous one's output, and the outputs are summed and\n";
+  out << "  // printed, so that none of the calls can be optimised away.\n";
+  out << "  float input[INFER_NUM_INPUTS];\n";
+  out << "  for (int j = 0; j < INFER_NUM_INPUTS; j++) input[j] = TEST_INPUTS[0][j];\n";
+  out << "  float checksum = 0.0f;\n";
+  out << "  auto start = std::chrono::steady_clock::now();\n";
+  out << "  for (int i = 0; i < TIMING_ITERATIONS; i++) {\n";
+  out << "    infer(input, output);\n";
+  out << "    input[i % INFER_NUM_INPUTS] += output[0] * 1e-6f;\n";
+  out << "    checksum += output[0];\n";
+  out << "  }\n";
+  out << "  std::chrono::duration<double, std::nano> elapsed = "
+      << "std::chrono::steady_clock::now() - start;\n\n";
+  out << "  bool pass = maxError <= TOLERANCE;\n";
+  out << "  std::printf(\"%s: max error %g, %.1f ns per inference (checksum %g)\\n\",\n";
+  out << "              pass ? \"PASS\" : \"FAIL\", maxError,\n";
+  out << "              elapsed.count() / TIMING_ITERATIONS, checksum);\n";
+  out << "  return pass ? 0 : 1;\n";
+  out << "}\n\n";
+  out << "#endif\n";
+}
+
+// std::exp doesn't vectorize without -ffast-math, so the generated code carries its own exp: the
+// Cephes expf range reduction and polynomial that Eigen's vectorized exp also uses. The argument
+// is clamped to where 2^n stays a normal float, the sigmoid being saturated well before that.
+// The clamp is written as conditionals rather than fmin/fmax, which only vectorize given
+// -ffinite-math-only.
+static void writeActivations(std::ostream &out) {
+  out << "inline float exp_approx(float x) {\n";
+  out << "  float t = x < -87.3f ? -87.3f : (x > 88.3f ? 88.3f : x);\n";
+  out << "  float n = std::floor(t * 1.44269504088896341f + 0.5f);\n";
+  out << "  float r = t - n * 0.693359375f + n * 2.12194440e-4f;\n";
+  out << "  float p = 1.9875691500e-4f;\n";
+  out << "  p = p * r + 1.3981999507e-3f;\n";
+  out << "  p = p * r + 8.3334519073e-3f;\n";
+  out << "  p = p * r + 4.1665795894e-2f;\n";
+  out << "  p = p * r + 1.6666665459e-1f;\n";
+  out << "  p = p * r + 5.0000001201e-1f;\n";
+  out << "  int32_t bits = ((int32_t) n + 127) << 23;\n";
+  out << "  float scale;\n";
+  out << "  std::memcpy(&scale, &bits, sizeof(scale));\n";
+  out << "  return (p * r * r + r + 1.0f) * scale;\n";
+  out << "}\n\n";
+  out << "inline float sigmoid(float x) {\n";
+  out << "  return 1.0f / (1.0f + exp_approx(-x));\n";
+  out << "}\n\n";
+}
+
+bool CodeGen::WriteSource(Network &network, std::ostream &out, unsigned numTestSamples) {
+  for (unsigned l = 0; l < network.NumLayers(); l++) {
+    if (network.GetNormalization(l) == Normalization::LAYER) {
+      return false;
+    }
+  }
+
+  const Tensor weights = network.GetInferenceWeights();
+  const unsigned numLayers = weights.NumLayers();
+  const unsigned numInputs = weights(0).cols() - 1;
+  const unsigned numOutputs = weights(numLayers - 1).rows();
+
+  out << "// Generated by vnn from a " << numInputs;
+  for (unsigned l = 0; l < numLayers; l++) {
+    out << "-" << weights(l).rows();
+  }
+  out << " network. Do not edit.\n";
+  out << "// The activation loops only vectorize given -fno-trapping-math (or -ffast-math).\n\n";
+  out << "#include <cmath>\n#include <cstdint>\n#include <cstring>\n\n";
+  out << "constexpr int INFER_NUM_INPUTS = " << numInputs << ";\n";
+  out << "constexpr int INFER_NUM_OUTPUTS = " << numOutputs << ";\n\n";
+
+  out << "namespace {\n\n";
+  for (unsigned l = 0; l < numLayers; l++) {
+    if (weights(l).size() > MAX_UNROLLED_WEIGHTS) {
+      writeLayerConstants(out, l, weights(l));
+    }
+  }
+  writeActivations(out);
+  out << "}\n\n";
+
+  const Loss loss = network.GetLoss();
+  out << "void infer(const float *input, float *output) {\n";
+  for (unsigned l = 0; l < numLayers; l++) {
+    const string in = activationName((int) l - 1);
+    const string result = l == numLayers - 1 ? "output" : activationName(l);
+    const bool sigmoid = l < numLayers - 1 || loss.type == LossType::BINARY_CROSS_ENTROPY;
+    if (l < numLayers - 1) {
+      out << "  float " << result << "[" << weights(l).rows() << "];\n";
+    }
+
+    if (weights(l).size() > MAX_UNROLLED_WEIGHTS) {
+      writeLoopLayer(out, l, weights(l), in, result, sigmoid);
+    } else {
+      writeUnrolledLayer(out, weights(l), in, result, sigmoid);
+    }
+    out << (l < numLayers - 1 ? "\n" : "");
+  }
+  writeOutputActivation(out, loss, numOutputs);
+  out << "}\n\n";
+
+  writeSelfTest(out, network, weights, numTestSamples);
+  return true;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "common/Common.hpp"
+#include "neuralnetwork/Network.hpp"
+#include <ostream>
+
+
+// Ahead of time compilation of trained networks into standalone C++, for deployments too small
+// for Eigen and the thread pool.
+namespace CodeGen {
+
+  // Writes a self contained C++11 source file, using only the standard library, defining
+  //   void infer(const float *input, float *output);
+  // which computes network.Process for the network's current weights. The weights are compiled
+  // in as constants: small layers are fully unrolled with the weights folded into the code (zero
+  // weights, as after pruning, dropping out entirely), larger layers are fixed size loops over
+  // constexpr arrays laid out for the compiler to vectorize (the activations given
+  // -fno-trapping-math).
+  //
+  // Compiled with -DVNN_SELF_TEST the file also defines a main that checks infer against the
+  // outputs of network.Process for numTestSamples random inputs, exiting non-zero on a mismatch,
+  // and reports the time per inference.
+  //
+  // Batch normalization is compiled in folded into the weights, but layer normalization isn't
+  // supported: for a network with any, nothing is written and false is returned.
+  bool WriteSource(Network &network, std::ostream &out, unsigned numTestSamples = 16);
+
+}
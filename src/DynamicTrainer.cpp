@@ -1,8 +1,8 @@
 
 #include "DynamicTrainer.hpp"
+#include "Autotuner.hpp"
 #include <cassert>
 #include <iostream>
-#include <random>
 
 
 DynamicTrainer::DynamicTrainer(float startLearnRate,
@@ -12,51 +12,82 @@ DynamicTrainer::DynamicTrainer(float startLearnRate,
     startLearnRate(startLearnRate),
     maxLearnRate(maxLearnRate),
     momentumAmount(momentumAmount),
-    stochasticSamples(stochasticSamples) {
+    stochasticSamples(stochasticSamples),
+    rnd(Random::NewStream()),
+    network(nullptr),
+    trainingSamples(nullptr),
+    compressedSamples(nullptr),
+    importanceMix(0.0f),
+    importanceExponent(1.0f) {
 
   assert(startLearnRate > 0.0f);
   assert(maxLearnRate > 0.0f);
   assert(momentumAmount >= 0.0f && momentumAmount < 1.0f);
   assert(stochasticSamples > 0);
-
-  random_device rd;
-  this->rnd = mt19937(rd());
 }
 
-void DynamicTrainer::Train(
-    Network &network, vector<TrainingSample> &trainingSamples, unsigned iterations) {
-
-  shuffle(trainingSamples.begin(), trainingSamples.end(), rnd);
-  numCompletePasses = 0;
-  curSamplesIndex = 0;
-  curSamplesOffset = 0;
-
-  curLearnRate = startLearnRate;
-  prevSampleError = 0.0f;
-
-  Tensor momentum;
-  for (unsigned i = 0; i < iterations; i++) {
-    // if (i%1000 == 0) {
-    //   cout << i << "/" << iterations << endl;
-    // }
+void DynamicTrainer::EnableImportanceSampling(float uniformMix, float weightExponent) {
+  assert(uniformMix > 0.0f && uniformMix <= 1.0f);
+  importanceMix = uniformMix;
+  importanceExponent = weightExponent;
+}
 
-    TrainingProvider samplesProvider = getStochasticSamples(trainingSamples);
-    pair<Tensor, float> gradientError = network.ComputeGradient(samplesProvider);
+void DynamicTrainer::Start(Network &network,
+                           const vector<TrainingSample> &trainingSamples,
+                           unsigned iterations) {
+  this->trainingSamples = &trainingSamples;
+  this->compressedSamples = nullptr;
+  this->numTrainingSamples = trainingSamples.size();
+  start(network);
+}
 
-    gradientError.first *= -curLearnRate;
+void DynamicTrainer::Start(Network &network,
+                           const CompressedDataset &trainingSamples,
+                           unsigned iterations) {
+  this->trainingSamples = nullptr;
+  this->compressedSamples = &trainingSamples;
+  this->numTrainingSamples = trainingSamples.NumSamples();
+  start(network);
+}
 
-    if (i == 0) {
-      momentum = gradientError.first;
-    } else {
-      momentum = momentum*momentumAmount + gradientError.first*(1.0f - momentumAmount);
-    }
+float DynamicTrainer::Step(void) {
+  assert(network != nullptr);
+  const bool isFirst = curIter == 0;
+
+  TrainingProvider samplesProvider = getStochasticSamples();
+  float sampleError = network->ComputeAndApplyGradient(samplesProvider,
+      [this, isFirst](unsigned layer, Matrix &gradient, const vector<unsigned> &columns) {
+        gradient *= -curLearnRate;
+
+        if (columns.empty()) {
+          applyMomentum(momentum(layer), gradient, isFirst);
+        } else {
+          // Sparse gradients only update the momentum of the columns they touch.
+          for (unsigned c = 0; c < columns.size(); c++) {
+            applyMomentum(momentum(layer).col(columns[c]), gradient.col(c), isFirst);
+          }
+        }
+      });
+
+  if (sampler) {
+    sampler->Update(batchIndices, batchLosses);
+  }
+  updateLearnRate(sampleError);
+  curIter++;
+  return sampleError;
+}
 
-    network.ApplyUpdate(momentum);
-    updateLearnRate(i, iterations, gradientError.second);
+template<typename M, typename G>
+void DynamicTrainer::applyMomentum(M &&momentum, G &&update, bool isFirst) {
+  if (isFirst) {
+    momentum = update;
+  } else {
+    momentum = momentum*momentumAmount + update*(1.0f - momentumAmount);
+    update = momentum;
   }
 }
 
-void DynamicTrainer::updateLearnRate(unsigned curIter, unsigned iterations, float sampleError) {
+void DynamicTrainer::updateLearnRate(float sampleError) {
   if (curIter > 0) {
     if (sampleError < prevSampleError) {
       curLearnRate *= 1.1f;
@@ -69,20 +100,62 @@ void DynamicTrainer::updateLearnRate(unsigned curIter, unsigned iterations, floa
   prevSampleError = sampleError;
 }
 
-TrainingProvider DynamicTrainer::getStochasticSamples(vector<TrainingSample> &allSamples) {
-  unsigned numSamples = min<unsigned>(allSamples.size(), stochasticSamples);
+void DynamicTrainer::start(Network &network) {
+  this->network = &network;
+  Autotuner::ApplyCached(network, stochasticSamples);
+
+  sampleOrder.resize(numTrainingSamples);
+  for (unsigned i = 0; i < sampleOrder.size(); i++) {
+    sampleOrder[i] = i;
+  }
+  shuffle(sampleOrder.begin(), sampleOrder.end(), rnd);
+
+  curIter = 0;
+  numCompletePasses = 0;
+  curSamplesIndex = 0;
+  curSamplesOffset = 0;
+
+  curLearnRate = startLearnRate;
+  prevSampleError = 0.0f;
+
+  // Only the shape of the weights is needed.
+  momentum = network.GetWeights();
+  momentum *= 0.0f;
+
+  sampler.reset();
+  if (importanceMix > 0.0f) {
+    sampler = make_unique<ImportanceSampler>(numTrainingSamples, importanceMix,
+                                             importanceExponent);
+  }
+}
+
+TrainingProvider DynamicTrainer::getStochasticSamples(void) {
+  unsigned numSamples = min<unsigned>(numTrainingSamples, stochasticSamples);
+
+  if (sampler) {
+    sampler->Sample(numSamples, rnd, batchIndices, batchWeights);
+    batchLosses.resize(numSamples);
+
+    auto result = compressedSamples ? TrainingProvider(*compressedSamples, batchIndices)
+                                    : TrainingProvider(*trainingSamples, batchIndices);
+    result.SetImportance(batchWeights.data(), batchLosses.data());
+    return result;
+  }
 
-  if ((curSamplesIndex + numSamples) > allSamples.size()) {
+  if ((curSamplesIndex + numSamples) > numTrainingSamples) {
     if (numCompletePasses%10 == 0) {
-      shuffle(allSamples.begin(), allSamples.end(), rnd);
+      shuffle(sampleOrder.begin(), sampleOrder.end(), rnd);
     } else {
-      curSamplesOffset = rnd() % allSamples.size();
+      curSamplesOffset = rnd() % numTrainingSamples;
     }
     curSamplesIndex = 0;
     numCompletePasses++;
   }
 
-  auto result = TrainingProvider(allSamples, numSamples, curSamplesIndex + curSamplesOffset);
+  const unsigned offset = curSamplesIndex + curSamplesOffset;
+  auto result = compressedSamples
+      ? TrainingProvider(*compressedSamples, sampleOrder, numSamples, offset)
+      : TrainingProvider(*trainingSamples, sampleOrder, numSamples, offset);
   curSamplesIndex += numSamples;
 
   return result;
@@ -1,8 +1,9 @@
 #pragma once
 
+#include "ImportanceSampler.hpp"
 #include "Trainer.hpp"
 #include "neuralnetwork/TrainingProvider.hpp"
-#include <random>
+#include "util/Random.hpp"
 
 class DynamicTrainer : public Trainer {
 public:
@@ -14,8 +15,19 @@ public:
 
   virtual ~DynamicTrainer() = default;
 
-  void Train(
-      Network &network, vector<TrainingSample> &trainingSamples, unsigned iterations) override;
+  // Draws each minibatch through an ImportanceSampler rather than walking a shuffled order of the
+  // samples, taking effect from the next Start.
+  void EnableImportanceSampling(
+      float uniformMix = ImportanceSampler::DEFAULT_UNIFORM_MIX,
+      float weightExponent = ImportanceSampler::DEFAULT_WEIGHT_EXPONENT);
+
+  void Start(Network &network,
+             const vector<TrainingSample> &trainingSamples,
+             unsigned iterations) override;
+  void Start(Network &network,
+             const CompressedDataset &trainingSamples,
+             unsigned iterations) override;
+  float Step(void) override;
 
 private:
 
@@ -24,14 +36,35 @@ private:
   const float momentumAmount;
   const unsigned stochasticSamples;
 
-  mt19937 rnd;
+  PhiloxRng rnd;
+
+  Network *network;
+  const vector<TrainingSample> *trainingSamples;
+  const CompressedDataset *compressedSamples;
+  unsigned numTrainingSamples;
+  vector<unsigned> sampleOrder;
+  Tensor momentum;
 
+  // With importance sampling, the sampler and the current minibatch.
+  float importanceMix;
+  float importanceExponent;
+  uptr<ImportanceSampler> sampler;
+  vector<unsigned> batchIndices;
+  vector<float> batchWeights;
+  vector<float> batchLosses;
+
+  unsigned curIter;
   unsigned numCompletePasses;
   unsigned curSamplesIndex;
   unsigned curSamplesOffset;
   float curLearnRate;
   float prevSampleError;
 
-  void updateLearnRate(unsigned curIter, unsigned iterations, float sampleError);
-  TrainingProvider getStochasticSamples(vector<TrainingSample> &allSamples);
+  // Blends the update into the momentum and replaces the update with the new momentum.
+  template<typename M, typename G>
+  void applyMomentum(M &&momentum, G &&update, bool isFirst);
+
+  void updateLearnRate(float sampleError);
+  void start(Network &network);
+  TrainingProvider getStochasticSamples(void);
 };
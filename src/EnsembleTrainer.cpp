@@ -0,0 +1,103 @@
+
+#include "EnsembleTrainer.hpp"
+#include <algorithm>
+#include <cassert>
+
+
+EnsembleTrainer::EnsembleTrainer(
+    const vector<EnsembleModelParams> &modelParams, unsigned stochasticSamples) :
+    modelParams(modelParams),
+    stochasticSamples(stochasticSamples),
+    rnd(Random::NewStream()) {
+
+  assert(!modelParams.empty());
+  assert(stochasticSamples > 0);
+  assert(all_of(modelParams.begin(), modelParams.end(), [](const EnsembleModelParams &mp) {
+    return mp.startLearnRate > 0.0f && mp.maxLearnRate > 0.0f &&
+        mp.momentumAmount >= 0.0f && mp.momentumAmount < 1.0f;
+  }));
+}
+
+vector<float> EnsembleTrainer::Train(
+    EnsembleNetwork &network, const vector<TrainingSample> &trainingSamples, unsigned iterations) {
+  assert(network.NumModels() == modelParams.size());
+  const unsigned numModels = network.NumModels();
+
+  sampleOrder.resize(trainingSamples.size());
+  for (unsigned i = 0; i < sampleOrder.size(); i++) {
+    sampleOrder[i] = i;
+  }
+  shuffle(sampleOrder.begin(), sampleOrder.end(), rnd);
+  curSamplesIndex = 0;
+
+  curLearnRates.clear();
+  for (const auto& mp : modelParams) {
+    curLearnRates.push_back(mp.startLearnRate);
+  }
+  prevSampleErrors.assign(numModels, 0.0f);
+
+  vector<float> sampleErrors;
+  Tensor momentum;
+  for (unsigned i = 0; i < iterations; i++) {
+    TrainingProvider samplesProvider = getStochasticSamples(trainingSamples);
+    pair<Tensor, vector<float>> gradientError = network.ComputeGradient(samplesProvider);
+    Tensor &update = gradientError.first;
+
+    if (i == 0) {
+      momentum = update * 0.0f;
+    }
+
+    // Each model owns a contiguous block of rows in every layer.
+    for (unsigned l = 0; l < network.NumLayers(); l++) {
+      const unsigned rows = network.LayerSize(l);
+
+      for (unsigned m = 0; m < numModels; m++) {
+        auto modelUpdate = update(l).middleRows(m * rows, rows);
+        auto modelMomentum = momentum(l).middleRows(m * rows, rows);
+        const float momentumAmount = modelParams[m].momentumAmount;
+
+        modelUpdate *= -curLearnRates[m];
+        if (i == 0) {
+          modelMomentum = modelUpdate;
+        } else {
+          modelMomentum = modelMomentum*momentumAmount + modelUpdate*(1.0f - momentumAmount);
+        }
+      }
+    }
+
+    network.ApplyUpdate(momentum);
+
+    sampleErrors = gradientError.second;
+    updateLearnRates(i, sampleErrors);
+  }
+
+  return sampleErrors;
+}
+
+void EnsembleTrainer::updateLearnRates(unsigned curIter, const vector<float> &sampleErrors) {
+  if (curIter > 0) {
+    for (unsigned m = 0; m < curLearnRates.size(); m++) {
+      if (sampleErrors[m] < prevSampleErrors[m]) {
+        curLearnRates[m] = min<float>(curLearnRates[m] * 1.1f, modelParams[m].maxLearnRate);
+      } else {
+        curLearnRates[m] *= 0.95f;
+      }
+    }
+  }
+
+  prevSampleErrors = sampleErrors;
+}
+
+TrainingProvider EnsembleTrainer::getStochasticSamples(const vector<TrainingSample> &allSamples) {
+  unsigned numSamples = min<unsigned>(allSamples.size(), stochasticSamples);
+
+  if ((curSamplesIndex + numSamples) > allSamples.size()) {
+    shuffle(sampleOrder.begin(), sampleOrder.end(), rnd);
+    curSamplesIndex = 0;
+  }
+
+  auto result = TrainingProvider(allSamples, sampleOrder, numSamples, curSamplesIndex);
+  curSamplesIndex += numSamples;
+
+  return result;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "common/Common.hpp"
+#include "neuralnetwork/EnsembleNetwork.hpp"
+#include "neuralnetwork/TrainingProvider.hpp"
+#include "util/Random.hpp"
+#include <vector>
+
+
+// Hyperparameters of a single model in the ensemble, as for DynamicTrainer.
+struct EnsembleModelParams {
+  float startLearnRate;
+  float maxLearnRate;
+  float momentumAmount;
+};
+
+// Trains all of the models of an EnsembleNetwork on the same stochastic minibatches, each model
+// adapting its own learning rate (in the same way as DynamicTrainer) based on its own error.
+class EnsembleTrainer {
+public:
+
+  EnsembleTrainer(const vector<EnsembleModelParams> &modelParams, unsigned stochasticSamples);
+
+  // Returns the final minibatch error of each model.
+  vector<float> Train(
+      EnsembleNetwork &network, const vector<TrainingSample> &trainingSamples, unsigned iterations);
+
+private:
+
+  const vector<EnsembleModelParams> modelParams;
+  const unsigned stochasticSamples;
+
+  PhiloxRng rnd;
+
+  vector<unsigned> sampleOrder;
+  unsigned curSamplesIndex;
+  vector<float> curLearnRates;
+  vector<float> prevSampleErrors;
+
+  void updateLearnRates(unsigned curIter, const vector<float> &sampleErrors);
+  TrainingProvider getStochasticSamples(const vector<TrainingSample> &allSamples);
+};
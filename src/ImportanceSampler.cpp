@@ -0,0 +1,64 @@
+
+#include "ImportanceSampler.hpp"
+#include <cassert>
+#include <cmath>
+
+
+// Keeps well learned samples from being starved of the chance to show they've been forgotten.
+static const double MIN_LOSS = 1e-6;
+
+ImportanceSampler::ImportanceSampler(unsigned numSamples, float uniformMix,
+                                     float weightExponent) :
+    losses(numSamples, 1.0),
+    uniformMix(uniformMix),
+    weightExponent(weightExponent) {
+  assert(numSamples > 0);
+  assert(uniformMix > 0.0f && uniformMix <= 1.0f);
+  assert(weightExponent >= 0.0f && weightExponent <= 1.0f);
+}
+
+void ImportanceSampler::Sample(unsigned batchSize, PhiloxRng &rng, vector<unsigned> &indices,
+                               vector<float> &weights) {
+  const unsigned numSamples = losses.Size();
+  const double total = losses.Total();
+  const double stratum = total / batchSize;
+
+  // Drawn together, as the generator is far faster filling an array than one value at a time.
+  uniforms.resize(2 * batchSize);
+  rng.FillUniform(uniforms.data(), uniforms.size(), 0.0f, 1.0f);
+
+  // The draws from the tree are searched for together, see SumTree::Find.
+  points.clear();
+  treeDraws.clear();
+  indices.resize(batchSize);
+  for (unsigned i = 0; i < batchSize; i++) {
+    const float choice = uniforms[2 * i], point = uniforms[2 * i + 1];
+    if (choice < uniformMix) {
+      indices[i] = min<unsigned>(numSamples - 1, point * numSamples);
+    } else {
+      points.push_back((i + point) * stratum);
+      treeDraws.push_back(i);
+    }
+  }
+
+  found.resize(points.size());
+  losses.Find(points.data(), points.size(), found.data());
+  for (unsigned i = 0; i < treeDraws.size(); i++) {
+    indices[treeDraws[i]] = found[i];
+  }
+
+  weights.resize(batchSize);
+  for (unsigned i = 0; i < batchSize; i++) {
+    const double p = (1.0 - uniformMix) * losses.Get(indices[i]) / total +
+                     uniformMix / numSamples;
+    const double weight = 1.0 / (numSamples * p);
+    weights[i] = weightExponent == 1.0f ? weight : pow(weight, (double) weightExponent);
+  }
+}
+
+void ImportanceSampler::Update(const vector<unsigned> &indices, const vector<float> &losses) {
+  assert(indices.size() == losses.size());
+  for (unsigned i = 0; i < indices.size(); i++) {
+    this->losses.Set(indices[i], max<double>(MIN_LOSS, losses[i]));
+  }
+}
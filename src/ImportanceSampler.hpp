@@ -0,0 +1,48 @@
+#pragma once
+
+#include "common/Common.hpp"
+#include "common/SumTree.hpp"
+#include "util/Random.hpp"
+#include <vector>
+
+
+// Draws minibatches with probabilities proportional to each sample's latest loss, so that training
+// concentrates on the samples not yet learned rather than spending most of each minibatch on ones
+// contributing next to nothing to the gradient. Each drawn sample comes with an importance weight
+// 1 / (n * p) for its probability p of being drawn out of n samples, which makes the weighted mean
+// gradient an unbiased estimate of the mean gradient over all of the samples. The losses are kept
+// in a SumTree, so drawing a sample or updating its loss takes O(log n).
+class ImportanceSampler {
+public:
+
+  static constexpr float DEFAULT_UNIFORM_MIX = 0.1f;
+  static constexpr float DEFAULT_WEIGHT_EXPONENT = 1.0f;
+
+  // A uniformMix fraction of the probabilities is spread evenly over the samples, so that every
+  // sample's loss keeps being refreshed and no weight exceeds 1 / uniformMix. Samples start with a
+  // loss of 1 until first drawn, so the first draws favour samples not yet seen. The importance
+  // weights are raised to weightExponent: below 1 they no longer fully undo the sampling's bias
+  // towards high loss samples, trading an unbiased gradient for faster progress on rare or hard
+  // samples (at 0, every weight is 1).
+  ImportanceSampler(unsigned numSamples, float uniformMix = DEFAULT_UNIFORM_MIX,
+                    float weightExponent = DEFAULT_WEIGHT_EXPONENT);
+
+  // Draws batchSize samples (stratified over the running total of the losses, with repeats
+  // allowed), writing their indices and importance weights.
+  void Sample(unsigned batchSize, PhiloxRng &rng, vector<unsigned> &indices,
+              vector<float> &weights);
+
+  // Records the losses of the given samples, as written by a gradient computation through
+  // TrainingProvider::SetImportance.
+  void Update(const vector<unsigned> &indices, const vector<float> &losses);
+
+private:
+  SumTree losses;
+  float uniformMix;
+  float weightExponent;
+
+  vector<float> uniforms;
+  vector<double> points;
+  vector<unsigned> treeDraws;
+  vector<unsigned> found;
+};
@@ -0,0 +1,213 @@
+
+#include "LbfgsTrainer.hpp"
+#include "Autotuner.hpp"
+#include <cassert>
+#include <cmath>
+
+
+// The Armijo condition: a step must reduce the error by at least this fraction of the reduction
+// predicted by the gradient.
+static const float SUFFICIENT_DECREASE = 1e-4f;
+static const float BACKTRACK_FACTOR = 0.5f;
+static const unsigned MAX_LINE_SEARCH_TRIALS = 20;
+
+// Steps whose gradient change barely correlates with the weight change (y . s) carry no usable
+// curvature, and would make the inverse Hessian approximation indefinite, so they're not kept.
+static const float MIN_CURVATURE = 1e-10f;
+
+static void flatten(const Tensor &tensor, Vector &flat) {
+  unsigned size = 0;
+  for (unsigned i = 0; i < tensor.NumLayers(); i++) {
+    size += tensor(i).size();
+  }
+  flat.resize(size);
+
+  unsigned offset = 0;
+  for (unsigned i = 0; i < tensor.NumLayers(); i++) {
+    flat.segment(offset, tensor(i).size()) =
+        Eigen::Map<const Vector>(tensor(i).data(), tensor(i).size());
+    offset += tensor(i).size();
+  }
+}
+
+static void unflatten(const Vector &flat, Tensor &tensor) {
+  unsigned offset = 0;
+  for (unsigned i = 0; i < tensor.NumLayers(); i++) {
+    Eigen::Map<Vector>(tensor(i).data(), tensor(i).size()) =
+        flat.segment(offset, tensor(i).size());
+    offset += tensor(i).size();
+  }
+  assert(offset == flat.size());
+}
+
+LbfgsTrainer::LbfgsTrainer(unsigned historySize) :
+    historySize(historySize),
+    network(nullptr),
+    trainingSamples(nullptr),
+    compressedSamples(nullptr) {
+
+  assert(historySize > 0);
+}
+
+void LbfgsTrainer::Start(Network &network,
+                         const vector<TrainingSample> &trainingSamples,
+                         unsigned iterations) {
+  this->trainingSamples = &trainingSamples;
+  this->compressedSamples = nullptr;
+  this->numTrainingSamples = trainingSamples.size();
+  start(network);
+}
+
+void LbfgsTrainer::Start(Network &network,
+                         const CompressedDataset &trainingSamples,
+                         unsigned iterations) {
+  this->trainingSamples = nullptr;
+  this->compressedSamples = &trainingSamples;
+  this->numTrainingSamples = trainingSamples.NumSamples();
+  start(network);
+}
+
+float LbfgsTrainer::Step(void) {
+  assert(network != nullptr);
+  if (converged) {
+    return error;
+  }
+
+  computeDirection();
+  float slope = gradient.dot(direction);
+  if (!(slope < 0.0f)) {
+    // Not a descent direction, the history no longer describes the error surface here.
+    historyLength = 0;
+    computeDirection();
+    slope = gradient.dot(direction);
+  }
+
+  // Without a history the direction is the gradient's, whose scale says nothing of how far to
+  // go, so the first trial moves the weights a distance of 1.
+  float step = historyLength > 0 ? 1.0f : 1.0f / direction.norm();
+
+  for (unsigned i = 0; i < MAX_LINE_SEARCH_TRIALS && slope < 0.0f; i++) {
+    trialWeights = weights + step * direction;
+    const float trialError = evaluate(trialWeights, trialGradient);
+
+    if (trialError <= error + SUFFICIENT_DECREASE * step * slope) {
+      addHistory(trialWeights - weights, trialGradient - gradient);
+      weights.swap(trialWeights);
+      gradient.swap(trialGradient);
+      error = trialError;
+      return error;
+    }
+    step *= BACKTRACK_FACTOR;
+  }
+
+  // No acceptable step: the network is left at the last trial's weights, so restore them. If
+  // even the steepest descent direction failed, the error can't be reduced any further (within
+  // float precision), otherwise the next step starts again from steepest descent.
+  unflatten(weights, weightShape);
+  network->SetWeights(weightShape);
+  converged = historyLength == 0;
+  historyLength = 0;
+  return error;
+}
+
+bool LbfgsTrainer::HasConverged(void) const {
+  return converged;
+}
+
+unsigned LbfgsTrainer::NumEvaluations(void) const {
+  return numEvaluations;
+}
+
+void LbfgsTrainer::start(Network &network) {
+  this->network = &network;
+  Autotuner::ApplyCached(network, numTrainingSamples);
+
+  sampleOrder.resize(numTrainingSamples);
+  for (unsigned i = 0; i < sampleOrder.size(); i++) {
+    sampleOrder[i] = i;
+  }
+
+  weightShape = network.GetWeights();
+  flatten(weightShape, weights);
+
+  Tensor weightMask = network.GetWeightMask();
+  if (weightMask.NumLayers() > 0) {
+    flatten(weightMask, mask);
+  } else {
+    mask.resize(0);
+  }
+
+  sHistory.resize(weights.size(), historySize);
+  yHistory.resize(weights.size(), historySize);
+  rho.resize(historySize);
+  alpha.resize(historySize);
+  historyStart = 0;
+  historyLength = 0;
+
+  numEvaluations = 0;
+  converged = false;
+  error = evaluate(weights, gradient);
+}
+
+float LbfgsTrainer::evaluate(const Vector &at, Vector &gradientOut) {
+  unflatten(at, weightShape);
+  network->SetWeights(weightShape);
+
+  auto samplesProvider = compressedSamples
+      ? TrainingProvider(*compressedSamples, sampleOrder, numTrainingSamples, 0)
+      : TrainingProvider(*trainingSamples, sampleOrder, numTrainingSamples, 0);
+  auto result = network->ComputeGradient(samplesProvider);
+  flatten(result.first, gradientOut);
+  if (mask.size() > 0) {
+    gradientOut.array() *= mask.array();
+  }
+
+  numEvaluations++;
+  return result.second;
+}
+
+void LbfgsTrainer::computeDirection(void) {
+  direction = -gradient;
+
+  for (unsigned i = historyLength; i-- > 0;) {
+    const unsigned c = (historyStart + i) % historySize;
+    alpha(c) = rho(c) * sHistory.col(c).dot(direction);
+    direction -= alpha(c) * yHistory.col(c);
+  }
+
+  if (historyLength > 0) {
+    // Scales the initial inverse Hessian to the curvature along the latest step.
+    const unsigned latest = (historyStart + historyLength - 1) % historySize;
+    direction *= 1.0f / (rho(latest) * yHistory.col(latest).squaredNorm());
+  }
+
+  for (unsigned i = 0; i < historyLength; i++) {
+    const unsigned c = (historyStart + i) % historySize;
+    const float beta = rho(c) * yHistory.col(c).dot(direction);
+    direction += (alpha(c) - beta) * sHistory.col(c);
+  }
+
+  if (mask.size() > 0) {
+    direction.array() *= mask.array();
+  }
+}
+
+void LbfgsTrainer::addHistory(const Vector &s, const Vector &y) {
+  const float curvature = y.dot(s);
+  if (!(curvature > MIN_CURVATURE * y.squaredNorm())) {
+    return;
+  }
+
+  unsigned c;
+  if (historyLength < historySize) {
+    c = (historyStart + historyLength) % historySize;
+    historyLength++;
+  } else {
+    c = historyStart;
+    historyStart = (historyStart + 1) % historySize;
+  }
+
+  sHistory.col(c) = s;
+  yHistory.col(c) = y;
+  rho(c) = 1.0f / curvature;
+}
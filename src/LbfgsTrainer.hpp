@@ -0,0 +1,88 @@
+#pragma once
+
+#include "Trainer.hpp"
+#include "neuralnetwork/TrainingProvider.hpp"
+#include <vector>
+
+
+// Full-batch L-BFGS: each step computes the gradient over the whole training set (split across
+// the thread pool like any other batch), and moves along the quasi-Newton direction given by the
+// last historySize steps, with a backtracking line search on the training error. For small
+// networks with smooth losses this converges in a few hundred steps, each one a dataset-wide
+// batch that keeps every thread busy, rather than in the ~100k minibatch steps of SGD.
+//
+// The line search relies on the gradient and error being deterministic and consistent with each
+// other, so the network shouldn't use dropout or weight decay (which the error doesn't include).
+// Every evaluation, including the line search's rejected trials, updates any batch normalization
+// running statistics, so these follow the trial weights too. Weights outside the network's weight
+// mask are held at their values.
+class LbfgsTrainer : public Trainer {
+public:
+
+  static const unsigned DEFAULT_HISTORY_SIZE = 10;
+
+  LbfgsTrainer(unsigned historySize = DEFAULT_HISTORY_SIZE);
+  virtual ~LbfgsTrainer() = default;
+
+  void Start(Network &network,
+             const vector<TrainingSample> &trainingSamples,
+             unsigned iterations) override;
+  void Start(Network &network,
+             const CompressedDataset &trainingSamples,
+             unsigned iterations) override;
+
+  // Returns the error over the whole training set after the step. Once no step along the
+  // steepest descent direction reduces the error, training has converged and further steps
+  // leave the weights as they are.
+  float Step(void) override;
+
+  bool HasConverged(void) const;
+
+  // The full-batch gradient evaluations so far, including the line search's rejected trials.
+  unsigned NumEvaluations(void) const;
+
+private:
+
+  const unsigned historySize;
+
+  Network *network;
+  const vector<TrainingSample> *trainingSamples;
+  const CompressedDataset *compressedSamples;
+  unsigned numTrainingSamples;
+  vector<unsigned> sampleOrder;
+
+  // The weights are handled as one flat vector, in the layout of this tensor's layers.
+  Tensor weightShape;
+  Vector weights;
+  Vector gradient;
+
+  // The network's weight mask in the same layout, empty without one.
+  Vector mask;
+  float error;
+
+  // The last historySize weight (s) and gradient (y) changes are the columns of these, used as a
+  // ring buffer, with rho = 1 / (y . s) for each.
+  Matrix sHistory;
+  Matrix yHistory;
+  Vector rho;
+  unsigned historyStart;
+  unsigned historyLength;
+
+  Vector direction;
+  Vector alpha;
+  Vector trialWeights;
+  Vector trialGradient;
+
+  unsigned numEvaluations;
+  bool converged;
+
+  void start(Network &network);
+
+  // Sets the network's weights to the given flat weights and computes the error and (flat)
+  // gradient over the training set, the gradient being masked.
+  float evaluate(const Vector &at, Vector &gradientOut);
+
+  // The L-BFGS two-loop recursion, the history approximating the inverse Hessian.
+  void computeDirection(void);
+  void addHistory(const Vector &s, const Vector &y);
+};
@@ -0,0 +1,108 @@
+
+#include "Pruning.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+
+// The magnitude below which the given fraction of the values fall.
+static float magnitudeThreshold(vector<float> &magnitudes, float sparsity) {
+  unsigned numPruned = (unsigned) (sparsity * magnitudes.size());
+  if (numPruned == 0) {
+    return 0.0f;
+  }
+
+  auto nth = magnitudes.begin() + (numPruned - 1);
+  nth_element(magnitudes.begin(), nth, magnitudes.end());
+  return *nth;
+}
+
+// Calls fn(column, startRow, numRows) for each group of blockRows rows of each weight column.
+template<typename Func>
+static void forEachGroup(const Matrix &layerWeights, unsigned blockRows, Func fn) {
+  for (unsigned c = 1; c < layerWeights.cols(); c++) {
+    for (unsigned r = 0; r < layerWeights.rows(); r += blockRows) {
+      fn(c, r, min<unsigned>(blockRows, layerWeights.rows() - r));
+    }
+  }
+}
+
+static float groupMagnitude(const Matrix &layerWeights, unsigned c, unsigned r, unsigned n) {
+  return layerWeights.col(c).segment(r, n).norm() / sqrtf(n);
+}
+
+// The magnitude of every group, repeated once per weight in the group so that the sparsity
+// threshold counts weights rather than groups.
+static void appendMagnitudes(const Matrix &layerWeights, unsigned blockRows, vector<float> &out) {
+  forEachGroup(layerWeights, blockRows, [&](unsigned c, unsigned r, unsigned n) {
+    out.insert(out.end(), n, groupMagnitude(layerWeights, c, r, n));
+  });
+}
+
+Tensor Pruning::MagnitudePrune(
+    Network &network, float sparsity, PruningScope scope, unsigned blockRows) {
+  assert(sparsity >= 0.0f && sparsity < 1.0f);
+  assert(blockRows > 0);
+
+  Tensor weights = network.GetWeights();
+  vector<float> thresholds;
+
+  vector<float> magnitudes;
+  if (scope == PruningScope::GLOBAL) {
+    for (unsigned l = 0; l < weights.NumLayers(); l++) {
+      appendMagnitudes(weights(l), blockRows, magnitudes);
+    }
+    thresholds.assign(weights.NumLayers(), magnitudeThreshold(magnitudes, sparsity));
+  } else {
+    for (unsigned l = 0; l < weights.NumLayers(); l++) {
+      magnitudes.clear();
+      appendMagnitudes(weights(l), blockRows, magnitudes);
+      thresholds.push_back(magnitudeThreshold(magnitudes, sparsity));
+    }
+  }
+
+  Tensor mask;
+  for (unsigned l = 0; l < weights.NumLayers(); l++) {
+    Matrix layerMask = Matrix::Ones(weights(l).rows(), weights(l).cols());
+    forEachGroup(weights(l), blockRows, [&](unsigned c, unsigned r, unsigned n) {
+      if (groupMagnitude(weights(l), c, r, n) <= thresholds[l]) {
+        layerMask.col(c).segment(r, n).setZero();
+      }
+    });
+
+    weights(l).array() *= layerMask.array();
+    mask.AddLayer(layerMask);
+  }
+
+  network.SetWeights(weights);
+  return mask;
+}
+
+void Pruning::PruneAndFinetune(Network &network, Trainer &trainer,
+                               const vector<TrainingSample> &trainingSamples, float targetSparsity,
+                               PruningScope scope, unsigned blockRows,
+                               unsigned numRounds, unsigned iterationsPerRound) {
+  assert(numRounds > 0);
+
+  for (unsigned round = 1; round <= numRounds; round++) {
+    float progress = round / (float) numRounds;
+    float sparsity = targetSparsity * (1.0f - powf(1.0f - progress, 3.0f));
+
+    network.SetWeightMask(MagnitudePrune(network, sparsity, scope, blockRows));
+    if (iterationsPerRound > 0) {
+      trainer.Train(network, trainingSamples, iterationsPerRound);
+    }
+  }
+}
+
+float Pruning::Sparsity(const Network &network) {
+  Tensor weights = network.GetWeights();
+
+  unsigned numZero = 0, numWeights = 0;
+  for (unsigned l = 0; l < weights.NumLayers(); l++) {
+    auto w = weights(l).rightCols(weights(l).cols() - 1);
+    numZero += (w.array() == 0.0f).count();
+    numWeights += w.size();
+  }
+  return numZero / (float) numWeights;
+}
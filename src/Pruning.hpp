@@ -0,0 +1,39 @@
+#pragma once
+
+#include "Trainer.hpp"
+#include "common/Common.hpp"
+#include "neuralnetwork/Network.hpp"
+#include <vector>
+
+
+enum class PruningScope {
+  // A single magnitude threshold over all of the network's weights.
+  GLOBAL,
+
+  // Each layer is pruned to the target sparsity separately.
+  PER_LAYER
+};
+
+namespace Pruning {
+
+  // Zeroes the smallest magnitude weights so that the given fraction of the weights are zero.
+  // Biases are never pruned. Weights are pruned in groups of blockRows consecutive rows of a
+  // column, ranked by their RMS magnitude. Groups of BlockCsrMatrix::BLOCK_ROWS give the sparsity
+  // the structure that SparseNetwork needs to turn it into a speedup. Returns the mask of the
+  // surviving weights (1 kept, 0 pruned).
+  Tensor MagnitudePrune(
+      Network &network, float sparsity, PruningScope scope, unsigned blockRows = 1);
+
+  // Gradual pruning: the sparsity is raised to targetSparsity over numRounds rounds on the cubic
+  // schedule of Zhu & Gupta ("To prune, or not to prune"), each round pruning and then fine-tuning
+  // for iterationsPerRound iterations with the pruned weights held at zero. The network keeps the
+  // final mask (see Network::SetWeightMask), so further training preserves the sparsity.
+  void PruneAndFinetune(Network &network, Trainer &trainer,
+                        const vector<TrainingSample> &trainingSamples, float targetSparsity,
+                        PruningScope scope, unsigned blockRows,
+                        unsigned numRounds, unsigned iterationsPerRound);
+
+  // Fraction of the network's (non-bias) weights that are zero.
+  float Sparsity(const Network &network);
+
+}
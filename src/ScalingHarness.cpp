@@ -0,0 +1,296 @@
+
+#include "ScalingHarness.hpp"
+#include "DynamicTrainer.hpp"
+#include "SimpleTrainer.hpp"
+#include "common/ThreadPool.hpp"
+#include "neuralnetwork/Network.hpp"
+#include "util/Random.hpp"
+#include "util/Timer.hpp"
+#include <cassert>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+
+
+// Every run starts from the same weights and sample order for its topology.
+static const unsigned RUN_SEED = 1234;
+
+static const unsigned TEACHER_HIDDEN = 16;
+
+// Scales the teacher's initial weights, so that its decision boundary is far from linear.
+static const float TEACHER_SHARPNESS = 4.0f;
+static const unsigned MAX_EVAL_SAMPLES = 2000;
+
+// The held out accuracy is evaluated (outside of the timed training) after every this many
+// training samples, so that the time to target is the throughput's and not the timer's.
+static const unsigned EVAL_INTERVAL_SAMPLES = 8192;
+
+static const char* const CSV_HEADER =
+    "trainer,threads,width,depth,batch_size,samples_per_second,parallel_efficiency,"
+    "seconds_to_target,final_accuracy,peak_rss_kb";
+
+// Random inputs labelled by a random teacher network, half of them 1: those where the teacher's
+// output is above its median.
+static vector<TrainingSample> syntheticSamples(unsigned howMany, unsigned numInputs) {
+  PhiloxRng &rng = Random::ThreadStream();
+  Network teacher({numInputs, TEACHER_HIDDEN, 1}, WeightInit::HE);
+  Tensor weights = teacher.GetWeights();
+  for (unsigned i = 0; i < weights.NumLayers(); i++) {
+    weights(i) *= TEACHER_SHARPNESS;
+  }
+  teacher.SetWeights(weights);
+
+  Matrix inputs(numInputs, howMany);
+  rng.FillUniform(inputs.data(), inputs.size(), -1.0f, 1.0f);
+  Matrix outputs = teacher.ProcessBatch(inputs);
+
+  vector<float> sorted(outputs.data(), outputs.data() + outputs.size());
+  nth_element(sorted.begin(), sorted.begin() + howMany / 2, sorted.end());
+  const float median = sorted[howMany / 2];
+
+  vector<TrainingSample> result;
+  result.reserve(howMany);
+  for (unsigned i = 0; i < howMany; i++) {
+    result.push_back(TrainingSample{inputs.col(i), Vector::Constant(1, outputs(0, i) > median)});
+  }
+  return result;
+}
+
+static float accuracy(Network &network, const Matrix &inputs, const Matrix &labels) {
+  Matrix outputs = network.ProcessBatch(inputs);
+  return ((outputs.array() > 0.5f).cast<float>() == labels.array()).cast<float>().mean();
+}
+
+static uptr<Trainer> makeTrainer(const string &name, unsigned batchSize) {
+  if (name == "simple") {
+    return make_unique<SimpleTrainer>(0.2f, 0.001f, batchSize);
+  }
+  assert(name == "dynamic");
+  return make_unique<DynamicTrainer>(0.5f, 0.5f, 0.25f, batchSize);
+}
+
+// Resets the kernel's peak RSS record for the process (Linux 4.0 onwards), so that each run's
+// peak is its own rather than the largest so far.
+static void resetPeakRss(void) {
+  ofstream clearRefs("/proc/self/clear_refs");
+  clearRefs << "5";
+}
+
+static unsigned long peakRssKb(void) {
+  ifstream status("/proc/self/status");
+  string line;
+  while (getline(status, line)) {
+    if (line.compare(0, 6, "VmHWM:") == 0) {
+      return stoul(line.substr(6));
+    }
+  }
+  return 0;
+}
+
+static ScalingResult trainOnce(const ScalingConfig &config, const string &trainerName,
+                               unsigned threads, unsigned width, unsigned depth,
+                               unsigned batchSize, const vector<TrainingSample> &samples,
+                               const Matrix &evalInputs, const Matrix &evalLabels) {
+  Random::Seed(RUN_SEED);
+  resetPeakRss();
+
+  vector<unsigned> layerSizes(depth + 2, width);
+  layerSizes.front() = config.numInputs;
+  layerSizes.back() = 1;
+  Network network(layerSizes);
+
+  network.SetExecutionConfig(ExecutionConfig{GradientSplit::AUTO, threads, 0, 0});
+  uptr<Trainer> trainer = makeTrainer(trainerName, batchSize);
+  trainer->Start(network, samples, config.maxIterations);
+
+  ScalingResult result{trainerName, threads, width, depth, batchSize, 0.0f, 0.0f, -1.0f, 0.0f, 0};
+  const unsigned evalInterval = max(1u, EVAL_INTERVAL_SAMPLES / batchSize);
+  unsigned iterations = 0, iterationsToTarget = 0;
+  float trainingSeconds = 0.0f;
+
+  Timer timer;
+  while (trainingSeconds < config.secondsPerRun && iterations < config.maxIterations) {
+    timer.Start();
+    trainer->Step();
+    timer.Stop();
+    trainingSeconds += timer.GetNumElapsedSeconds();
+    iterations++;
+
+    if (iterations % evalInterval == 0 || trainingSeconds >= config.secondsPerRun ||
+        iterations == config.maxIterations) {
+      result.finalAccuracy = accuracy(network, evalInputs, evalLabels);
+      if (iterationsToTarget == 0 && result.finalAccuracy >= config.targetAccuracy) {
+        iterationsToTarget = iterations;
+      }
+    }
+  }
+
+  result.samplesPerSecond = iterations * batchSize / trainingSeconds;
+  if (iterationsToTarget > 0) {
+    result.secondsToTarget = iterationsToTarget * batchSize / result.samplesPerSecond;
+  }
+  result.peakRssKb = peakRssKb();
+  return result;
+}
+
+static void computeEfficiencies(vector<ScalingResult> &results) {
+  for (auto& r : results) {
+    const ScalingResult *reference = &r;
+    for (const auto& other : results) {
+      if (other.trainer == r.trainer && other.width == r.width && other.depth == r.depth &&
+          other.batchSize == r.batchSize && other.threads < reference->threads) {
+        reference = &other;
+      }
+    }
+
+    r.parallelEfficiency = (r.samplesPerSecond / reference->samplesPerSecond) /
+                           (r.threads / (float) reference->threads);
+  }
+}
+
+static string runName(const ScalingResult &r) {
+  ostringstream name;
+  name << r.trainer << " threads " << r.threads << " width " << r.width << " depth " << r.depth
+       << " batch " << r.batchSize;
+  return name.str();
+}
+
+ScalingConfig ScalingHarness::DefaultConfig(void) {
+  const unsigned numThreads = ThreadPool::instance().NumThreads();
+  vector<unsigned> threadCounts;
+  for (unsigned threads = 1; threads < numThreads; threads *= 2) {
+    threadCounts.push_back(threads);
+  }
+  threadCounts.push_back(numThreads);
+
+  return ScalingConfig{{"simple", "dynamic"}, threadCounts, {16, 64}, {1, 2}, {32, 256},
+                       16, 20000, 0.9f, 1.0f, 1000000};
+}
+
+vector<ScalingResult> ScalingHarness::Run(const ScalingConfig &config, std::ostream *progress) {
+  assert(config.numSamples > 1);
+
+  Random::Seed(RUN_SEED);
+  vector<TrainingSample> samples = syntheticSamples(config.numSamples, config.numInputs);
+
+  // The last samples are held out for evaluation.
+  const unsigned numEval = min(MAX_EVAL_SAMPLES, config.numSamples / 5);
+  Matrix evalInputs(config.numInputs, numEval), evalLabels(1, numEval);
+  for (unsigned i = 0; i < numEval; i++) {
+    evalInputs.col(i) = samples[samples.size() - numEval + i].input;
+    evalLabels.col(i) = samples[samples.size() - numEval + i].expectedOutput;
+  }
+  samples.erase(samples.end() - numEval, samples.end());
+
+  vector<ScalingResult> results;
+  for (const string &trainer : config.trainers) {
+    for (unsigned width : config.widths) {
+      for (unsigned depth : config.depths) {
+        for (unsigned batchSize : config.batchSizes) {
+          for (unsigned threads : config.threadCounts) {
+            results.push_back(trainOnce(config, trainer, threads, width, depth, batchSize,
+                                        samples, evalInputs, evalLabels));
+
+            const ScalingResult &r = results.back();
+            if (progress) {
+              *progress << runName(r) << ": " << r.samplesPerSecond << " samples/s, accuracy "
+                        << r.finalAccuracy << ", to target "
+                        << (r.secondsToTarget < 0.0f ? "not reached"
+                                                     : to_string(r.secondsToTarget) + "s")
+                        << endl;
+            }
+          }
+        }
+      }
+    }
+  }
+
+  computeEfficiencies(results);
+  return results;
+}
+
+void ScalingHarness::WriteCsv(const vector<ScalingResult> &results, std::ostream &out) {
+  out << CSV_HEADER << "\n";
+  for (const auto& r : results) {
+    out << r.trainer << "," << r.threads << "," << r.width << "," << r.depth << ","
+        << r.batchSize << "," << r.samplesPerSecond << "," << r.parallelEfficiency << ","
+        << r.secondsToTarget << "," << r.finalAccuracy << "," << r.peakRssKb << "\n";
+  }
+}
+
+vector<ScalingResult> ScalingHarness::ReadCsv(std::istream &in) {
+  vector<ScalingResult> result;
+  string line;
+  while (getline(in, line)) {
+    if (line.empty() || line == CSV_HEADER) {
+      continue;
+    }
+
+    for (char &c : line) {
+      c = c == ',' ? ' ' : c;
+    }
+    istringstream fields(line);
+    ScalingResult r;
+    if (fields >> r.trainer >> r.threads >> r.width >> r.depth >> r.batchSize
+               >> r.samplesPerSecond >> r.parallelEfficiency >> r.secondsToTarget
+               >> r.finalAccuracy >> r.peakRssKb) {
+      result.push_back(r);
+    }
+  }
+  return result;
+}
+
+unsigned ScalingHarness::CompareToBaseline(const vector<ScalingResult> &results,
+                                           const vector<ScalingResult> &baseline,
+                                           float tolerance, std::ostream &report) {
+  auto change = [](float value, float base) {
+    ostringstream out;
+    out << showpos << round(1000.0f * (value / base - 1.0f)) / 10.0f << "%";
+    return out.str();
+  };
+
+  unsigned numRegressions = 0;
+  for (const auto& r : results) {
+    auto base = find_if(baseline.begin(), baseline.end(), [&r](const ScalingResult &b) {
+      return b.trainer == r.trainer && b.threads == r.threads && b.width == r.width &&
+             b.depth == r.depth && b.batchSize == r.batchSize;
+    });
+    if (base == baseline.end()) {
+      report << runName(r) << ": no baseline" << endl;
+      continue;
+    }
+
+    vector<string> regressions;
+    if (r.samplesPerSecond < base->samplesPerSecond * (1.0f - tolerance)) {
+      regressions.push_back("throughput");
+    }
+    const float maxSecondsToTarget = base->secondsToTarget * (1.0f + tolerance);
+    if (base->secondsToTarget >= 0.0f &&
+        (r.secondsToTarget < 0.0f || r.secondsToTarget > maxSecondsToTarget)) {
+      regressions.push_back("time to target");
+    }
+    if (r.peakRssKb > base->peakRssKb * (1.0f + tolerance)) {
+      regressions.push_back("peak rss");
+    }
+
+    report << runName(r) << ": " << r.samplesPerSecond << " samples/s ("
+           << change(r.samplesPerSecond, base->samplesPerSecond) << "), to target ";
+    if (r.secondsToTarget < 0.0f || base->secondsToTarget < 0.0f) {
+      report << (r.secondsToTarget < 0.0f ? "not reached" : to_string(r.secondsToTarget) + "s")
+             << " (baseline "
+             << (base->secondsToTarget < 0.0f ? "not reached" : "reached") << ")";
+    } else {
+      report << r.secondsToTarget << "s (" << change(r.secondsToTarget, base->secondsToTarget)
+             << ")";
+    }
+    report << ", peak rss " << r.peakRssKb << "KiB ("
+           << change(r.peakRssKb, base->peakRssKb) << ")";
+
+    for (unsigned i = 0; i < regressions.size(); i++) {
+      report << (i == 0 ? "  REGRESSION: " : ", ") << regressions[i];
+    }
+    report << endl;
+    numRegressions += regressions.size();
+  }
+  return numRegressions;
+}
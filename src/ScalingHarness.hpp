@@ -0,0 +1,74 @@
+#pragma once
+
+#include "common/Common.hpp"
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+
+// A sweep of end-to-end training runs. Every combination of trainer, thread count, hidden layer
+// width, depth and minibatch size trains a fresh network on the same synthetic dataset for
+// secondsPerRun (or maxIterations, if sooner).
+struct ScalingConfig {
+  // "simple" and/or "dynamic".
+  vector<string> trainers;
+
+  // The thread pool threads training may use. Efficiencies are relative to the fewest.
+  vector<unsigned> threadCounts;
+
+  vector<unsigned> widths;
+  vector<unsigned> depths;
+  vector<unsigned> batchSizes;
+
+  // The synthetic dataset: random inputs labelled by a random teacher network.
+  unsigned numInputs;
+  unsigned numSamples;
+
+  float targetAccuracy;
+  float secondsPerRun;
+  unsigned maxIterations;
+};
+
+struct ScalingResult {
+  string trainer;
+  unsigned threads;
+  unsigned width;
+  unsigned depth;
+  unsigned batchSize;
+
+  float samplesPerSecond;
+
+  // samplesPerSecond per thread, relative to the run with the fewest threads.
+  float parallelEfficiency;
+
+  // Training time until the held out accuracy first reached the target, negative if it didn't.
+  float secondsToTarget;
+  float finalAccuracy;
+
+  // The peak resident set size during the run, in KiB.
+  unsigned long peakRssKb;
+};
+
+// End-to-end scaling measurements of full training runs, for deciding whether a build is safe to
+// deploy: results are written as CSV, which a later build's results can be compared against.
+namespace ScalingHarness {
+
+  // The thread counts default to powers of 2 up to the thread pool size, plus the size itself.
+  ScalingConfig DefaultConfig(void);
+
+  // Runs the sweep, reporting each result to progress (if given) as it completes.
+  vector<ScalingResult> Run(const ScalingConfig &config, std::ostream *progress = nullptr);
+
+  void WriteCsv(const vector<ScalingResult> &results, std::ostream &out);
+  vector<ScalingResult> ReadCsv(std::istream &in);
+
+  // Writes a line per result that has a baseline result with the same trainer and parameters,
+  // flagging as regressions a throughput lower, or a time to target or peak RSS higher, than the
+  // baseline's by more than the tolerance (a fraction), and failing to reach a target the
+  // baseline reached. Returns the number of regressions.
+  unsigned CompareToBaseline(const vector<ScalingResult> &results,
+                             const vector<ScalingResult> &baseline, float tolerance,
+                             std::ostream &report);
+
+}
@@ -1,46 +1,85 @@
 
 #include "SimpleTrainer.hpp"
+#include "Autotuner.hpp"
 #include <cassert>
 
 
 SimpleTrainer::SimpleTrainer(float startLearnRate, float endLearnRate, unsigned stochasticSamples) :
     startLearnRate(startLearnRate),
     endLearnRate(endLearnRate),
-    stochasticSamples(stochasticSamples) {
+    stochasticSamples(stochasticSamples),
+    rnd(Random::NewStream()),
+    network(nullptr),
+    trainingSamples(nullptr),
+    compressedSamples(nullptr) {
 
   assert(startLearnRate > endLearnRate);
   assert(endLearnRate >= 0.0f);
   assert(stochasticSamples > 0);
 }
 
-void SimpleTrainer::Train(
-    Network &network, vector<TrainingSample> &trainingSamples, unsigned iterations) {
+void SimpleTrainer::Start(Network &network,
+                          const vector<TrainingSample> &trainingSamples,
+                          unsigned iterations) {
+  this->trainingSamples = &trainingSamples;
+  this->compressedSamples = nullptr;
+  this->numTrainingSamples = trainingSamples.size();
+  start(network, iterations);
+}
 
-  random_shuffle(trainingSamples.begin(), trainingSamples.end());
-  curSamplesIndex = 0;
+void SimpleTrainer::Start(Network &network,
+                          const CompressedDataset &trainingSamples,
+                          unsigned iterations) {
+  this->trainingSamples = nullptr;
+  this->compressedSamples = &trainingSamples;
+  this->numTrainingSamples = trainingSamples.NumSamples();
+  start(network, iterations);
+}
 
-  for (unsigned i = 0; i < iterations; i++) {
-    float lr = getLearnRate(i, iterations);
+float SimpleTrainer::Step(void) {
+  assert(network != nullptr);
+  float lr = getLearnRate();
 
-    TrainingProvider samplesProvider = getStochasticSamples(trainingSamples);
-    pair<Tensor, float> gradientError = network.ComputeGradient(samplesProvider);
-    network.ApplyUpdate(gradientError.first * -lr);
-  }
+  TrainingProvider samplesProvider = getStochasticSamples();
+  float sampleError = network->ComputeAndApplyGradient(samplesProvider,
+      [lr](unsigned layer, Matrix &gradient, const vector<unsigned> &columns) {
+        gradient *= -lr;
+      });
+
+  curIter++;
+  return sampleError;
 }
 
-float SimpleTrainer::getLearnRate(unsigned curIter, unsigned iterations) {
+float SimpleTrainer::getLearnRate(void) {
   return startLearnRate + (endLearnRate - startLearnRate) * curIter / (float) iterations;
 }
 
-TrainingProvider SimpleTrainer::getStochasticSamples(vector<TrainingSample> &allSamples) {
-  unsigned numSamples = min<unsigned>(allSamples.size(), stochasticSamples);
+void SimpleTrainer::start(Network &network, unsigned iterations) {
+  this->network = &network;
+  this->iterations = iterations;
+  Autotuner::ApplyCached(network, stochasticSamples);
+
+  sampleOrder.resize(numTrainingSamples);
+  for (unsigned i = 0; i < sampleOrder.size(); i++) {
+    sampleOrder[i] = i;
+  }
+  shuffle(sampleOrder.begin(), sampleOrder.end(), rnd);
+
+  curIter = 0;
+  curSamplesIndex = 0;
+}
+
+TrainingProvider SimpleTrainer::getStochasticSamples(void) {
+  unsigned numSamples = min<unsigned>(numTrainingSamples, stochasticSamples);
 
-  if ((curSamplesIndex + numSamples) >= allSamples.size()) {
-    random_shuffle(allSamples.begin(), allSamples.end());
+  if ((curSamplesIndex + numSamples) >= numTrainingSamples) {
+    shuffle(sampleOrder.begin(), sampleOrder.end(), rnd);
     curSamplesIndex = 0;
   }
 
-  auto result = TrainingProvider(allSamples, numSamples, curSamplesIndex);
+  auto result = compressedSamples
+      ? TrainingProvider(*compressedSamples, sampleOrder, numSamples, curSamplesIndex)
+      : TrainingProvider(*trainingSamples, sampleOrder, numSamples, curSamplesIndex);
   curSamplesIndex += numSamples;
 
   return result;
@@ -2,6 +2,7 @@
 
 #include "Trainer.hpp"
 #include "neuralnetwork/TrainingProvider.hpp"
+#include "util/Random.hpp"
 
 
 class SimpleTrainer : public Trainer {
@@ -10,8 +11,13 @@ public:
   SimpleTrainer(float startLearnRate, float endLearnRate, unsigned stochasticSamples);
   virtual ~SimpleTrainer() = default;
 
-  void Train(
-      Network &network, vector<TrainingSample> &trainingSamples, unsigned iterations) override;
+  void Start(Network &network,
+             const vector<TrainingSample> &trainingSamples,
+             unsigned iterations) override;
+  void Start(Network &network,
+             const CompressedDataset &trainingSamples,
+             unsigned iterations) override;
+  float Step(void) override;
 
 private:
 
@@ -19,9 +25,20 @@ private:
   const float endLearnRate;
   const unsigned stochasticSamples;
 
+  PhiloxRng rnd;
+
+  Network *network;
+  const vector<TrainingSample> *trainingSamples;
+  const CompressedDataset *compressedSamples;
+  unsigned numTrainingSamples;
+  vector<unsigned> sampleOrder;
+
+  unsigned curIter;
+  unsigned iterations;
   unsigned curSamplesIndex;
 
-  float getLearnRate(unsigned curIter, unsigned iterations);
-  TrainingProvider getStochasticSamples(vector<TrainingSample> &allSamples);
+  float getLearnRate(void);
+  void start(Network &network, unsigned iterations);
+  TrainingProvider getStochasticSamples(void);
 
 };
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "common/Common.hpp"
+#include "neuralnetwork/CompressedDataset.hpp"
 #include "neuralnetwork/Network.hpp"
 #include <vector>
 
@@ -9,7 +10,31 @@ class Trainer {
 public:
   virtual ~Trainer() {}
 
-  virtual void Train(
-      Network &network, vector<TrainingSample> &trainingSamples, unsigned iterations) = 0;
+  void Train(Network &network, const vector<TrainingSample> &trainingSamples, unsigned iterations) {
+    Start(network, trainingSamples, iterations);
+    for (unsigned i = 0; i < iterations; i++) {
+      Step();
+    }
+  }
+
+  // As above, decoding the samples as they're used.
+  void Train(Network &network, const CompressedDataset &trainingSamples, unsigned iterations) {
+    Start(network, trainingSamples, iterations);
+    for (unsigned i = 0; i < iterations; i++) {
+      Step();
+    }
+  }
+
+  // Stepwise form of Train, letting the caller interleave several trainings. The network and
+  // samples must outlive the training, the samples are never modified. Starting a network still
+  // on the default configuration applies any the Autotuner has cached for the network and the
+  // trainer's batch size.
+  virtual void Start(
+      Network &network, const vector<TrainingSample> &trainingSamples, unsigned iterations) = 0;
+  virtual void Start(
+      Network &network, const CompressedDataset &trainingSamples, unsigned iterations) = 0;
+
+  // Runs one training iteration, returning the error over the samples it used.
+  virtual float Step(void) = 0;
 
 };
@@ -0,0 +1,259 @@
+
+#include "TrainingScheduler.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+
+// How long a job runs before the runner picks the next job to run. Cancellation also takes
+// effect at the end of a quantum.
+static const auto QUANTUM = std::chrono::milliseconds(10);
+
+// Weight of the most recent step in a job's smoothed error.
+static const float ERROR_SMOOTHING = 0.05f;
+
+TrainingScheduler::TrainingScheduler(SchedulingPolicy policy, unsigned maxConcurrentJobs) :
+    policy(policy),
+    useHalving(false),
+    shutdown(false) {
+
+  assert(maxConcurrentJobs > 0);
+  for (unsigned i = 0; i < maxConcurrentJobs; i++) {
+    runners.emplace_back([this]() { runLoop(); });
+  }
+}
+
+// Unfinished jobs are abandoned once the running quanta complete.
+TrainingScheduler::~TrainingScheduler() {
+  {
+    std::unique_lock<std::mutex> lock(jobsMutex);
+    shutdown = true;
+  }
+  jobsSignal.notify_all();
+
+  for (auto& runner : runners) {
+    runner.join();
+  }
+}
+
+void TrainingScheduler::EnableSuccessiveHalving(const HalvingConfig &config) {
+  assert(config.firstRungIterations > 0);
+  assert(config.reductionFactor >= 2);
+
+  std::unique_lock<std::mutex> lock(jobsMutex);
+  assert(jobs.empty());
+  useHalving = true;
+  halvingConfig = config;
+}
+
+unsigned TrainingScheduler::Submit(const TrainingJob &job) {
+  assert(job.network && job.trainer && job.trainingSamples);
+  assert(job.iterations > 0);
+
+  auto entry = make_unique<JobEntry>();
+  entry->job = job;
+  entry->status = JobStatus{JobState::QUEUED, 0, job.iterations, 0.0f, 0.0f};
+  entry->started = false;
+  entry->running = false;
+  entry->cancelRequested = false;
+  entry->rung = 0;
+
+  unsigned jobId;
+  {
+    std::unique_lock<std::mutex> lock(jobsMutex);
+    jobId = jobs.size();
+    jobs.push_back(move(entry));
+  }
+
+  jobsSignal.notify_all();
+  return jobId;
+}
+
+void TrainingScheduler::Cancel(unsigned jobId) {
+  {
+    std::unique_lock<std::mutex> lock(jobsMutex);
+    assert(jobId < jobs.size());
+
+    JobEntry &entry = *jobs[jobId];
+    entry.cancelRequested = true;
+
+    // A running job is cancelled by its runner once the current quantum is done.
+    if (!entry.running && isActive(entry)) {
+      entry.status.state = JobState::CANCELLED;
+      promoteRungs();
+    }
+  }
+  jobsSignal.notify_all();
+}
+
+JobStatus TrainingScheduler::GetStatus(unsigned jobId) const {
+  std::unique_lock<std::mutex> lock(jobsMutex);
+  assert(jobId < jobs.size());
+  return jobs[jobId]->status;
+}
+
+void TrainingScheduler::WaitAll(void) {
+  std::unique_lock<std::mutex> lock(jobsMutex);
+  jobsSignal.wait(lock, [this]() {
+    return none_of(jobs.begin(), jobs.end(), [this](const uptr<JobEntry> &entry) {
+      return isActive(*entry);
+    });
+  });
+}
+
+void TrainingScheduler::runLoop(void) {
+  while (true) {
+    JobEntry *entry = nullptr;
+    bool needsStart;
+    unsigned maxSteps;
+    JobStatus status;
+
+    {
+      std::unique_lock<std::mutex> lock(jobsMutex);
+      jobsSignal.wait(lock, [this, &entry]() {
+        return shutdown || (entry = pickJob()) != nullptr;
+      });
+
+      if (shutdown) {
+        return;
+      }
+
+      entry->running = true;
+      entry->status.state = JobState::RUNNING;
+      needsStart = !entry->started;
+      entry->started = true;
+      maxSteps = iterationLimit(*entry) - entry->status.iterationsDone;
+      status = entry->status;
+    }
+
+    // The job's network and trainer are only touched by the runner that claimed it, so the
+    // quantum itself runs without holding the lock.
+    runQuantum(entry->job, needsStart, maxSteps, status);
+
+    {
+      std::unique_lock<std::mutex> lock(jobsMutex);
+      entry->running = false;
+      entry->status = status;
+
+      if (entry->cancelRequested) {
+        entry->status.state = JobState::CANCELLED;
+      } else if (status.iterationsDone == status.iterations) {
+        entry->status.state = JobState::FINISHED;
+      }
+      promoteRungs();
+    }
+    jobsSignal.notify_all();
+  }
+}
+
+void TrainingScheduler::runQuantum(
+    const TrainingJob &job, bool needsStart, unsigned maxSteps, JobStatus &status) {
+
+  std::unique_lock<std::mutex> pipelineLock(pipelineMutex, std::defer_lock);
+  if (job.network->GetParallelMode() == ParallelMode::PIPELINE) {
+    pipelineLock.lock();
+  }
+
+  auto start = Clock::now();
+  if (needsStart) {
+    job.trainer->Start(*job.network, *job.trainingSamples, job.iterations);
+  }
+
+  for (unsigned i = 0; i < maxSteps; i++) {
+    float sampleError = job.trainer->Step();
+
+    if (status.iterationsDone == 0) {
+      status.smoothedError = sampleError;
+    } else {
+      status.smoothedError += ERROR_SMOOTHING * (sampleError - status.smoothedError);
+    }
+    status.iterationsDone++;
+
+    if (Clock::now() - start >= QUANTUM) {
+      break;
+    }
+  }
+
+  status.trainingSeconds += std::chrono::duration<float>(Clock::now() - start).count();
+}
+
+TrainingScheduler::JobEntry* TrainingScheduler::pickJob(void) {
+  JobEntry *result = nullptr;
+
+  for (auto& entry : jobs) {
+    if (!isActive(*entry) || entry->running || entry->cancelRequested ||
+        entry->status.iterationsDone >= iterationLimit(*entry)) {
+      continue;
+    }
+
+    if (result == nullptr) {
+      result = entry.get();
+      continue;
+    }
+
+    if (policy == SchedulingPolicy::PRIORITY && entry->job.priority != result->job.priority) {
+      if (entry->job.priority > result->job.priority) {
+        result = entry.get();
+      }
+    } else if (entry->status.trainingSeconds < result->status.trainingSeconds) {
+      result = entry.get();
+    }
+  }
+
+  return result;
+}
+
+bool TrainingScheduler::isActive(const JobEntry &entry) const {
+  return entry.status.state == JobState::QUEUED || entry.status.state == JobState::RUNNING;
+}
+
+unsigned TrainingScheduler::iterationLimit(const JobEntry &entry) const {
+  if (!useHalving) {
+    return entry.job.iterations;
+  }
+
+  double rungIterations = halvingConfig.firstRungIterations *
+      pow((double) halvingConfig.reductionFactor, (double) entry.rung);
+  return (unsigned) min<double>(rungIterations, entry.job.iterations);
+}
+
+// Once every active job of the lowest rung has reached the end of it, the best of them move on
+// to the next rung and the rest are stopped.
+void TrainingScheduler::promoteRungs(void) {
+  while (useHalving) {
+    vector<JobEntry*> cohort;
+    for (auto& entry : jobs) {
+      if (!isActive(*entry)) {
+        continue;
+      }
+
+      if (!cohort.empty() && entry->rung < cohort.front()->rung) {
+        cohort.clear();
+      }
+      if (cohort.empty() || entry->rung == cohort.front()->rung) {
+        cohort.push_back(entry.get());
+      }
+    }
+
+    bool rungDone = all_of(cohort.begin(), cohort.end(), [this](const JobEntry *entry) {
+      return !entry->running && entry->status.iterationsDone >= iterationLimit(*entry);
+    });
+    if (cohort.empty() || !rungDone) {
+      return;
+    }
+
+    sort(cohort.begin(), cohort.end(), [](const JobEntry *a, const JobEntry *b) {
+      return a->status.smoothedError < b->status.smoothedError;
+    });
+
+    unsigned numKept = (cohort.size() + halvingConfig.reductionFactor - 1) /
+        halvingConfig.reductionFactor;
+    for (unsigned i = 0; i < cohort.size(); i++) {
+      if (i < numKept) {
+        cohort[i]->rung++;
+      } else {
+        cohort[i]->status.state = JobState::STOPPED_EARLY;
+      }
+    }
+  }
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "Trainer.hpp"
+#include "common/Common.hpp"
+#include "neuralnetwork/Network.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+enum class SchedulingPolicy {
+  // The runnable job that has had the least training time so far runs next.
+  FAIR_SHARE,
+
+  // The runnable job with the highest priority runs next, fair share between equal priorities.
+  PRIORITY
+};
+
+struct TrainingJob {
+  sptr<Network> network;
+  sptr<Trainer> trainer;
+
+  // Never modified by training, so may be shared between jobs.
+  sptr<const vector<TrainingSample>> trainingSamples;
+
+  unsigned iterations;
+  int priority;
+};
+
+enum class JobState {
+  QUEUED,
+  RUNNING,
+  FINISHED,
+  CANCELLED,
+  STOPPED_EARLY
+};
+
+struct JobStatus {
+  JobState state;
+  unsigned iterationsDone;
+  unsigned iterations;
+
+  // Exponential moving average of the per-step sample error.
+  float smoothedError;
+  float trainingSeconds;
+};
+
+// Successive halving: every job trains for firstRungIterations, then only the best
+// 1/reductionFactor of them (by smoothed error) continue, for reductionFactor times as many
+// iterations, and so on until the survivors reach their full iteration counts.
+struct HalvingConfig {
+  unsigned firstRungIterations;
+  unsigned reductionFactor;
+};
+
+// Trains many jobs at once by interleaving their steps, each job's steps running on the shared
+// ThreadPool as usual. Up to maxConcurrentJobs jobs run a step at any one time, jobs being
+// switched every few milliseconds according to the scheduling policy.
+class TrainingScheduler {
+public:
+
+  TrainingScheduler(SchedulingPolicy policy, unsigned maxConcurrentJobs);
+  ~TrainingScheduler();
+
+  TrainingScheduler(const TrainingScheduler &) = delete;
+  TrainingScheduler& operator=(const TrainingScheduler &) = delete;
+
+  // Must be called before any jobs are submitted.
+  void EnableSuccessiveHalving(const HalvingConfig &config);
+
+  // These are thread safe. Submit returns the id used to refer to the job.
+  unsigned Submit(const TrainingJob &job);
+  void Cancel(unsigned jobId);
+  JobStatus GetStatus(unsigned jobId) const;
+
+  // Blocks until every submitted job has finished, been cancelled, or been stopped early.
+  void WaitAll(void);
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  struct JobEntry {
+    TrainingJob job;
+    JobStatus status;
+
+    bool started;
+    bool running;
+    bool cancelRequested;
+
+    // The successive halving rung the job is training towards.
+    unsigned rung;
+  };
+
+  const SchedulingPolicy policy;
+
+  bool useHalving;
+  HalvingConfig halvingConfig;
+
+  mutable std::mutex jobsMutex;
+  std::condition_variable jobsSignal;
+  vector<uptr<JobEntry>> jobs;
+  bool shutdown;
+
+  // Pipeline mode stages wait on each other from within pool tasks, so two pipelined jobs
+  // stepping at once could fill the pool with waiting stages.
+  std::mutex pipelineMutex;
+
+  vector<std::thread> runners;
+
+  void runLoop(void);
+  void runQuantum(const TrainingJob &job, bool needsStart, unsigned maxSteps, JobStatus &status);
+
+  JobEntry* pickJob(void);
+  bool isActive(const JobEntry &entry) const;
+  unsigned iterationLimit(const JobEntry &entry) const;
+  void promoteRungs(void);
+};
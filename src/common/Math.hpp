@@ -1,6 +1,11 @@
 #pragma once
 
 #include <Eigen/Dense>
+#include <Eigen/Sparse>
 
 typedef Eigen::VectorXf Vector;
 typedef Eigen::MatrixXf Matrix;
+typedef Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMajorMatrix;
+
+typedef Eigen::SparseVector<float> SparseVector;
+typedef Eigen::SparseMatrix<float> SparseMatrix;
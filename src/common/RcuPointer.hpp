@@ -0,0 +1,141 @@
+#pragma once
+
+#include "Common.hpp"
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// Publishes successive immutable versions of a T to any number of concurrent readers, which never
+// block on the publisher (epoch-based read-copy-update). A reader announces the epoch it starts
+// in by claiming a slot, then reads whatever version is current. Publishing swaps in the new
+// version, advances the epoch and retires the old version, which is only deleted once every
+// reader has moved past the epoch it was retired in. Readers only wait if more than
+// NUM_READER_SLOTS of them are reading at once.
+template<typename T>
+class RcuPointer {
+public:
+
+  static const unsigned NUM_READER_SLOTS = 64;
+
+  RcuPointer(uptr<T> initial);
+  ~RcuPointer();
+
+  RcuPointer(const RcuPointer &) = delete;
+  RcuPointer& operator=(const RcuPointer &) = delete;
+
+  // Returns fn(value) for the current version, which stays valid (and unchanged) until fn
+  // returns however many versions are published meanwhile.
+  template<typename Func>
+  auto Read(Func fn) const -> decltype(fn(std::declval<const T&>()));
+
+  // Makes value the current version. Publishers are serialized with each other, but never wait
+  // for readers: retired versions still being read are deleted by a later Publish.
+  void Publish(uptr<T> value);
+
+  // The number of versions published so far.
+  uint64_t NumPublished(void) const;
+
+private:
+  static const uint64_t IDLE = UINT64_MAX;
+
+  // Padded to a cache line each, so that readers don't contend on their announcements.
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> epoch{IDLE};
+  };
+
+  struct Retired {
+    T *value;
+    uint64_t epoch;
+  };
+
+  mutable Slot slots[NUM_READER_SLOTS];
+  std::atomic<T*> current;
+  std::atomic<uint64_t> epoch;
+
+  std::mutex publishMutex;
+  vector<Retired> retired;
+
+  unsigned claimSlot(void) const;
+  void reclaim(void);
+};
+
+template<typename T>
+RcuPointer<T>::RcuPointer(uptr<T> initial) : current(initial.release()), epoch(0) {
+  assert(current.load() != nullptr);
+}
+
+template<typename T>
+RcuPointer<T>::~RcuPointer() {
+  for (const auto& r : retired) {
+    delete r.value;
+  }
+  delete current.load();
+}
+
+template<typename T>
+template<typename Func>
+auto RcuPointer<T>::Read(Func fn) const -> decltype(fn(std::declval<const T&>())) {
+  // Releases the slot however fn exits.
+  struct SlotGuard {
+    Slot &slot;
+    ~SlotGuard() { slot.epoch.store(IDLE); }
+  } guard{slots[claimSlot()]};
+
+  // The slot was claimed (sequentially consistently) with an epoch no later than this load, so
+  // any version retired after the load is kept until the slot is released.
+  return fn(*current.load());
+}
+
+template<typename T>
+void RcuPointer<T>::Publish(uptr<T> value) {
+  assert(value != nullptr);
+  std::unique_lock<std::mutex> lock(publishMutex);
+
+  T *old = current.exchange(value.release());
+  retired.push_back(Retired{old, epoch.fetch_add(1) + 1});
+  reclaim();
+}
+
+template<typename T>
+uint64_t RcuPointer<T>::NumPublished(void) const {
+  return epoch.load();
+}
+
+// Slots are claimed by swapping in the current epoch, starting from a slot chosen by the thread
+// so that concurrent readers rarely collide.
+template<typename T>
+unsigned RcuPointer<T>::claimSlot(void) const {
+  const unsigned start = std::hash<std::thread::id>()(std::this_thread::get_id());
+  while (true) {
+    for (unsigned i = 0; i < NUM_READER_SLOTS; i++) {
+      Slot &slot = slots[(start + i) % NUM_READER_SLOTS];
+      uint64_t expected = IDLE;
+      if (slot.epoch.load(std::memory_order_relaxed) == IDLE &&
+          slot.epoch.compare_exchange_strong(expected, epoch.load())) {
+        return (start + i) % NUM_READER_SLOTS;
+      }
+    }
+    std::this_thread::yield();
+  }
+}
+
+// A version retired in epoch e can only be in use by readers that announced an earlier epoch.
+template<typename T>
+void RcuPointer<T>::reclaim(void) {
+  uint64_t oldestReader = IDLE;
+  for (const auto& slot : slots) {
+    oldestReader = min(oldestReader, slot.epoch.load());
+  }
+
+  auto firstFreed = partition(retired.begin(), retired.end(),
+                              [oldestReader](const Retired &r) { return r.epoch > oldestReader; });
+  for (auto it = firstFreed; it != retired.end(); ++it) {
+    delete it->value;
+  }
+  retired.erase(firstFreed, retired.end());
+}
@@ -0,0 +1,74 @@
+
+#include "SumTree.hpp"
+#include <cassert>
+
+
+SumTree::SumTree(unsigned size, double initialValue) : size(size), numLeaves(1) {
+  assert(size > 0);
+  assert(initialValue >= 0.0);
+
+  while (numLeaves < size) {
+    numLeaves *= 2;
+  }
+
+  nodes.resize(2 * numLeaves, 0.0);
+  fill(nodes.begin() + numLeaves, nodes.begin() + numLeaves + size, initialValue);
+  for (unsigned n = numLeaves - 1; n > 0; n--) {
+    nodes[n] = nodes[2 * n] + nodes[2 * n + 1];
+  }
+}
+
+unsigned SumTree::Size(void) const {
+  return size;
+}
+
+double SumTree::Total(void) const {
+  return nodes[1];
+}
+
+double SumTree::Get(unsigned index) const {
+  assert(index < size);
+  return nodes[numLeaves + index];
+}
+
+// The sums are recomputed from the children rather than adjusted by the change, so that rounding
+// errors don't accumulate however many updates there are.
+void SumTree::Set(unsigned index, double value) {
+  assert(index < size);
+  assert(value >= 0.0);
+
+  unsigned n = numLeaves + index;
+  nodes[n] = value;
+  for (n /= 2; n > 0; n /= 2) {
+    nodes[n] = nodes[2 * n] + nodes[2 * n + 1];
+  }
+}
+
+// Only descends into subtrees with a positive total, so points outside of [0, Total()) still end
+// at an index with a positive value.
+unsigned SumTree::Find(double point) const {
+  unsigned index;
+  Find(&point, 1, &index);
+  return index;
+}
+
+// Each level's step depends on the last, so a lone search is bound by the latency of its loads.
+// Searching for all of the points a level at a time keeps many loads in flight instead.
+void SumTree::Find(double *points, unsigned numPoints, unsigned *indices) const {
+  assert(Total() > 0.0);
+
+  fill(indices, indices + numPoints, 1);
+  for (unsigned level = 1; level < numLeaves; level *= 2) {
+    for (unsigned i = 0; i < numPoints; i++) {
+      const unsigned n = indices[i];
+      const double left = nodes[2 * n], right = nodes[2 * n + 1];
+      const bool goRight = right > 0.0 && (left <= 0.0 || points[i] >= left);
+      points[i] -= goRight ? left : 0.0;
+      indices[i] = 2 * n + goRight;
+    }
+  }
+
+  for (unsigned i = 0; i < numPoints; i++) {
+    indices[i] -= numLeaves;
+  }
+}
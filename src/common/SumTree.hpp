@@ -0,0 +1,37 @@
+#pragma once
+
+#include "Common.hpp"
+#include <vector>
+
+
+// Non-negative values indexed 0..size-1, kept in a complete binary tree of their partial sums so
+// that updating a value and finding the index at a given point of the running total (for drawing
+// an index with probability proportional to its value) both take O(log size).
+class SumTree {
+public:
+
+  SumTree(unsigned size, double initialValue = 0.0);
+
+  unsigned Size(void) const;
+  double Total(void) const;
+
+  double Get(unsigned index) const;
+  void Set(unsigned index, double value);
+
+  // The index i whose value covers the given point of the running total, ie. with the sum of the
+  // values before i at most point and the sum up to and including i above it. Points outside of
+  // [0, Total()) give the first or last index with a positive value, so that rounding never lands
+  // on a zero value. The total must be positive.
+  unsigned Find(double point) const;
+
+  // Finds each of the points (overwriting them), faster than one at a time.
+  void Find(double *points, unsigned numPoints, unsigned *indices) const;
+
+private:
+  unsigned size;
+
+  // The number of leaves, size rounded up to a power of 2. Node 1 is the root, node n has the
+  // children 2n and 2n+1, and the leaves are nodes numLeaves onwards.
+  unsigned numLeaves;
+  vector<double> nodes;
+};
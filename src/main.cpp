@@ -1,17 +1,30 @@
 
 #include <iostream>
+#include <fstream>
 #include <vector>
 #include <random>
 #include <cstdlib>
 #include <cmath>
 #include <memory>
+#include <string>
+#include <sstream>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 #include <Eigen/Dense>
 
 // #include "common/ThreadPool.hpp"
+#include "util/Random.hpp"
 #include "util/Util.hpp"
 #include "neuralnetwork/Network.hpp"
+#include "neuralnetwork/InferenceBatcher.hpp"
 #include "SimpleTrainer.hpp"
 #include "DynamicTrainer.hpp"
+#include "Benchmarks.hpp"
+#include "CodeGen.hpp"
+#include "Autotuner.hpp"
+#include "ScalingHarness.hpp"
 
 
 using namespace std;
@@ -74,15 +87,265 @@ void evaluateNetwork(Network &network, const std::vector<TrainingSample> &evalSa
   cout << "frac correct: " << (numCorrect / (float) evalSamples.size()) << endl;
 }
 
-int main() {
-  srand(1234);
+static const unsigned TRAINING_BATCH_SIZE = 500;
 
-  Network network({2, 3, 1});
-  // uptr<Trainer> trainer = make_unique<SimpleTrainer>(0.2, 0.001, 500);
-  uptr<Trainer> trainer = make_unique<DynamicTrainer>(0.5f, 0.5f, 0.25f, 500);
+void trainNetwork(Network &network) {
+  // uptr<Trainer> trainer = make_unique<SimpleTrainer>(0.2, 0.001, TRAINING_BATCH_SIZE);
+  uptr<Trainer> trainer = make_unique<DynamicTrainer>(0.5f, 0.5f, 0.25f, TRAINING_BATCH_SIZE);
 
   vector<TrainingSample> trainingSamples = getTrainingData(8000);
   trainer->Train(network, trainingSamples, 100000);
+}
+
+// Serves inference requests from stdin, one line of whitespace separated inputs per request,
+// writing the outputs to stdout in request order. Requests are submitted without waiting for
+// earlier results, so requests arriving close together are batched.
+void serve(Network &network, unsigned numInputs) {
+  BatcherConfig config;
+  config.maxBatchSize = 64;
+  config.latencyTargetMicroseconds = 1000;
+  InferenceBatcher batcher(network, config);
+
+  mutex pendingMutex;
+  condition_variable pendingSignal;
+  deque<future<Vector>> pending;
+  bool inputDone = false;
+
+  thread writer([&]() {
+    while (true) {
+      future<Vector> next;
+      {
+        unique_lock<mutex> lock(pendingMutex);
+        pendingSignal.wait(lock, [&]() { return !pending.empty() || inputDone; });
+        if (pending.empty()) {
+          return;
+        }
+        next = move(pending.front());
+        pending.pop_front();
+      }
+
+      Vector output = next.get();
+      for (unsigned i = 0; i < output.rows(); i++) {
+        cout << output(i) << (i + 1 < output.rows() ? " " : "");
+      }
+      cout << endl;
+    }
+  });
+
+  string line;
+  while (getline(cin, line)) {
+    istringstream lineStream(line);
+    vector<float> values;
+    float v;
+    while (lineStream >> v) {
+      values.push_back(v);
+    }
+
+    if (values.size() != numInputs) {
+      cerr << "expected " << numInputs << " inputs, got: " << line << endl;
+      continue;
+    }
+
+    Vector input = Eigen::Map<Vector>(values.data(), values.size());
+    {
+      unique_lock<mutex> lock(pendingMutex);
+      pending.push_back(batcher.Submit(input));
+    }
+    pendingSignal.notify_one();
+  }
+
+  {
+    unique_lock<mutex> lock(pendingMutex);
+    inputDone = true;
+  }
+  pendingSignal.notify_one();
+  writer.join();
+}
+
+static vector<unsigned> parseList(const string &list, char separator) {
+  vector<unsigned> result;
+  istringstream in(list);
+  string value;
+  while (getline(in, value, separator)) {
+    result.push_back(stoi(value));
+  }
+  return result;
+}
+
+// Tunes training of the given topology ("2-3-1" style layer sizes) for the batch size, caching
+// the result for the trainers.
+void autotune(const string &topology, unsigned batchSize) {
+  Network network(parseList(topology, '-'));
+  TuningResult result = Autotuner::TuneAndStore(network, batchSize);
+  const ExecutionConfig &execution = result.execution;
+
+  static const char* const SPLITS[] = {"auto", "samples", "intra-op"};
+  cout << Autotuner::CacheKey(network, batchSize) << ":" << endl;
+  cout << "  mode " << (result.parallelMode == ParallelMode::PIPELINE ? "pipeline" : "data")
+       << ", split " << SPLITS[(int) execution.split] << ", workers " << execution.maxWorkers
+       << ", worker batch " << execution.workerBatchSize << ", chunk work "
+       << execution.minChunkWork << endl;
+  cout << "  " << result.samplesPerSecond << " samples/s vs " << result.defaultSamplesPerSecond
+       << " by default, stored in " << Autotuner::DEFAULT_CACHE_PATH << endl;
+}
+
+// Runs the scaling sweep, writing the results to csvPath. The options (name=value) override the
+// default sweep, and with baseline=<csv> the results are compared against those in the file.
+// Returns the exit code: non-zero on a regression beyond the tolerance (10% by default).
+int scaling(const string &csvPath, const vector<string> &options) {
+  ScalingConfig config = ScalingHarness::DefaultConfig();
+  string baselinePath;
+  float tolerance = 0.1f;
+
+  for (const string &option : options) {
+    size_t equals = option.find('=');
+    const string name = option.substr(0, equals);
+    const string value = equals == string::npos ? "" : option.substr(equals + 1);
+
+    if (name == "trainers") {
+      config.trainers.clear();
+      istringstream in(value);
+      string trainer;
+      while (getline(in, trainer, ',')) {
+        if (trainer != "simple" && trainer != "dynamic") {
+          cerr << "unknown trainer: " << trainer << endl;
+          return 1;
+        }
+        config.trainers.push_back(trainer);
+      }
+    } else if (name == "threads") {
+      config.threadCounts = parseList(value, ',');
+    } else if (name == "widths") {
+      config.widths = parseList(value, ',');
+    } else if (name == "depths") {
+      config.depths = parseList(value, ',');
+    } else if (name == "batches") {
+      config.batchSizes = parseList(value, ',');
+    } else if (name == "inputs") {
+      config.numInputs = stoi(value);
+    } else if (name == "samples") {
+      config.numSamples = stoi(value);
+    } else if (name == "target") {
+      config.targetAccuracy = stof(value);
+    } else if (name == "seconds") {
+      config.secondsPerRun = stof(value);
+    } else if (name == "iterations") {
+      config.maxIterations = stoi(value);
+    } else if (name == "baseline") {
+      baselinePath = value;
+    } else if (name == "tolerance") {
+      tolerance = stof(value);
+    } else {
+      cerr << "unknown option: " << option << endl;
+      return 1;
+    }
+  }
+
+  // Read first, as the baseline may be the file being written.
+  vector<ScalingResult> baseline;
+  if (!baselinePath.empty()) {
+    ifstream in(baselinePath);
+    baseline = ScalingHarness::ReadCsv(in);
+  }
+
+  vector<ScalingResult> results = ScalingHarness::Run(config, &cout);
+  ofstream out(csvPath);
+  ScalingHarness::WriteCsv(results, out);
+
+  if (baselinePath.empty()) {
+    return 0;
+  }
+  cout << "compared to " << baselinePath << ":" << endl;
+  unsigned numRegressions = ScalingHarness::CompareToBaseline(results, baseline, tolerance, cout);
+  cout << numRegressions << " regressions" << endl;
+  return numRegressions > 0 ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+  Random::Seed(1234);
+
+  string mode(argc > 1 ? argv[1] : "");
+  if (mode == "bench-pipeline") {
+    Benchmarks::PipelineParallel();
+    return 0;
+  } else if (mode == "bench-sparse") {
+    Benchmarks::SparseInputs();
+    return 0;
+  } else if (mode == "bench-batching") {
+    Benchmarks::InferenceBatching();
+    return 0;
+  } else if (mode == "bench-cache") {
+    Benchmarks::ResultCache();
+    return 0;
+  } else if (mode == "bench-ensemble") {
+    Benchmarks::Ensemble();
+    return 0;
+  } else if (mode == "bench-sweep") {
+    Benchmarks::TrainingSweep();
+    return 0;
+  } else if (mode == "bench-pruning") {
+    Benchmarks::Pruning();
+    return 0;
+  } else if (mode == "bench-graph") {
+    Benchmarks::GraphMemory();
+    return 0;
+  } else if (mode == "bench-checkpoint") {
+    Benchmarks::Checkpointing();
+    return 0;
+  } else if (mode == "bench-softmax") {
+    Benchmarks::SoftmaxLoss();
+    return 0;
+  } else if (mode == "bench-online") {
+    Benchmarks::OnlineLearning();
+    return 0;
+  } else if (mode == "bench-compressed") {
+    Benchmarks::CompressedData();
+    return 0;
+  } else if (mode == "bench-importance") {
+    Benchmarks::ImportanceSampling();
+    return 0;
+  } else if (mode == "bench-lbfgs") {
+    Benchmarks::Lbfgs();
+    return 0;
+  } else if (mode == "bench-normalization") {
+    Benchmarks::Normalization();
+    return 0;
+  } else if (mode == "bench-layout") {
+    Benchmarks::WeightLayout();
+    return 0;
+  } else if (mode == "autotune") {
+    autotune(argc > 2 ? argv[2] : "2-3-1", argc > 3 ? atoi(argv[3]) : TRAINING_BATCH_SIZE);
+    return 0;
+  } else if (mode == "scaling" && argc > 2) {
+    return scaling(argv[2], vector<string>(argv + 3, argv + argc));
+  } else if (mode == "scaling") {
+    cerr << "usage: vnn scaling <results.csv> [baseline=<csv>] [tolerance=0.1]"
+         << " [trainers=simple,dynamic] [threads=1,2,4] [widths=16,64] [depths=1,2]"
+         << " [batches=32,256] [inputs=16]"
+         << " [samples=20000] [target=0.9] [seconds=1] [iterations=1000000]" << endl;
+    return 1;
+  } else if (mode == "codegen" && argc != 3) {
+    cerr << "usage: vnn codegen <output.cpp>" << endl;
+    return 1;
+  } else if (!mode.empty() && mode != "serve" && mode != "codegen") {
+    cerr << "unknown mode: " << mode << endl;
+    return 1;
+  }
+
+  Network network({2, 3, 1});
+  trainNetwork(network);
+
+  if (mode == "serve") {
+    serve(network, 2);
+    return 0;
+  } else if (mode == "codegen") {
+    ofstream out(argv[2]);
+    if (!CodeGen::WriteSource(network, out)) {
+      cerr << "codegen doesn't support layer normalization" << endl;
+      return 1;
+    }
+    return 0;
+  }
 
   vector<TrainingSample> evalSamples = getTrainingData(1000);
   evaluateNetwork(network, evalSamples);
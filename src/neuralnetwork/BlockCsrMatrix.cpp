@@ -0,0 +1,86 @@
+
+#include "BlockCsrMatrix.hpp"
+#include <cassert>
+
+
+const unsigned BlockCsrMatrix::BLOCK_ROWS;
+
+typedef Eigen::Matrix<float, BlockCsrMatrix::BLOCK_ROWS, 1> Strip;
+
+BlockCsrMatrix::BlockCsrMatrix(const Matrix &dense) : rows(dense.rows()), cols(dense.cols()) {
+  blockRowStart.push_back(0);
+
+  for (unsigned br = 0; br < NumBlockRows(); br++) {
+    const unsigned startRow = br * BLOCK_ROWS;
+    const unsigned numRows = min(BLOCK_ROWS, rows - startRow);
+
+    for (unsigned c = 0; c < cols; c++) {
+      auto strip = dense.col(c).segment(startRow, numRows);
+      if ((strip.array() == 0.0f).all()) {
+        continue;
+      }
+
+      blockCols.push_back(c);
+      for (unsigned r = 0; r < BLOCK_ROWS; r++) {
+        values.push_back(r < numRows ? strip(r) : 0.0f);
+      }
+    }
+    blockRowStart.push_back(blockCols.size());
+  }
+}
+
+unsigned BlockCsrMatrix::Rows(void) const {
+  return rows;
+}
+
+unsigned BlockCsrMatrix::Cols(void) const {
+  return cols;
+}
+
+unsigned BlockCsrMatrix::NumBlockRows(void) const {
+  return (rows + BLOCK_ROWS - 1) / BLOCK_ROWS;
+}
+
+unsigned BlockCsrMatrix::PaddedRows(void) const {
+  return NumBlockRows() * BLOCK_ROWS;
+}
+
+float BlockCsrMatrix::BlockDensity(void) const {
+  return blockCols.size() / (float) (NumBlockRows() * cols);
+}
+
+size_t BlockCsrMatrix::NumStoredValues(void) const {
+  return values.size();
+}
+
+size_t BlockCsrMatrix::SizeBytes(void) const {
+  return values.size() * sizeof(float) +
+      (blockCols.size() + blockRowStart.size()) * sizeof(unsigned);
+}
+
+void BlockCsrMatrix::Multiply(const RowMajorMatrix &in, RowMajorMatrix &out,
+                              unsigned startBlockRow, unsigned endBlockRow) const {
+  assert(in.rows() >= cols);
+  assert(out.rows() == PaddedRows() && out.cols() == in.cols());
+  assert(endBlockRow <= NumBlockRows());
+
+  // A single sample keeps the strip sums in registers.
+  if (in.cols() == 1) {
+    for (unsigned br = startBlockRow; br < endBlockRow; br++) {
+      Strip sum = Strip::Zero();
+      for (unsigned k = blockRowStart[br]; k < blockRowStart[br+1]; k++) {
+        sum += Eigen::Map<const Strip>(&values[k * BLOCK_ROWS]) * in(blockCols[k], 0);
+      }
+      out.middleRows(br * BLOCK_ROWS, BLOCK_ROWS) = sum;
+    }
+    return;
+  }
+
+  for (unsigned br = startBlockRow; br < endBlockRow; br++) {
+    auto outRows = out.middleRows(br * BLOCK_ROWS, BLOCK_ROWS);
+    outRows.setZero();
+    for (unsigned k = blockRowStart[br]; k < blockRowStart[br+1]; k++) {
+      outRows.noalias() += Eigen::Map<const Strip>(&values[k * BLOCK_ROWS]) * in.row(blockCols[k]);
+    }
+  }
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "../common/Common.hpp"
+#include "../common/Math.hpp"
+#include <vector>
+
+
+// A sparse matrix stored as vertical strips of BLOCK_ROWS rows by a single column, with the
+// strips of each block row (BLOCK_ROWS consecutive rows) held in CSR order. A strip is stored if
+// any of its entries is non-zero. Its values are contiguous, so each strip contributes to the
+// product with a single SIMD multiply-add per input, without the per-entry index of plain CSR.
+class BlockCsrMatrix {
+public:
+  static const unsigned BLOCK_ROWS = 8;
+
+  // Entries that are exactly zero are left out.
+  BlockCsrMatrix(const Matrix &dense);
+
+  unsigned Rows(void) const;
+  unsigned Cols(void) const;
+  unsigned NumBlockRows(void) const;
+
+  // Rows() rounded up to a whole number of block rows.
+  unsigned PaddedRows(void) const;
+
+  // Fraction of the strips that are stored, and the number of values (zeros included) they hold.
+  float BlockDensity(void) const;
+  size_t NumStoredValues(void) const;
+  size_t SizeBytes(void) const;
+
+  // Writes block rows [startBlockRow, endBlockRow) of this * in to the same rows of out. in and
+  // out hold one sample per column, stored row major so that each input row is contiguous. out
+  // must have PaddedRows() rows, and in at least Cols() rows.
+  void Multiply(const RowMajorMatrix &in, RowMajorMatrix &out,
+                unsigned startBlockRow, unsigned endBlockRow) const;
+
+private:
+  unsigned rows;
+  unsigned cols;
+
+  // The strips of block row i are [blockRowStart[i], blockRowStart[i+1]).
+  vector<unsigned> blockRowStart;
+  vector<unsigned> blockCols;
+
+  // BLOCK_ROWS values per strip.
+  vector<float> values;
+};
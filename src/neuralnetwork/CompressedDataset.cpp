@@ -0,0 +1,167 @@
+
+#include "CompressedDataset.hpp"
+#include <cassert>
+#include <cmath>
+#include <cstring>
+
+
+// Half precision floats are converted by rescaling the exponent with a float multiply (2^112 being
+// the difference of the exponent biases) rather than by branching on the kind of value, so that
+// decoding loops vectorize, and half denormals come out right for free. Infinities and NaNs aren't
+// handled, as the stored values are within [-1, 1].
+static const float HALF_TO_FLOAT_SCALE = 5.192296858534828e33f; // 2^112
+static const float FLOAT_TO_HALF_SCALE = 1.925929944387236e-34f; // 2^-112
+
+static uint16_t floatToHalf(float value) {
+  float scaled = value * FLOAT_TO_HALF_SCALE;
+  uint32_t bits;
+  memcpy(&bits, &scaled, sizeof(bits));
+
+  // Rounds to nearest by adding half of the 13 dropped mantissa bits.
+  const uint32_t sign = bits & 0x80000000u;
+  const uint32_t magnitude = bits & 0x7fffffffu;
+  return (uint16_t) ((sign >> 16) | ((magnitude + 0x1000u) >> 13));
+}
+
+CompressedDataset::CompressedDataset(const vector<TrainingSample> &samples,
+                                     FeatureEncoding encoding) :
+    numSamples(samples.size()),
+    numInputs(samples.empty() ? 0 : samples.front().input.rows()),
+    numOutputs(samples.empty() ? 0 : samples.front().expectedOutput.rows()),
+    encoding(encoding),
+    scale(numInputs, 1.0f),
+    offset(numInputs, 0.0f),
+    binaryOutputs(true) {
+
+  assert(!samples.empty());
+  assert(!samples.front().IsSparse());
+
+  Vector smallest = samples.front().input, largest = samples.front().input;
+  for (const auto& s : samples) {
+    assert(s.input.rows() == numInputs && s.expectedOutput.rows() == numOutputs);
+    smallest = smallest.cwiseMin(s.input);
+    largest = largest.cwiseMax(s.input);
+    binaryOutputs = binaryOutputs &&
+        (s.expectedOutput.array() == 0.0f || s.expectedOutput.array() == 1.0f).all();
+  }
+
+  // Constant features keep a scale of 1 and are stored as 0.
+  for (unsigned i = 0; i < numInputs; i++) {
+    const float range = largest(i) - smallest(i);
+    if (encoding == FeatureEncoding::UINT8) {
+      offset[i] = smallest(i);
+      scale[i] = range > 0.0f ? range / 255.0f : 1.0f;
+    } else {
+      offset[i] = (smallest(i) + largest(i)) / 2.0f;
+      scale[i] = range > 0.0f ? range / 2.0f : 1.0f;
+    }
+  }
+
+  if (encoding == FeatureEncoding::UINT8) {
+    quantized.resize((size_t) numSamples * numInputs);
+  } else {
+    halves.resize((size_t) numSamples * numInputs);
+  }
+
+  for (unsigned s = 0; s < numSamples; s++) {
+    const Vector &input = samples[s].input;
+    for (unsigned i = 0; i < numInputs; i++) {
+      const float normalized = (input(i) - offset[i]) / scale[i];
+      const size_t index = (size_t) s * numInputs + i;
+      if (encoding == FeatureEncoding::UINT8) {
+        quantized[index] = (uint8_t) max(0.0f, min(255.0f, roundf(normalized)));
+      } else {
+        halves[index] = floatToHalf(normalized);
+      }
+    }
+  }
+
+  if (binaryOutputs) {
+    outputBits.resize(((size_t) numSamples * numOutputs + 63) / 64);
+    for (unsigned s = 0; s < numSamples; s++) {
+      for (unsigned i = 0; i < numOutputs; i++) {
+        const size_t bit = (size_t) s * numOutputs + i;
+        if (samples[s].expectedOutput(i) == 1.0f) {
+          outputBits[bit / 64] |= 1ull << (bit % 64);
+        }
+      }
+    }
+  } else {
+    outputs.resize((size_t) numSamples * numOutputs);
+    for (unsigned s = 0; s < numSamples; s++) {
+      const Vector &output = samples[s].expectedOutput;
+      copy(output.data(), output.data() + numOutputs, &outputs[(size_t) s * numOutputs]);
+    }
+  }
+}
+
+unsigned CompressedDataset::NumSamples(void) const {
+  return numSamples;
+}
+
+unsigned CompressedDataset::NumInputs(void) const {
+  return numInputs;
+}
+
+unsigned CompressedDataset::NumOutputs(void) const {
+  return numOutputs;
+}
+
+FeatureEncoding CompressedDataset::Encoding(void) const {
+  return encoding;
+}
+
+bool CompressedDataset::HasBinaryOutputs(void) const {
+  return binaryOutputs;
+}
+
+size_t CompressedDataset::NumBytes(void) const {
+  return quantized.size() * sizeof(uint8_t) + halves.size() * sizeof(uint16_t) +
+         outputBits.size() * sizeof(uint64_t) + outputs.size() * sizeof(float) +
+         (scale.size() + offset.size()) * sizeof(float);
+}
+
+// Both loops are plain enough for the compiler to vectorize, widening 8 or 16 stored values at a
+// time to floats.
+void CompressedDataset::DecodeInput(unsigned index, float *out) const {
+  assert(index < numSamples);
+  const float *s = scale.data();
+  const float *o = offset.data();
+
+  if (encoding == FeatureEncoding::UINT8) {
+    const uint8_t *in = &quantized[(size_t) index * numInputs];
+    for (unsigned i = 0; i < numInputs; i++) {
+      out[i] = o[i] + s[i] * in[i];
+    }
+  } else {
+    const uint16_t *in = &halves[(size_t) index * numInputs];
+    for (unsigned i = 0; i < numInputs; i++) {
+      const uint32_t bits = ((uint32_t) (in[i] & 0x8000u) << 16) |
+                            ((uint32_t) (in[i] & 0x7fffu) << 13);
+      float value;
+      memcpy(&value, &bits, sizeof(value));
+      out[i] = o[i] + s[i] * (value * HALF_TO_FLOAT_SCALE);
+    }
+  }
+}
+
+void CompressedDataset::DecodeOutput(unsigned index, float *out) const {
+  assert(index < numSamples);
+  if (!binaryOutputs) {
+    memcpy(out, &outputs[(size_t) index * numOutputs], numOutputs * sizeof(float));
+    return;
+  }
+
+  const size_t firstBit = (size_t) index * numOutputs;
+  for (unsigned i = 0; i < numOutputs; i++) {
+    const size_t bit = firstBit + i;
+    out[i] = (outputBits[bit / 64] >> (bit % 64)) & 1 ? 1.0f : 0.0f;
+  }
+}
+
+TrainingSample CompressedDataset::GetSample(unsigned index) const {
+  Vector input(numInputs), output(numOutputs);
+  DecodeInput(index, input.data());
+  DecodeOutput(index, output.data());
+  return TrainingSample{input, output};
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "TrainingSample.hpp"
+#include "../common/Common.hpp"
+#include <cstdint>
+#include <vector>
+
+
+// How CompressedDataset stores each input feature. UINT8 quantizes it to 256 evenly spaced levels
+// between its smallest and largest values. FP16 shifts and scales it into [-1, 1] and stores it
+// as a half precision float, keeping about 3 significant digits whatever the feature's range.
+enum class FeatureEncoding {
+  UINT8,
+  FP16
+};
+
+// A dense training set in a quarter (UINT8) or half (FP16) of the memory of fp32 samples, each
+// input feature having its own scale and offset. Expected outputs that are all 0 or 1 are packed
+// a bit each, any others are kept as fp32. TrainingProvider decodes the samples straight into the
+// columns of a batch, so each training step also reads a fraction of the memory.
+class CompressedDataset {
+public:
+
+  CompressedDataset(const vector<TrainingSample> &samples, FeatureEncoding encoding);
+
+  unsigned NumSamples(void) const;
+  unsigned NumInputs(void) const;
+  unsigned NumOutputs(void) const;
+  FeatureEncoding Encoding(void) const;
+  bool HasBinaryOutputs(void) const;
+
+  // The memory held by the samples, in bytes.
+  size_t NumBytes(void) const;
+
+  // Write the given sample's NumInputs() input or NumOutputs() expected output values to out.
+  void DecodeInput(unsigned index, float *out) const;
+  void DecodeOutput(unsigned index, float *out) const;
+
+  TrainingSample GetSample(unsigned index) const;
+
+private:
+  unsigned numSamples;
+  unsigned numInputs;
+  unsigned numOutputs;
+  FeatureEncoding encoding;
+
+  // A feature is offset + scale * (its stored value).
+  vector<float> scale;
+  vector<float> offset;
+
+  // The features of each sample are contiguous, in one of these depending on the encoding.
+  vector<uint8_t> quantized;
+  vector<uint16_t> halves;
+
+  // Bit sample * numOutputs + i is output i of the sample, when every output is binary.
+  bool binaryOutputs;
+  vector<uint64_t> outputBits;
+  vector<float> outputs;
+};
@@ -0,0 +1,242 @@
+
+#include "EnsembleNetwork.hpp"
+#include "LayerKernels.hpp"
+#include "../common/ThreadPool.hpp"
+#include <cassert>
+#include <future>
+
+
+// The per model blocks are typically tiny, and below this many weights Eigen's coefficient based
+// product beats its general matrix product, which pays a fixed cost for packing its operands.
+static const unsigned MAX_LAZY_PRODUCT_WEIGHTS = 256;
+
+// The models have sigmoid outputs, trained with binary cross entropy.
+static const Loss ENSEMBLE_LOSS{LossType::BINARY_CROSS_ENTROPY, 1.0f};
+
+// out = a * b, or out += a * b if accumulate is set.
+template<typename A, typename B, typename Out>
+static void blockProduct(const A &a, const B &b, Out &&out, bool accumulate) {
+  bool lazy = a.size() <= MAX_LAZY_PRODUCT_WEIGHTS;
+  if (accumulate) {
+    if (lazy) {
+      out.noalias() += a.lazyProduct(b);
+    } else {
+      out.noalias() += a * b;
+    }
+  } else {
+    if (lazy) {
+      out.noalias() = a.lazyProduct(b);
+    } else {
+      out.noalias() = a * b;
+    }
+  }
+}
+
+// Applies a (non-first) layer of every model, model i's block of weights reading model i's block
+// of the previous layer's activations. The output layer is left as logits.
+static void blockForward(const Matrix &weights, const Matrix &in, Matrix &out, unsigned numModels,
+                         bool isOutput) {
+  const unsigned rows = weights.rows() / numModels;
+  const unsigned inRows = in.rows() / numModels;
+  assert(weights.cols() == (int) inRows + 1);
+
+  out.resize(weights.rows(), in.cols());
+  for (unsigned i = 0; i < numModels; i++) {
+    auto z = out.middleRows(i * rows, rows);
+    blockProduct(weights.block(i * rows, 1, rows, inRows), in.middleRows(i * inRows, inRows), z, false);
+    z.colwise() += weights.col(0).segment(i * rows, rows);
+  }
+  if (!isOutput) {
+    out = (1.0f + (-out.array()).exp()).inverse().matrix();
+  }
+}
+
+static void blockBackward(const Matrix &weights, const Matrix &delta, const Matrix &prevOut,
+                          Matrix &prevDelta, unsigned numModels) {
+  const unsigned rows = weights.rows() / numModels;
+  const unsigned inRows = prevOut.rows() / numModels;
+
+  prevDelta.resize(prevOut.rows(), delta.cols());
+  for (unsigned i = 0; i < numModels; i++) {
+    blockProduct(weights.block(i * rows, 1, rows, inRows).transpose(),
+                 delta.middleRows(i * rows, rows), prevDelta.middleRows(i * inRows, inRows), false);
+  }
+  prevDelta.array() *= prevOut.array() * (1.0f - prevOut.array());
+}
+
+static void blockAccumulateGradient(
+    const Matrix &delta, const Matrix &in, Matrix &gradient, unsigned numModels) {
+  const unsigned rows = gradient.rows() / numModels;
+  const unsigned inRows = in.rows() / numModels;
+
+  gradient.col(0) += delta.rowwise().sum();
+  for (unsigned i = 0; i < numModels; i++) {
+    // The gradient block is the same size as the weight block, and is the relevant size here.
+    auto gradientBlock = gradient.block(i * rows, 1, rows, inRows);
+    if (gradientBlock.size() <= MAX_LAZY_PRODUCT_WEIGHTS) {
+      gradientBlock.noalias() +=
+          delta.middleRows(i * rows, rows).lazyProduct(in.middleRows(i * inRows, inRows).transpose());
+    } else {
+      gradientBlock.noalias() +=
+          delta.middleRows(i * rows, rows) * in.middleRows(i * inRows, inRows).transpose();
+    }
+  }
+}
+
+EnsembleNetwork::EnsembleNetwork(
+    const vector<unsigned> &layerSizes, unsigned numModels, WeightInit weightInit) :
+    layerSizes(layerSizes), numModels(numModels) {
+  assert(layerSizes.size() >= 2);
+  assert(numModels > 0);
+
+  for (unsigned l = 0; l < NumLayers(); l++) {
+    Matrix weights(numModels * layerSizes[l+1], layerSizes[l] + 1);
+    LayerKernels::InitWeights(weights, layerSizes[l+1], weightInit);
+
+    layerWeights.AddLayer(weights);
+    zeroGradient.AddLayer(Matrix::Zero(weights.rows(), weights.cols()));
+  }
+}
+
+unsigned EnsembleNetwork::NumModels(void) const {
+  return numModels;
+}
+
+unsigned EnsembleNetwork::NumLayers(void) const {
+  return layerSizes.size() - 1;
+}
+
+unsigned EnsembleNetwork::LayerSize(unsigned layer) const {
+  assert(layer < NumLayers());
+  return layerSizes[layer + 1];
+}
+
+Matrix EnsembleNetwork::Process(const Vector &input) {
+  vector<Matrix> layerOutputs;
+  forward(input, layerOutputs);
+  LayerKernels::ActivateOutputs(layerOutputs.back(), ENSEMBLE_LOSS);
+
+  const unsigned numOutputs = layerSizes.back();
+  Matrix result(numOutputs, numModels);
+  for (unsigned i = 0; i < numModels; i++) {
+    result.col(i) = layerOutputs.back().block(i * numOutputs, 0, numOutputs, 1);
+  }
+  return result;
+}
+
+pair<Tensor, vector<float>> EnsembleNetwork::ComputeGradient(const TrainingProvider &samplesProvider) {
+  const unsigned numSamples = samplesProvider.NumSamples();
+  const unsigned numSubsets = min(ThreadPool::instance().NumThreads(), numSamples);
+
+  if (workerGradients.size() < numSubsets) {
+    workerGradients.resize(numSubsets, zeroGradient);
+  }
+  vector<vector<float>> workerErrors(numSubsets, vector<float>(numModels, 0.0f));
+
+  vector<future<void>> futures;
+  futures.reserve(numSubsets);
+
+  for (unsigned i = 0; i < numSubsets; i++) {
+    futures.push_back(ThreadPool::instance().Execute(
+        [this, &samplesProvider, &workerErrors, i, numSubsets, numSamples]() {
+      unsigned start = (i * numSamples) / numSubsets;
+      unsigned end = ((i+1) * numSamples) / numSubsets;
+
+      Tensor &gradient = workerGradients[i];
+      for (unsigned l = 0; l < gradient.NumLayers(); l++) {
+        gradient(l).setZero();
+      }
+      computeSubsetGradient(samplesProvider, start, end, gradient, workerErrors[i]);
+    }));
+  }
+
+  for (auto& f : futures) {
+    f.get();
+  }
+
+  // Reduced into the first worker's accumulator, whose layers are then swapped into the result,
+  // leaving it the result's zeroed matrices for the next call.
+  auto result = make_pair(zeroGradient, vector<float>(numModels, 0.0f));
+  for (unsigned l = 0; l < NumLayers(); l++) {
+    Matrix &layerGradient = workerGradients[0](l);
+    for (unsigned i = 1; i < numSubsets; i++) {
+      layerGradient += workerGradients[i](l);
+    }
+    layerGradient *= 1.0f / numSamples;
+    result.first(l).swap(layerGradient);
+  }
+
+  for (unsigned m = 0; m < numModels; m++) {
+    for (unsigned i = 0; i < numSubsets; i++) {
+      result.second[m] += workerErrors[i][m];
+    }
+    result.second[m] /= numSamples;
+  }
+  return result;
+}
+
+void EnsembleNetwork::ApplyUpdate(const Tensor &weightUpdates) {
+  layerWeights += weightUpdates;
+}
+
+uptr<Network> EnsembleNetwork::ExtractModel(unsigned model) const {
+  assert(model < numModels);
+
+  Tensor weights;
+  for (unsigned l = 0; l < NumLayers(); l++) {
+    weights.AddLayer(layerWeights(l).middleRows(model * LayerSize(l), LayerSize(l)));
+  }
+
+  auto result = make_unique<Network>(layerSizes);
+  result->SetWeights(weights);
+  return result;
+}
+
+void EnsembleNetwork::forward(const Matrix &inputs, vector<Matrix> &layerOutputs) const {
+  layerOutputs.resize(NumLayers());
+
+  // Every model reads the same inputs, so the stacked first layer is a single product.
+  if (NumLayers() == 1) {
+    LayerKernels::Logits(layerWeights(0), inputs, layerOutputs[0]);
+  } else {
+    LayerKernels::Forward(layerWeights(0), inputs, layerOutputs[0]);
+  }
+  for (unsigned l = 1; l < NumLayers(); l++) {
+    blockForward(layerWeights(l), layerOutputs[l-1], layerOutputs[l], numModels,
+                 l == NumLayers() - 1);
+  }
+}
+
+void EnsembleNetwork::computeSubsetGradient(const TrainingProvider &samplesProvider,
+                                            unsigned start, unsigned end,
+                                            Tensor &gradient, vector<float> &errors) const {
+  const unsigned numInputs = layerSizes.front();
+  const unsigned numOutputs = layerSizes.back();
+
+  Matrix inputs(numInputs, end - start);
+  Matrix targets(numOutputs, end - start);
+  for (unsigned i = start; i < end; i++) {
+    samplesProvider.PackInput(i, inputs.col(i - start));
+    samplesProvider.PackOutput(i, targets.col(i - start));
+  }
+
+  vector<Matrix> layerOutputs;
+  forward(inputs, layerOutputs);
+
+  vector<Matrix> layerDeltas(NumLayers());
+  Matrix &outputDelta = layerDeltas.back();
+  outputDelta.resize(layerOutputs.back().rows(), end - start);
+  Matrix modelDelta;
+  for (unsigned m = 0; m < numModels; m++) {
+    errors[m] += LayerKernels::OutputDelta(
+        layerOutputs.back().middleRows(m * numOutputs, numOutputs), targets, ENSEMBLE_LOSS,
+        modelDelta);
+    outputDelta.middleRows(m * numOutputs, numOutputs) = modelDelta;
+  }
+
+  for (unsigned l = NumLayers() - 1; l > 0; l--) {
+    blockAccumulateGradient(layerDeltas[l], layerOutputs[l-1], gradient(l), numModels);
+    blockBackward(layerWeights(l), layerDeltas[l], layerOutputs[l-1], layerDeltas[l-1], numModels);
+  }
+  LayerKernels::AccumulateGradient(layerDeltas[0], inputs, gradient(0));
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "Network.hpp"
+#include "Tensor.hpp"
+#include "TrainingProvider.hpp"
+#include "../common/Common.hpp"
+#include "../common/Math.hpp"
+#include <vector>
+
+
+// A set of independently initialised networks with the same topology, trained together on a
+// shared minibatch in a single batched pass. Each layer's weights for all of the models are
+// stacked vertically into one matrix, model i owning rows [i*LayerSize(l), (i+1)*LayerSize(l)).
+// As all models see the same inputs, the first layer of every model is computed with a single
+// matrix product, and the remaining layers as per model blocks of the stacked activations.
+class EnsembleNetwork {
+public:
+
+  EnsembleNetwork(const vector<unsigned> &layerSizes,
+                  unsigned numModels,
+                  WeightInit weightInit = WeightInit::UNIFORM);
+
+  unsigned NumModels(void) const;
+  unsigned NumLayers(void) const;
+
+  // Number of rows (neurons) each model has in the given layer.
+  unsigned LayerSize(unsigned layer) const;
+
+  // Returns the output of every model, one column per model.
+  Matrix Process(const Vector &input);
+
+  // Returns the stacked gradient of every model and each model's error, the mean binary cross
+  // entropy its sigmoid outputs are trained with.
+  pair<Tensor, vector<float>> ComputeGradient(const TrainingProvider &samplesProvider);
+  void ApplyUpdate(const Tensor &weightUpdates);
+
+  uptr<Network> ExtractModel(unsigned model) const;
+
+private:
+  const vector<unsigned> layerSizes;
+  const unsigned numModels;
+
+  Tensor layerWeights;
+  Tensor zeroGradient;
+
+  // Each worker's gradient accumulator, kept between minibatches rather than reallocated.
+  vector<Tensor> workerGradients;
+
+  // Leaves the output layer as logits.
+  void forward(const Matrix &inputs, vector<Matrix> &layerOutputs) const;
+  void computeSubsetGradient(const TrainingProvider &samplesProvider, unsigned start, unsigned end,
+                             Tensor &gradient, vector<float> &errors) const;
+};
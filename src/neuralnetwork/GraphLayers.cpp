@@ -0,0 +1,184 @@
+
+#include "GraphLayers.hpp"
+#include "LayerKernels.hpp"
+#include <cassert>
+
+
+// Writes value to target, or adds it if the target already holds another consumer's delta.
+template<typename Expr>
+static void writeDelta(const InputDelta &target, const Expr &value) {
+  if (target.accumulate) {
+    target.delta->noalias() += value;
+  } else {
+    target.delta->noalias() = value;
+  }
+}
+
+GraphLayer::GraphLayer(const vector<unsigned> &inputs, unsigned outputSize) :
+    inputs(inputs), outputSize(outputSize) {
+  assert(!inputs.empty());
+  assert(outputSize > 0);
+}
+
+GraphLayer::~GraphLayer() = default;
+
+const vector<unsigned>& GraphLayer::Inputs(void) const {
+  return inputs;
+}
+
+unsigned GraphLayer::OutputSize(void) const {
+  return outputSize;
+}
+
+Matrix GraphLayer::CreateWeights(void) const {
+  return Matrix();
+}
+
+DenseLayer::DenseLayer(
+    unsigned input, unsigned inputSize, unsigned outputSize, WeightInit weightInit) :
+    GraphLayer({input}, outputSize), inputSize(inputSize), weightInit(weightInit) {}
+
+Matrix DenseLayer::CreateWeights(void) const {
+  Matrix result(OutputSize(), inputSize + 1);
+  LayerKernels::InitWeights(result, OutputSize(), weightInit);
+  return result;
+}
+
+bool DenseLayer::BackwardReadsInputs(void) const {
+  return true;
+}
+
+bool DenseLayer::BackwardReadsOutput(void) const {
+  return false;
+}
+
+void DenseLayer::Forward(const vector<ArenaMatrix> &in, const Matrix *weights,
+                         ArenaMatrix &out) const {
+  assert(weights != nullptr && weights->cols() == in[0].rows() + 1);
+
+  out.noalias() = weights->rightCols(inputSize) * in[0];
+  out.colwise() += weights->col(0);
+}
+
+void DenseLayer::Backward(const vector<ArenaMatrix> &in, const ArenaMatrix &out,
+                          const ArenaMatrix &delta, const Matrix *weights,
+                          const vector<InputDelta> &inDeltas, Matrix *gradient) const {
+  assert(weights != nullptr && gradient != nullptr);
+
+  gradient->col(0) += delta.rowwise().sum();
+  gradient->rightCols(inputSize).noalias() += delta * in[0].transpose();
+
+  if (inDeltas[0].delta != nullptr) {
+    writeDelta(inDeltas[0], weights->rightCols(inputSize).transpose() * delta);
+  }
+}
+
+ActivationLayer::ActivationLayer(unsigned input, unsigned size, Activation activation) :
+    GraphLayer({input}, size), activation(activation) {}
+
+bool ActivationLayer::BackwardReadsInputs(void) const {
+  return false;
+}
+
+// Each derivative is computed from the output alone.
+bool ActivationLayer::BackwardReadsOutput(void) const {
+  return true;
+}
+
+void ActivationLayer::Forward(const vector<ArenaMatrix> &in, const Matrix *weights,
+                              ArenaMatrix &out) const {
+  switch (activation) {
+  case Activation::SIGMOID:
+    out = (1.0f + (-in[0].array()).exp()).inverse().matrix();
+    break;
+  case Activation::RELU:
+    out = in[0].cwiseMax(0.0f);
+    break;
+  case Activation::TANH:
+    out = in[0].array().tanh().matrix();
+    break;
+  }
+}
+
+void ActivationLayer::Backward(const vector<ArenaMatrix> &in, const ArenaMatrix &out,
+                               const ArenaMatrix &delta, const Matrix *weights,
+                               const vector<InputDelta> &inDeltas, Matrix *gradient) const {
+  if (inDeltas[0].delta == nullptr) {
+    return;
+  }
+
+  switch (activation) {
+  case Activation::SIGMOID:
+    writeDelta(inDeltas[0], (delta.array() * out.array() * (1.0f - out.array())).matrix());
+    break;
+  case Activation::RELU:
+    writeDelta(inDeltas[0], (out.array() > 0.0f).select(delta, 0.0f));
+    break;
+  case Activation::TANH:
+    writeDelta(inDeltas[0], (delta.array() * (1.0f - out.array().square())).matrix());
+    break;
+  }
+}
+
+SumLayer::SumLayer(const vector<unsigned> &inputs, unsigned size) : GraphLayer(inputs, size) {
+  assert(inputs.size() >= 2);
+}
+
+bool SumLayer::BackwardReadsInputs(void) const {
+  return false;
+}
+
+bool SumLayer::BackwardReadsOutput(void) const {
+  return false;
+}
+
+void SumLayer::Forward(const vector<ArenaMatrix> &in, const Matrix *weights,
+                       ArenaMatrix &out) const {
+  out = in[0] + in[1];
+  for (unsigned i = 2; i < in.size(); i++) {
+    out += in[i];
+  }
+}
+
+void SumLayer::Backward(const vector<ArenaMatrix> &in, const ArenaMatrix &out,
+                        const ArenaMatrix &delta, const Matrix *weights,
+                        const vector<InputDelta> &inDeltas, Matrix *gradient) const {
+  for (const auto& inDelta : inDeltas) {
+    if (inDelta.delta != nullptr) {
+      writeDelta(inDelta, delta);
+    }
+  }
+}
+
+ConcatLayer::ConcatLayer(const vector<unsigned> &inputs, unsigned outputSize) :
+    GraphLayer(inputs, outputSize) {}
+
+bool ConcatLayer::BackwardReadsInputs(void) const {
+  return false;
+}
+
+bool ConcatLayer::BackwardReadsOutput(void) const {
+  return false;
+}
+
+void ConcatLayer::Forward(const vector<ArenaMatrix> &in, const Matrix *weights,
+                          ArenaMatrix &out) const {
+  unsigned row = 0;
+  for (const auto& input : in) {
+    out.middleRows(row, input.rows()) = input;
+    row += input.rows();
+  }
+  assert(row == OutputSize());
+}
+
+void ConcatLayer::Backward(const vector<ArenaMatrix> &in, const ArenaMatrix &out,
+                           const ArenaMatrix &delta, const Matrix *weights,
+                           const vector<InputDelta> &inDeltas, Matrix *gradient) const {
+  unsigned row = 0;
+  for (unsigned i = 0; i < in.size(); i++) {
+    if (inDeltas[i].delta != nullptr) {
+      writeDelta(inDeltas[i], delta.middleRows(row, in[i].rows()));
+    }
+    row += in[i].rows();
+  }
+}
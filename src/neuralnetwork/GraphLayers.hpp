@@ -0,0 +1,125 @@
+#pragma once
+
+#include "Tensor.hpp"
+#include "../common/Common.hpp"
+#include "../common/Math.hpp"
+#include <vector>
+
+
+// A view of a buffer within a GraphNetwork's activation arena, one sample per column.
+using ArenaMatrix = Eigen::Map<Matrix, Eigen::Aligned16>;
+
+enum class Activation {
+  SIGMOID,
+  RELU,
+  TANH
+};
+
+// Where a layer's Backward writes the delta of one of its inputs. delta is null for the network
+// input, which needs none. If accumulate is set another consumer of the same input has already
+// written its share of the delta, which is added to rather than overwritten.
+struct InputDelta {
+  ArenaMatrix *delta;
+  bool accumulate;
+};
+
+// A node of a GraphNetwork, reading the outputs of the nodes listed in Inputs. Layers hold no
+// state of their own: any weights (bias in column 0) are kept by the network and passed in.
+class GraphLayer {
+public:
+  GraphLayer(const vector<unsigned> &inputs, unsigned outputSize);
+  virtual ~GraphLayer();
+
+  const vector<unsigned>& Inputs(void) const;
+  unsigned OutputSize(void) const;
+
+  // Freshly initialised weights, or an empty matrix for layers without any.
+  virtual Matrix CreateWeights(void) const;
+
+  // Whether Backward reads the layer's inputs and output, which decides how long the planner
+  // keeps those buffers alive.
+  virtual bool BackwardReadsInputs(void) const = 0;
+  virtual bool BackwardReadsOutput(void) const = 0;
+
+  virtual void Forward(const vector<ArenaMatrix> &in, const Matrix *weights,
+                       ArenaMatrix &out) const = 0;
+
+  // Propagates delta, the error gradient of the layer's output, to the layer's inputs, and adds
+  // the weight gradient to gradient for layers with weights.
+  virtual void Backward(const vector<ArenaMatrix> &in, const ArenaMatrix &out,
+                        const ArenaMatrix &delta, const Matrix *weights,
+                        const vector<InputDelta> &inDeltas, Matrix *gradient) const = 0;
+
+private:
+  const vector<unsigned> inputs;
+  const unsigned outputSize;
+};
+
+// out = weights * [1; in]
+class DenseLayer : public GraphLayer {
+public:
+  DenseLayer(unsigned input, unsigned inputSize, unsigned outputSize, WeightInit weightInit);
+
+  Matrix CreateWeights(void) const override;
+
+  bool BackwardReadsInputs(void) const override;
+  bool BackwardReadsOutput(void) const override;
+
+  void Forward(const vector<ArenaMatrix> &in, const Matrix *weights,
+               ArenaMatrix &out) const override;
+  void Backward(const vector<ArenaMatrix> &in, const ArenaMatrix &out,
+                const ArenaMatrix &delta, const Matrix *weights,
+                const vector<InputDelta> &inDeltas, Matrix *gradient) const override;
+
+private:
+  const unsigned inputSize;
+  const WeightInit weightInit;
+};
+
+// Element-wise activation function.
+class ActivationLayer : public GraphLayer {
+public:
+  ActivationLayer(unsigned input, unsigned size, Activation activation);
+
+  bool BackwardReadsInputs(void) const override;
+  bool BackwardReadsOutput(void) const override;
+
+  void Forward(const vector<ArenaMatrix> &in, const Matrix *weights,
+               ArenaMatrix &out) const override;
+  void Backward(const vector<ArenaMatrix> &in, const ArenaMatrix &out,
+                const ArenaMatrix &delta, const Matrix *weights,
+                const vector<InputDelta> &inDeltas, Matrix *gradient) const override;
+
+private:
+  const Activation activation;
+};
+
+// Element-wise sum of equally sized inputs, as for a residual connection.
+class SumLayer : public GraphLayer {
+public:
+  SumLayer(const vector<unsigned> &inputs, unsigned size);
+
+  bool BackwardReadsInputs(void) const override;
+  bool BackwardReadsOutput(void) const override;
+
+  void Forward(const vector<ArenaMatrix> &in, const Matrix *weights,
+               ArenaMatrix &out) const override;
+  void Backward(const vector<ArenaMatrix> &in, const ArenaMatrix &out,
+                const ArenaMatrix &delta, const Matrix *weights,
+                const vector<InputDelta> &inDeltas, Matrix *gradient) const override;
+};
+
+// Stacks the inputs vertically, in order.
+class ConcatLayer : public GraphLayer {
+public:
+  ConcatLayer(const vector<unsigned> &inputs, unsigned outputSize);
+
+  bool BackwardReadsInputs(void) const override;
+  bool BackwardReadsOutput(void) const override;
+
+  void Forward(const vector<ArenaMatrix> &in, const Matrix *weights,
+               ArenaMatrix &out) const override;
+  void Backward(const vector<ArenaMatrix> &in, const ArenaMatrix &out,
+                const ArenaMatrix &delta, const Matrix *weights,
+                const vector<InputDelta> &inDeltas, Matrix *gradient) const override;
+};
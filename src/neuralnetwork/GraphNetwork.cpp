@@ -0,0 +1,275 @@
+
+#include "GraphNetwork.hpp"
+#include "../common/ThreadPool.hpp"
+#include <cassert>
+#include <future>
+#include <mutex>
+
+
+const unsigned GraphNetwork::INPUT;
+
+GraphNetwork::GraphNetwork(unsigned numInputs) {
+  assert(numInputs > 0);
+  nodes.push_back(Node{nullptr, numInputs, -1, {}});
+}
+
+GraphNetwork::~GraphNetwork() = default;
+
+unsigned GraphNetwork::AddDense(unsigned input, unsigned size, WeightInit weightInit) {
+  assert(input < nodes.size());
+  return addNode(make_unique<DenseLayer>(input, nodes[input].size, size, weightInit));
+}
+
+unsigned GraphNetwork::AddActivation(unsigned input, Activation activation) {
+  assert(input < nodes.size());
+  return addNode(make_unique<ActivationLayer>(input, nodes[input].size, activation));
+}
+
+unsigned GraphNetwork::AddSum(const vector<unsigned> &inputs) {
+  for (unsigned i = 0; i < inputs.size(); i++) {
+    assert(inputs[i] < nodes.size());
+    assert(nodes[inputs[i]].size == nodes[inputs[0]].size);
+  }
+  return addNode(make_unique<SumLayer>(inputs, nodes[inputs[0]].size));
+}
+
+unsigned GraphNetwork::AddConcat(const vector<unsigned> &inputs) {
+  unsigned size = 0;
+  for (unsigned input : inputs) {
+    assert(input < nodes.size());
+    size += nodes[input].size;
+  }
+  return addNode(make_unique<ConcatLayer>(inputs, size));
+}
+
+unsigned GraphNetwork::NumNodes(void) const {
+  return nodes.size();
+}
+
+unsigned GraphNetwork::NodeSize(unsigned node) const {
+  assert(node < nodes.size());
+  return nodes[node].size;
+}
+
+Tensor GraphNetwork::GetWeights(void) const {
+  return layerWeights;
+}
+
+void GraphNetwork::SetWeights(const Tensor &weights) {
+  assert(weights.NumLayers() == layerWeights.NumLayers());
+  for (unsigned i = 0; i < weights.NumLayers(); i++) {
+    assert(weights(i).rows() == layerWeights(i).rows());
+    assert(weights(i).cols() == layerWeights(i).cols());
+  }
+  layerWeights = weights;
+}
+
+Vector GraphNetwork::Process(const Vector &input) {
+  return ProcessBatch(input);
+}
+
+Matrix GraphNetwork::ProcessBatch(const Matrix &inputs) {
+  assert(inputs.rows() == nodes[0].size);
+
+  Workspace &ws = inferenceWorkspace;
+  prepare(ws, inputs.cols(), false);
+  buffer(ws, 0, nodes[0].size) = inputs;
+  forward(ws);
+  return buffer(ws, nodes.size() - 1, nodes.back().size);
+}
+
+pair<Tensor, float> GraphNetwork::ComputeGradient(const TrainingProvider &samplesProvider) {
+  const unsigned numSamples = samplesProvider.NumSamples();
+  const unsigned numSubsets = min(ThreadPool::instance().NumThreads(), numSamples);
+  assert(numSubsets > 0);
+
+  trainingWorkspaces.resize(max<size_t>(trainingWorkspaces.size(), numSubsets));
+  auto result = make_pair(zeroGradient, 0.0f);
+
+  mutex gradientMutex;
+  vector<future<void>> futures;
+  futures.reserve(numSubsets);
+
+  for (unsigned i = 0; i < numSubsets; i++) {
+    futures.push_back(ThreadPool::instance().Execute(
+        [this, &gradientMutex, &samplesProvider, &result, i, numSubsets, numSamples]() {
+      unsigned start = (i * numSamples) / numSubsets;
+      unsigned end = ((i+1) * numSamples) / numSubsets;
+
+      Workspace &ws = trainingWorkspaces[i];
+      if (ws.gradient.NumLayers() != zeroGradient.NumLayers()) {
+        ws.gradient = zeroGradient;
+      }
+      for (unsigned l = 0; l < ws.gradient.NumLayers(); l++) {
+        ws.gradient(l).setZero();
+      }
+      float error = computeSubsetGradient(samplesProvider, start, end, ws, ws.gradient);
+
+      std::unique_lock<std::mutex> lock(gradientMutex);
+      result.first += ws.gradient;
+      result.second += error;
+    }));
+  }
+
+  for (auto& f : futures) {
+    f.get();
+  }
+
+  result.first *= 1.0f / numSamples;
+  result.second /= numSamples;
+  return result;
+}
+
+void GraphNetwork::ApplyUpdate(const Tensor &weightUpdates) {
+  layerWeights += weightUpdates;
+}
+
+// Forward runs node i at step i. Training then computes the output delta at step n and runs
+// node i's backward at step 2n - i, a node's delta living from the backward of its last consumer
+// (which writes it first) to its own backward.
+MemoryPlan GraphNetwork::PlanMemory(unsigned batchSize, bool training) const {
+  const unsigned n = nodes.size();
+  assert(n >= 2);
+  auto backwardStep = [n](unsigned node) { return 2 * n - node; };
+
+  vector<BufferLifetime> buffers;
+  for (unsigned i = 0; i < n; i++) {
+    assert(i == n - 1 || !nodes[i].consumers.empty());
+
+    BufferLifetime activation{(size_t) nodes[i].size * batchSize, i, i};
+    for (unsigned c : nodes[i].consumers) {
+      activation.lastUse = max(activation.lastUse, c);
+      if (training && nodes[c].layer->BackwardReadsInputs()) {
+        activation.lastUse = max(activation.lastUse, backwardStep(c));
+      }
+    }
+    if (training && i == n - 1) {
+      activation.lastUse = max(activation.lastUse, n);
+    }
+    if (training && i > 0 && nodes[i].layer->BackwardReadsOutput()) {
+      activation.lastUse = max(activation.lastUse, backwardStep(i));
+    }
+    buffers.push_back(activation);
+  }
+
+  for (unsigned i = 1; training && i < n; i++) {
+    const vector<unsigned> &consumers = nodes[i].consumers;
+    unsigned firstUse =
+        i == n - 1 ? n : backwardStep(*max_element(consumers.begin(), consumers.end()));
+    buffers.push_back(
+        BufferLifetime{(size_t) nodes[i].size * batchSize, firstUse, backwardStep(i)});
+  }
+
+  return MemoryPlanner::Plan(buffers);
+}
+
+unsigned GraphNetwork::addNode(uptr<GraphLayer> layer) {
+  const unsigned id = nodes.size();
+  for (unsigned input : layer->Inputs()) {
+    nodes[input].consumers.push_back(id);
+  }
+
+  int weightsIndex = -1;
+  Matrix weights = layer->CreateWeights();
+  if (weights.size() > 0) {
+    weightsIndex = layerWeights.NumLayers();
+    layerWeights.AddLayer(weights);
+    zeroGradient.AddLayer(Matrix::Zero(weights.rows(), weights.cols()));
+  }
+
+  const unsigned size = layer->OutputSize();
+  nodes.push_back(Node{move(layer), size, weightsIndex, {}});
+
+  // The existing plans don't cover the new node.
+  inferenceWorkspace = Workspace();
+  trainingWorkspaces.clear();
+  return id;
+}
+
+const Matrix* GraphNetwork::nodeWeights(unsigned node) const {
+  return nodes[node].weightsIndex < 0 ? nullptr : &layerWeights(nodes[node].weightsIndex);
+}
+
+void GraphNetwork::prepare(Workspace &ws, unsigned batchSize, bool training) const {
+  if (ws.batchSize == batchSize && ws.training == training) {
+    return;
+  }
+
+  ws.batchSize = batchSize;
+  ws.training = training;
+  ws.plan = PlanMemory(batchSize, training);
+  if ((size_t) ws.arena.size() < ws.plan.arenaSize) {
+    ws.arena.resize(ws.plan.arenaSize);
+  }
+}
+
+ArenaMatrix GraphNetwork::buffer(Workspace &ws, unsigned index, unsigned rows) const {
+  return ArenaMatrix(ws.arena.data() + ws.plan.offsets[index], rows, ws.batchSize);
+}
+
+vector<ArenaMatrix> GraphNetwork::inputBuffers(Workspace &ws, unsigned node) const {
+  vector<ArenaMatrix> result;
+  for (unsigned input : nodes[node].layer->Inputs()) {
+    result.push_back(buffer(ws, input, nodes[input].size));
+  }
+  return result;
+}
+
+void GraphNetwork::forward(Workspace &ws) const {
+  for (unsigned i = 1; i < nodes.size(); i++) {
+    ArenaMatrix out = buffer(ws, i, nodes[i].size);
+    nodes[i].layer->Forward(inputBuffers(ws, i), nodeWeights(i), out);
+  }
+}
+
+float GraphNetwork::computeSubsetGradient(const TrainingProvider &samplesProvider, unsigned start,
+                                          unsigned end, Workspace &ws, Tensor &gradient) const {
+  const unsigned n = nodes.size();
+  prepare(ws, end - start, true);
+  auto deltaBuffer = [this, &ws, n](unsigned node) {
+    return buffer(ws, n + node - 1, nodes[node].size);
+  };
+
+  ArenaMatrix inputs = buffer(ws, 0, nodes[0].size);
+  Matrix targets(nodes.back().size, end - start);
+  for (unsigned i = start; i < end; i++) {
+    samplesProvider.PackInput(i, inputs.col(i - start));
+    samplesProvider.PackOutput(i, targets.col(i - start));
+  }
+
+  forward(ws);
+
+  ArenaMatrix outputDelta = deltaBuffer(n - 1);
+  outputDelta = buffer(ws, n - 1, nodes.back().size) - targets;
+  const float error = 0.5f * outputDelta.squaredNorm();
+
+  // Whether some consumer has written (part of) each node's delta yet.
+  vector<bool> deltaWritten(n, false);
+
+  vector<ArenaMatrix> inDeltaBuffers;
+  vector<InputDelta> inDeltas;
+  for (unsigned i = n - 1; i > 0; i--) {
+    const vector<unsigned> &layerInputs = nodes[i].layer->Inputs();
+
+    // Reserved up front, as inDeltas points into it.
+    inDeltaBuffers.clear();
+    inDeltaBuffers.reserve(layerInputs.size());
+    inDeltas.clear();
+    for (unsigned input : layerInputs) {
+      if (input == INPUT) {
+        inDeltas.push_back(InputDelta{nullptr, false});
+      } else {
+        inDeltaBuffers.push_back(deltaBuffer(input));
+        inDeltas.push_back(InputDelta{&inDeltaBuffers.back(), deltaWritten[input]});
+        deltaWritten[input] = true;
+      }
+    }
+
+    int weightsIndex = nodes[i].weightsIndex;
+    nodes[i].layer->Backward(inputBuffers(ws, i), buffer(ws, i, nodes[i].size), deltaBuffer(i),
+                             nodeWeights(i), inDeltas,
+                             weightsIndex < 0 ? nullptr : &gradient(weightsIndex));
+  }
+
+  return error;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "GraphLayers.hpp"
+#include "MemoryPlanner.hpp"
+#include "Tensor.hpp"
+#include "TrainingProvider.hpp"
+#include "../common/Common.hpp"
+#include "../common/Math.hpp"
+#include <vector>
+
+
+// A network built as a directed acyclic graph of layers, for architectures that aren't a plain
+// chain of sigmoid layers (residual connections, concatenated branches, other activations).
+// Nodes are added in topological order, each reading nodes added before it, and the last node
+// added is the output. Every other node must be read by some later node.
+//
+// All of a batch's activations (and for training its deltas) live in a single arena laid out by
+// MemoryPlanner, buffers whose lifetimes don't overlap sharing memory. The arenas are kept
+// between calls and only replanned when the batch size changes.
+class GraphNetwork {
+public:
+
+  // Node id of the network input.
+  static const unsigned INPUT = 0;
+
+  GraphNetwork(unsigned numInputs);
+  ~GraphNetwork();
+
+  // Each of these appends a node and returns its id.
+  unsigned AddDense(unsigned input, unsigned size, WeightInit weightInit = WeightInit::UNIFORM);
+  unsigned AddActivation(unsigned input, Activation activation);
+  unsigned AddSum(const vector<unsigned> &inputs);
+  unsigned AddConcat(const vector<unsigned> &inputs);
+
+  unsigned NumNodes(void) const;
+  unsigned NodeSize(unsigned node) const;
+
+  // The weights of the dense layers, in the order the layers were added.
+  Tensor GetWeights(void) const;
+  void SetWeights(const Tensor &weights);
+
+  // Neither of these may be called concurrently with any other method.
+  Vector Process(const Vector &input);
+  Matrix ProcessBatch(const Matrix &inputs);
+
+  // The gradient of half the squared error of the output node, and that error, averaged over the
+  // samples. The samples are split across the thread pool as for Network's DATA mode.
+  pair<Tensor, float> ComputeGradient(const TrainingProvider &samplesProvider);
+  void ApplyUpdate(const Tensor &weightUpdates);
+
+  // Arena layout for a batch of the given size. Buffer i < NumNodes() holds node i's output, and
+  // for training buffer NumNodes() + i - 1 holds node i's delta (the input node has none).
+  MemoryPlan PlanMemory(unsigned batchSize, bool training) const;
+
+private:
+  struct Node {
+    uptr<GraphLayer> layer;
+    unsigned size;
+
+    // Index of the node's weights in layerWeights, -1 if it has none.
+    int weightsIndex;
+    vector<unsigned> consumers;
+  };
+
+  // The arena of one in-flight batch, planned for the batch size it was last used with, and for
+  // training the worker's gradient accumulator.
+  struct Workspace {
+    unsigned batchSize = 0;
+    bool training = false;
+    MemoryPlan plan;
+    Vector arena;
+    Tensor gradient;
+  };
+
+  vector<Node> nodes;
+  Tensor layerWeights;
+  Tensor zeroGradient;
+
+  Workspace inferenceWorkspace;
+  vector<Workspace> trainingWorkspaces;
+
+  unsigned addNode(uptr<GraphLayer> layer);
+  const Matrix* nodeWeights(unsigned node) const;
+
+  void prepare(Workspace &ws, unsigned batchSize, bool training) const;
+  ArenaMatrix buffer(Workspace &ws, unsigned index, unsigned rows) const;
+  vector<ArenaMatrix> inputBuffers(Workspace &ws, unsigned node) const;
+
+  void forward(Workspace &ws) const;
+  float computeSubsetGradient(const TrainingProvider &samplesProvider, unsigned start,
+                              unsigned end, Workspace &ws, Tensor &gradient) const;
+};
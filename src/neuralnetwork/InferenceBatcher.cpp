@@ -0,0 +1,108 @@
+
+#include "InferenceBatcher.hpp"
+#include <cassert>
+
+
+// Weight of the most recent batch in the processing time estimate.
+static const float BATCH_TIME_SMOOTHING = 0.1f;
+
+InferenceBatcher::InferenceBatcher(Network &network, const BatcherConfig &config) :
+    network(network),
+    config(config),
+    shutdown(false),
+    avgBatchMicroseconds(0.0f),
+    numRequests(0),
+    numBatches(0) {
+
+  assert(config.maxBatchSize > 0);
+  dispatcher = std::thread([this]() { dispatchLoop(); });
+}
+
+InferenceBatcher::~InferenceBatcher() {
+  {
+    std::unique_lock<std::mutex> lock(queueMutex);
+    shutdown = true;
+  }
+  queueSignal.notify_all();
+  dispatcher.join();
+}
+
+future<Vector> InferenceBatcher::Submit(const Vector &input) {
+  Request request;
+  request.input = input;
+  request.arrival = Clock::now();
+  auto result = request.result.get_future();
+
+  {
+    std::unique_lock<std::mutex> lock(queueMutex);
+    queue.push_back(std::move(request));
+  }
+
+  numRequests++;
+  queueSignal.notify_one();
+  return result;
+}
+
+BatcherStats InferenceBatcher::GetStats(void) const {
+  BatcherStats result;
+  result.numRequests = numRequests.load();
+  result.numBatches = numBatches.load();
+  return result;
+}
+
+void InferenceBatcher::dispatchLoop(void) {
+  vector<Request> batch;
+  batch.reserve(config.maxBatchSize);
+
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(queueMutex);
+      queueSignal.wait(lock, [this]() { return !queue.empty() || shutdown; });
+
+      if (queue.empty()) {
+        return; // shutting down with nothing left to process.
+      }
+
+      auto waitBudget = std::chrono::microseconds(
+          (long) max(0.0f, config.latencyTargetMicroseconds - avgBatchMicroseconds));
+      queueSignal.wait_until(lock, queue.front().arrival + waitBudget, [this]() {
+        return queue.size() >= config.maxBatchSize || shutdown;
+      });
+
+      unsigned batchSize = min<unsigned>(queue.size(), config.maxBatchSize);
+      for (unsigned i = 0; i < batchSize; i++) {
+        batch.push_back(std::move(queue.front()));
+        queue.pop_front();
+      }
+    }
+
+    processBatch(batch);
+    batch.clear();
+  }
+}
+
+void InferenceBatcher::processBatch(vector<Request> &batch) {
+  auto start = Clock::now();
+
+  Matrix inputs(batch.front().input.rows(), batch.size());
+  for (unsigned i = 0; i < batch.size(); i++) {
+    inputs.col(i) = batch[i].input;
+  }
+
+  try {
+    Matrix outputs = network.ProcessBatch(inputs);
+    for (unsigned i = 0; i < batch.size(); i++) {
+      batch[i].result.set_value(outputs.col(i));
+    }
+  } catch (...) {
+    for (auto& request : batch) {
+      request.result.set_exception(std::current_exception());
+    }
+  }
+
+  float elapsed = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+  avgBatchMicroseconds = numBatches.load() == 0 ?
+      elapsed : avgBatchMicroseconds + BATCH_TIME_SMOOTHING * (elapsed - avgBatchMicroseconds);
+
+  numBatches++;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "Network.hpp"
+#include "../common/Common.hpp"
+#include "../common/Math.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+
+
+struct BatcherConfig {
+  // Upper bound on the number of requests coalesced into a single forward pass.
+  unsigned maxBatchSize;
+
+  // Target end-to-end latency for a request. A partially filled batch is dispatched once its
+  // oldest request has waited long enough that any more waiting would (given the measured batch
+  // processing time) push it past this target.
+  unsigned latencyTargetMicroseconds;
+};
+
+struct BatcherStats {
+  unsigned long numRequests;
+  unsigned long numBatches;
+};
+
+// Coalesces concurrently submitted single-sample inference requests into batches that run as
+// one batched forward pass over the network. The network must not be modified while the
+// batcher is running.
+class InferenceBatcher {
+public:
+
+  InferenceBatcher(Network &network, const BatcherConfig &config);
+  ~InferenceBatcher();
+
+  InferenceBatcher(const InferenceBatcher &) = delete;
+  InferenceBatcher& operator=(const InferenceBatcher &) = delete;
+
+  // Thread safe, the returned future completes with the network output for this input.
+  future<Vector> Submit(const Vector &input);
+
+  BatcherStats GetStats(void) const;
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Request {
+    Vector input;
+    promise<Vector> result;
+    Clock::time_point arrival;
+  };
+
+  Network &network;
+  const BatcherConfig config;
+
+  std::mutex queueMutex;
+  std::condition_variable queueSignal;
+  std::deque<Request> queue;
+  bool shutdown;
+
+  // Exponential moving average of the time taken to process a batch, in microseconds.
+  float avgBatchMicroseconds;
+
+  std::atomic<unsigned long> numRequests;
+  std::atomic<unsigned long> numBatches;
+
+  std::thread dispatcher;
+
+  void dispatchLoop(void);
+  void processBatch(vector<Request> &batch);
+};
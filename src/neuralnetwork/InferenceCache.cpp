@@ -0,0 +1,130 @@
+
+#include "InferenceCache.hpp"
+#include <cassert>
+#include <cmath>
+#include <cstring>
+
+
+static const unsigned NUM_SHARDS = 16;
+
+// Quantized values are clamped to this magnitude (2^62) so that they fit an int64_t, inputs
+// beyond it all sharing a key.
+static const float MAX_QUANTIZED = 4.611686e18f;
+
+InferenceCache::InferenceCache(unsigned capacity, float quantizationStep) :
+    quantizationStep(quantizationStep),
+    shardCapacity(max(1u, (capacity + NUM_SHARDS - 1) / NUM_SHARDS)),
+    shards(NUM_SHARDS),
+    hits(0),
+    misses(0),
+    evictions(0),
+    hitNanoseconds(0),
+    missNanoseconds(0) {
+
+  assert(capacity > 0);
+  assert(quantizationStep >= 0.0f);
+}
+
+bool InferenceCache::Lookup(const Vector &input, unsigned long modelVersion, Vector &output) {
+  Key key = makeKey(input);
+
+  std::unique_lock<std::mutex> lock;
+  Shard &shard = lockedShard(key, modelVersion, lock);
+
+  auto it = shard.index.find(key);
+  if (it == shard.index.end() || shard.modelVersion != modelVersion) {
+    misses++;
+    return false;
+  }
+
+  shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+  output = it->second->output;
+  hits++;
+  return true;
+}
+
+void InferenceCache::Insert(const Vector &input, unsigned long modelVersion, const Vector &output) {
+  Key key = makeKey(input);
+
+  std::unique_lock<std::mutex> lock;
+  Shard &shard = lockedShard(key, modelVersion, lock);
+  if (shard.modelVersion != modelVersion) {
+    return; // computed with weights that have since been replaced.
+  }
+
+  auto it = shard.index.find(key);
+  if (it != shard.index.end()) {
+    it->second->output = output;
+    shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+    return;
+  }
+
+  if (shard.entries.size() >= shardCapacity) {
+    shard.index.erase(shard.entries.back().key);
+    shard.entries.pop_back();
+    evictions++;
+  }
+
+  shard.entries.push_front(Entry{key, output});
+  shard.index.emplace(std::move(key), shard.entries.begin());
+}
+
+void InferenceCache::RecordHitLatency(unsigned long nanoseconds) {
+  hitNanoseconds += nanoseconds;
+}
+
+void InferenceCache::RecordMissLatency(unsigned long nanoseconds) {
+  missNanoseconds += nanoseconds;
+}
+
+CacheStats InferenceCache::GetStats(void) const {
+  CacheStats result;
+  result.hits = hits.load();
+  result.misses = misses.load();
+  result.evictions = evictions.load();
+  result.avgHitMicroseconds = result.hits == 0 ? 0.0f : hitNanoseconds.load() / (1000.0f * result.hits);
+  result.avgMissMicroseconds =
+      result.misses == 0 ? 0.0f : missNanoseconds.load() / (1000.0f * result.misses);
+  return result;
+}
+
+InferenceCache::Key InferenceCache::makeKey(const Vector &input) const {
+  Key result;
+  result.values.resize(input.rows());
+
+  for (unsigned i = 0; i < input.rows(); i++) {
+    if (quantizationStep > 0.0f) {
+      const float quantized = input(i) / quantizationStep;
+      result.values[i] = llroundf(max(-MAX_QUANTIZED, min(MAX_QUANTIZED, quantized)));
+    } else {
+      float v = input(i);
+      uint32_t bits;
+      memcpy(&bits, &v, sizeof(float));
+      result.values[i] = bits;
+    }
+  }
+
+  // FNV-1a, over both halves of each value.
+  uint64_t hash = 14695981039346656037ULL;
+  for (int64_t v : result.values) {
+    hash = (hash ^ (uint32_t) v) * 1099511628211ULL;
+    hash = (hash ^ (uint32_t) ((uint64_t) v >> 32)) * 1099511628211ULL;
+  }
+  result.hash = hash;
+
+  return result;
+}
+
+InferenceCache::Shard& InferenceCache::lockedShard(
+    const Key &key, unsigned long modelVersion, std::unique_lock<std::mutex> &lock) {
+  // The low bits of the hash pick the unordered_map bucket, so use the high bits for the shard.
+  Shard &shard = shards[(key.hash >> 32) % NUM_SHARDS];
+  lock = std::unique_lock<std::mutex>(shard.mutex);
+
+  if (modelVersion > shard.modelVersion) {
+    shard.entries.clear();
+    shard.index.clear();
+    shard.modelVersion = modelVersion;
+  }
+  return shard;
+}
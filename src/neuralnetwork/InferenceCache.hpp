@@ -0,0 +1,89 @@
+#pragma once
+
+#include "../common/Common.hpp"
+#include "../common/Math.hpp"
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+
+struct CacheStats {
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+
+  // Mean time to serve a request from the cache, and to compute and insert a missing result.
+  float avgHitMicroseconds;
+  float avgMissMicroseconds;
+
+  float HitRate(void) const {
+    return (hits + misses) == 0 ? 0.0f : hits / (float) (hits + misses);
+  }
+};
+
+// Thread safe LRU cache of network outputs, keyed on the (optionally quantized) input vector.
+// Split into independently locked shards to keep concurrent lookups from contending. Entries
+// are tagged with the model version they were computed with, a shard dropping all of its
+// entries the first time it sees a newer version.
+class InferenceCache {
+public:
+
+  // Inputs are rounded to multiples of quantizationStep before being used as a key, or matched
+  // exactly if it is 0.
+  InferenceCache(unsigned capacity, float quantizationStep);
+
+  bool Lookup(const Vector &input, unsigned long modelVersion, Vector &output);
+  void Insert(const Vector &input, unsigned long modelVersion, const Vector &output);
+
+  // Latencies are measured by the caller, as a miss is only resolved once the output is computed.
+  void RecordHitLatency(unsigned long nanoseconds);
+  void RecordMissLatency(unsigned long nanoseconds);
+
+  CacheStats GetStats(void) const;
+
+private:
+  struct Key {
+    vector<int64_t> values;
+    size_t hash;
+
+    bool operator==(const Key &other) const {
+      return hash == other.hash && values == other.values;
+    }
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key &key) const {
+      return key.hash;
+    }
+  };
+
+  struct Entry {
+    Key key;
+    Vector output;
+  };
+
+  struct Shard {
+    std::mutex mutex;
+    unsigned long modelVersion = 0;
+
+    // Most recently used at the front.
+    std::list<Entry> entries;
+    std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index;
+  };
+
+  const float quantizationStep;
+  unsigned shardCapacity;
+  vector<Shard> shards;
+
+  std::atomic<unsigned long> hits;
+  std::atomic<unsigned long> misses;
+  std::atomic<unsigned long> evictions;
+  std::atomic<unsigned long> hitNanoseconds;
+  std::atomic<unsigned long> missNanoseconds;
+
+  Key makeKey(const Vector &input) const;
+  Shard& lockedShard(const Key &key, unsigned long modelVersion, std::unique_lock<std::mutex> &lock);
+};
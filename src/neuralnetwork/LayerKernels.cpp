@@ -0,0 +1,426 @@
+
+#include "LayerKernels.hpp"
+#include "../common/ThreadPool.hpp"
+#include "../util/Random.hpp"
+#include <cassert>
+#include <cmath>
+#include <vector>
+
+
+// Minimum number of multiply-adds per chunk for intra-op parallelism to outweigh the cost of
+// dispatching a task to the thread pool.
+static const unsigned MIN_CHUNK_WORK = 1 << 16;
+
+// Range of the weights of a WeightInit::UNIFORM layer.
+static const float INIT_WEIGHT_RANGE = 0.1f;
+
+// Dropout masks are drawn in Philox blocks of 4, so chunks must start on a block boundary.
+static_assert(LayerKernels::CHUNK_ROW_ALIGN % 4 == 0, "chunks must start on a Philox block");
+
+unsigned LayerKernels::IntraOpChunks(const Matrix &weights, unsigned batchSize, unsigned maxChunks,
+                                     size_t minChunkWork) {
+  return IntraOpChunks((size_t) weights.size(), batchSize, maxChunks, minChunkWork);
+}
+
+unsigned LayerKernels::IntraOpChunks(size_t numWeights, unsigned batchSize, unsigned maxChunks,
+                                     size_t minChunkWork) {
+  maxChunks = maxChunks == 0 ? ThreadPool::instance().NumThreads() : maxChunks;
+  minChunkWork = minChunkWork == 0 ? MIN_CHUNK_WORK : minChunkWork;
+
+  size_t work = numWeights * batchSize;
+  return max<size_t>(1, min<size_t>(maxChunks, work / minChunkWork));
+}
+
+void LayerKernels::InitWeights(Matrix &weights, unsigned fanOut, WeightInit init) {
+  const unsigned fanIn = weights.cols() - 1;
+  PhiloxRng &rng = Random::ThreadStream();
+
+  switch (init) {
+  case WeightInit::UNIFORM:
+    rng.FillUniform(weights, -INIT_WEIGHT_RANGE, INIT_WEIGHT_RANGE);
+    break;
+  case WeightInit::XAVIER: {
+    float range = sqrtf(6.0f / (fanIn + fanOut));
+    rng.FillUniform(weights, -range, range);
+    weights.col(0).setZero();
+    break;
+  }
+  case WeightInit::HE:
+    rng.FillGaussian(weights, 0.0f, sqrtf(2.0f / fanIn));
+    weights.col(0).setZero();
+    break;
+  }
+}
+
+// z = dropout(sigmoid(z)), z holding the pre-activations of the rows starting at startRow of a
+// layer's output. With dropout the mask is drawn and applied in the same pass as the sigmoid.
+template<typename Z>
+static void activate(Z &&z, unsigned startRow, const LayerKernels::Dropout &dropout) {
+  if (dropout.keepProb >= 1.0f) {
+    z = (1.0f + (-z.array()).exp()).inverse().matrix();
+    return;
+  }
+
+  assert(startRow % 4 == 0);
+  const float scale = 1.0f / dropout.keepProb;
+
+  Eigen::ArrayXf uniform(z.rows());
+  for (unsigned c = 0; c < z.cols(); c++) {
+    PhiloxRng rng(dropout.seed, dropout.stream + c);
+    rng.Seek(startRow / 4);
+    rng.FillUniform(uniform.data(), uniform.size(), 0.0f, 1.0f);
+
+    auto zc = z.col(c).array();
+    zc = (uniform < dropout.keepProb).select(scale * (1.0f + (-zc).exp()).inverse(), 0.0f);
+  }
+}
+
+// g = g * scale + l2Decay * w + l1Decay * sign(w)
+template<typename G, typename W>
+static void scaleAndDecay(G &&g, float scale, const W &w, const LayerRegularization &reg) {
+  g = g * scale + reg.l2Decay * w + reg.l1Decay * w.cwiseSign();
+}
+
+LayerKernels::Dropout LayerKernels::LayerDropout(const LayerRegularization &regularization,
+                                                 unsigned layer, uint64_t seed,
+                                                 unsigned firstSample) {
+  Dropout result;
+  result.keepProb = 1.0f - regularization.dropoutRate;
+  result.seed = seed;
+  result.stream = ((uint64_t) layer << 32) + firstSample;
+  return result;
+}
+
+void LayerKernels::Forward(const Matrix &weights, const Matrix &in, Matrix &out, unsigned numChunks,
+                           const Dropout &dropout) {
+  assert(in.rows() == weights.cols() - 1);
+
+  out.resize(weights.rows(), in.cols());
+  ForRowChunks(weights.rows(), numChunks, [&](unsigned start, unsigned rows) {
+    auto z = out.middleRows(start, rows);
+    z.noalias() = weights.block(start, 1, rows, weights.cols() - 1) * in;
+    z.colwise() += weights.col(0).segment(start, rows);
+    activate(z, start, dropout);
+  });
+}
+
+void LayerKernels::Logits(
+    const Matrix &weights, const Matrix &in, Matrix &out, unsigned numChunks) {
+  assert(in.rows() == weights.cols() - 1);
+
+  out.resize(weights.rows(), in.cols());
+  ForRowChunks(weights.rows(), numChunks, [&](unsigned start, unsigned rows) {
+    auto z = out.middleRows(start, rows);
+    z.noalias() = weights.block(start, 1, rows, weights.cols() - 1) * in;
+    z.colwise() += weights.col(0).segment(start, rows);
+  });
+}
+
+void LayerKernels::Backward(const Matrix &weights, const Matrix &delta, const Matrix &prevOut,
+                            Matrix &prevDelta, unsigned numChunks, float prevKeepProb) {
+  assert(delta.rows() == weights.rows());
+  assert(prevOut.rows() == weights.cols() - 1);
+
+  prevDelta.resize(prevOut.rows(), delta.cols());
+  ForRowChunks(prevOut.rows(), numChunks, [&](unsigned start, unsigned rows) {
+    auto pd = prevDelta.middleRows(start, rows);
+    pd.noalias() = weights.block(0, start + 1, weights.rows(), rows).transpose() * delta;
+
+    // A kept activation po is sigmoid(z) / prevKeepProb, so its derivative with respect to z is
+    // po * (1 - po * prevKeepProb), which is also 0 for a dropped (zero) activation.
+    auto po = prevOut.middleRows(start, rows).array();
+    pd.array() *= po * (1.0f - po * prevKeepProb);
+  });
+}
+
+void LayerKernels::AccumulateGradient(
+    const Matrix &delta, const Matrix &in, Matrix &gradient, unsigned numChunks) {
+  assert(delta.cols() == in.cols());
+  assert(gradient.rows() == delta.rows() && gradient.cols() == in.rows() + 1);
+
+  ForRowChunks(gradient.rows(), numChunks, [&](unsigned start, unsigned rows) {
+    gradient.block(start, 0, rows, 1) += delta.middleRows(start, rows).rowwise().sum();
+    gradient.block(start, 1, rows, gradient.cols() - 1).noalias() +=
+        delta.middleRows(start, rows) * in.transpose();
+  });
+}
+
+void LayerKernels::FinishGradient(Matrix &gradient, float scale, const Matrix &weights,
+                                  const LayerRegularization &regularization,
+                                  const vector<unsigned> &columns) {
+  if (regularization.l2Decay == 0.0f && regularization.l1Decay == 0.0f) {
+    gradient *= scale;
+    return;
+  }
+
+  // The biases are not decayed.
+  gradient.col(0) *= scale;
+  if (columns.empty()) {
+    assert(gradient.rows() == weights.rows() && gradient.cols() == weights.cols());
+    scaleAndDecay(gradient.rightCols(gradient.cols() - 1), scale,
+                  weights.rightCols(weights.cols() - 1), regularization);
+  } else {
+    assert(gradient.cols() == (int) columns.size() && columns[0] == 0);
+    for (unsigned i = 1; i < columns.size(); i++) {
+      scaleAndDecay(gradient.col(i), scale, weights.col(columns[i]), regularization);
+    }
+  }
+}
+
+void LayerKernels::SparseForward(const Matrix &weights, const SparseMatrix &in, Matrix &out,
+                                 const Dropout &dropout) {
+  SparseLogits(weights, in, out);
+  activate(out, 0, dropout);
+}
+
+void LayerKernels::SparseLogits(const Matrix &weights, const SparseMatrix &in, Matrix &out) {
+  assert(in.rows() == weights.cols() - 1);
+
+  out.resize(weights.rows(), in.cols());
+  for (unsigned s = 0; s < in.cols(); s++) {
+    auto z = out.col(s);
+    z = weights.col(0);
+    for (SparseMatrix::InnerIterator it(in, s); it; ++it) {
+      z.noalias() += it.value() * weights.col(it.index() + 1);
+    }
+  }
+}
+
+void LayerKernels::SparseAccumulateGradient(const Matrix &delta, const SparseMatrix &in,
+                                            const vector<unsigned> &columns, Matrix &gradient) {
+  assert(delta.cols() == in.cols());
+  assert(gradient.rows() == delta.rows() && gradient.cols() == (int) columns.size());
+  assert(!columns.empty() && columns[0] == 0);
+
+  gradient.col(0) += delta.rowwise().sum();
+  for (unsigned s = 0; s < in.cols(); s++) {
+    for (SparseMatrix::InnerIterator it(in, s); it; ++it) {
+      auto column = lower_bound(columns.begin(), columns.end(), it.index() + 1);
+      assert(column != columns.end() && *column == (unsigned) it.index() + 1);
+      gradient.col(column - columns.begin()).noalias() += it.value() * delta.col(s);
+    }
+  }
+}
+
+void LayerKernels::NormalizedForward(const Matrix &weights, const Matrix &scale,
+                                     Normalization normalization, const Matrix &in, Matrix &out,
+                                     NormalizationCache *cache, unsigned numChunks,
+                                     const Dropout &dropout) {
+  assert(in.rows() == weights.cols() - 1);
+  assert(scale.rows() == weights.rows() && scale.cols() == 1);
+  assert(normalization != Normalization::NONE);
+  assert(cache != nullptr || normalization == Normalization::LAYER);
+
+  const unsigned rows = weights.rows(), n = in.cols();
+  out.resize(rows, n);
+  ForRowChunks(rows, numChunks, [&](unsigned start, unsigned numRows) {
+    out.middleRows(start, numRows).noalias() =
+        weights.block(start, 1, numRows, weights.cols() - 1) * in;
+  });
+
+  auto gamma = scale.col(0).array();
+  auto shift = weights.col(0).array();
+  Eigen::ArrayXf mean, invStd;
+
+  if (normalization == Normalization::BATCH) {
+    // The sums are of the differences from the first sample, which keeps the variance accurate
+    // when a row's mean is large relative to its spread.
+    const Eigen::ArrayXf first = out.col(0).array();
+    Eigen::ArrayXf sum = Eigen::ArrayXf::Zero(rows), squareSum = Eigen::ArrayXf::Zero(rows);
+    for (unsigned c = 0; c < n; c++) {
+      auto d = out.col(c).array() - first;
+      sum += d;
+      squareSum += d.square();
+    }
+
+    const Eigen::ArrayXf shiftedMean = sum / n;
+    mean = first + shiftedMean;
+    const Eigen::ArrayXf variance = (squareSum / n - shiftedMean.square()).max(0.0f);
+    invStd = (variance + NORMALIZATION_EPSILON).rsqrt();
+
+    cache->mean = mean.matrix();
+    cache->variance = variance.matrix();
+    cache->invStd = invStd.matrix();
+  } else if (cache) {
+    cache->invStd.resize(n);
+  }
+
+  if (cache) {
+    cache->normalized.resize(rows, n);
+  }
+
+  for (unsigned c = 0; c < n; c++) {
+    auto z = out.col(c).array();
+    if (normalization == Normalization::LAYER) {
+      const float columnMean = z.mean();
+      const float columnInvStd =
+          1.0f / sqrtf((z - columnMean).square().mean() + NORMALIZATION_EPSILON);
+      z = (z - columnMean) * columnInvStd;
+      if (cache) {
+        cache->invStd(c) = columnInvStd;
+      }
+    } else {
+      z = (z - mean) * invStd;
+    }
+
+    if (cache) {
+      cache->normalized.col(c) = z.matrix();
+    }
+    z = gamma * z + shift;
+
+    Dropout columnDropout = dropout;
+    columnDropout.stream += c;
+    activate(out.col(c), 0, columnDropout);
+  }
+}
+
+void LayerKernels::NormalizedAccumulateGradient(const Matrix &scale, Normalization normalization,
+                                                const NormalizationCache &cache,
+                                                const Matrix &in, Matrix &delta,
+                                                Matrix &gradient, Matrix &scaleGradient,
+                                                unsigned numChunks) {
+  assert(delta.cols() == in.cols());
+  assert(gradient.rows() == delta.rows() && gradient.cols() == in.rows() + 1);
+  assert(scaleGradient.rows() == delta.rows() && scaleGradient.cols() == 1);
+  assert(cache.normalized.rows() == delta.rows() && cache.normalized.cols() == delta.cols());
+
+  const unsigned rows = delta.rows(), n = delta.cols();
+  auto gamma = scale.col(0).array();
+  Eigen::ArrayXf shiftSum = Eigen::ArrayXf::Zero(rows), scaleSum = Eigen::ArrayXf::Zero(rows);
+
+  // With zh the normalized values, dy the incoming delta and dzh = gamma * dy, the delta of the
+  // product is invStd * (dzh - mean(dzh) - zh * mean(dzh * zh)), the means being over whatever
+  // the normalization was over.
+  if (normalization == Normalization::BATCH) {
+    for (unsigned c = 0; c < n; c++) {
+      auto dy = delta.col(c).array();
+      shiftSum += dy;
+      scaleSum += dy * cache.normalized.col(c).array();
+    }
+
+    const Eigen::ArrayXf k = gamma * cache.invStd.array();
+    const Eigen::ArrayXf shiftMean = shiftSum / n, scaleMean = scaleSum / n;
+    for (unsigned c = 0; c < n; c++) {
+      auto dy = delta.col(c).array();
+      dy = k * (dy - shiftMean - cache.normalized.col(c).array() * scaleMean);
+    }
+  } else {
+    for (unsigned c = 0; c < n; c++) {
+      auto dy = delta.col(c).array();
+      auto zh = cache.normalized.col(c).array();
+      shiftSum += dy;
+      scaleSum += dy * zh;
+
+      const float dzhMean = (gamma * dy).mean();
+      const float dzhZhMean = (gamma * dy * zh).mean();
+      dy = cache.invStd(c) * (gamma * dy - dzhMean - zh * dzhZhMean);
+    }
+  }
+
+  gradient.col(0) += shiftSum.matrix();
+  scaleGradient.col(0) += scaleSum.matrix();
+  ForRowChunks(rows, numChunks, [&](unsigned start, unsigned numRows) {
+    gradient.block(start, 1, numRows, gradient.cols() - 1).noalias() +=
+        delta.middleRows(start, numRows) * in.transpose();
+  });
+}
+
+void LayerKernels::FoldBatchNormalization(const Matrix &weights, const Matrix &scale,
+                                          const Vector &mean, const Vector &variance,
+                                          Matrix &folded) {
+  assert(scale.rows() == weights.rows() && mean.rows() == weights.rows());
+
+  const Vector rowScale =
+      scale.col(0).cwiseProduct((variance.array() + NORMALIZATION_EPSILON).rsqrt().matrix());
+  folded.resize(weights.rows(), weights.cols());
+  folded.rightCols(weights.cols() - 1).noalias() =
+      rowScale.asDiagonal() * weights.rightCols(weights.cols() - 1);
+  folded.col(0) = weights.col(0) - rowScale.cwiseProduct(mean);
+}
+
+void LayerKernels::ActivateOutputs(Matrix &logits, const Loss &loss) {
+  switch (loss.type) {
+  case LossType::BINARY_CROSS_ENTROPY:
+    logits = (1.0f + (-logits.array()).exp()).inverse().matrix();
+    break;
+  case LossType::SOFTMAX_CROSS_ENTROPY: {
+    Eigen::RowVectorXf maxLogits = logits.colwise().maxCoeff();
+    logits = (logits.rowwise() - maxLogits).array().exp().matrix();
+    Eigen::RowVectorXf sums = logits.colwise().sum();
+    logits.array().rowwise() /= sums.array();
+    break;
+  }
+  case LossType::MSE:
+  case LossType::HUBER:
+    break;
+  }
+}
+
+// Softmax cross entropy of each column, with the gradient p - t. The loss needs only one log per
+// sample rather than the log of every probability: -sum(t * log(p)) = sum(t) * lse - sum(t * z),
+// where lse = max + log(sum(exp(z - max))). The exponentials are written straight into the delta
+// and normalised there, so the logits are only read twice (for the max, then for the exponentials
+// and the target dot product).
+static void softmaxCrossEntropy(const Matrix &logits, const Matrix &targets, Matrix &delta,
+                                Eigen::RowVectorXf &losses) {
+  for (unsigned c = 0; c < logits.cols(); c++) {
+    auto z = logits.col(c).array();
+    auto t = targets.col(c).array();
+    auto d = delta.col(c).array();
+
+    const float maxLogit = z.maxCoeff();
+    d = (z - maxLogit).exp();
+    const float sum = d.sum();
+
+    losses(c) = t.sum() * (maxLogit + logf(sum)) - (t * z).sum();
+    d = d * (1.0f / sum) - t;
+  }
+}
+
+float LayerKernels::OutputDelta(const Matrix &logits, const Matrix &targets, const Loss &loss,
+                                Matrix &delta, const float *sampleWeights, float *sampleLosses) {
+  assert(logits.rows() == targets.rows() && logits.cols() == targets.cols());
+  delta.resize(logits.rows(), logits.cols());
+
+  // The loss of each sample.
+  Eigen::RowVectorXf losses(logits.cols());
+
+  auto z = logits.array();
+  auto t = targets.array();
+  switch (loss.type) {
+  case LossType::BINARY_CROSS_ENTROPY: {
+    // With e = exp(-|z|), the loss is max(z, 0) - z * t + log(1 + e) and sigmoid(z) is 1 / (1 + e)
+    // or e / (1 + e) depending on the sign of z, so one exponential serves both.
+    Eigen::ArrayXXf e = (-z.abs()).exp();
+    delta.array() = (z >= 0.0f).select(1.0f, e) / (1.0f + e) - t;
+    losses = (z.max(0.0f) - z * t + e.log1p()).matrix().colwise().sum();
+    break;
+  }
+  case LossType::SOFTMAX_CROSS_ENTROPY:
+    softmaxCrossEntropy(logits, targets, delta, losses);
+    break;
+  case LossType::MSE:
+    delta = logits - targets;
+    losses = 0.5f * delta.colwise().squaredNorm();
+    break;
+  case LossType::HUBER: {
+    const float k = loss.huberDelta;
+    assert(k > 0.0f);
+    Eigen::ArrayXXf diff = z - t;
+    delta.array() = diff.max(-k).min(k);
+    losses = (diff.abs() <= k).select(0.5f * diff.square(), k * (diff.abs() - 0.5f * k))
+                 .matrix().colwise().sum();
+    break;
+  }
+  }
+
+  if (sampleLosses) {
+    Eigen::Map<Eigen::RowVectorXf>(sampleLosses, losses.size()) = losses;
+  }
+  if (sampleWeights) {
+    Eigen::Map<const Eigen::RowVectorXf> weights(sampleWeights, losses.size());
+    delta *= weights.asDiagonal();
+    return losses.dot(weights);
+  }
+  return losses.sum();
+}
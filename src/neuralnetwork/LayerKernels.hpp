@@ -0,0 +1,167 @@
+#pragma once
+
+#include "../common/Common.hpp"
+#include "../common/Math.hpp"
+#include "Tensor.hpp"
+#include "../common/ThreadPool.hpp"
+#include <cstdint>
+#include <future>
+#include <vector>
+
+// Batched versions of the per-layer operations. Each column of an activation/delta matrix
+// holds a single sample, and the layer weight matrices store the bias in column 0. The products
+// work on blocks and transposed views of the weights in place (bench-layout measures this against
+// padded weight columns with a separate bias, which gain nothing as the GEMM packs its operands).
+//
+// Each operation can optionally be split by output rows into numChunks pieces that run in
+// parallel on the thread pool (intra-op parallelism). The calling thread runs one of the chunks
+// and waits for the others, so this must not be used from within a thread pool task.
+namespace LayerKernels {
+
+  // Chunk boundaries are kept to multiples of this many rows so that each chunk starts on a SIMD
+  // boundary within the column.
+  static const unsigned CHUNK_ROW_ALIGN = 8;
+
+  // Number of chunks worth splitting a product with the given layer weights over a batch of
+  // batchSize samples into, 1 if the layer is too small to benefit. There are at most maxChunks
+  // (0 for the thread pool size), each of at least minChunkWork multiply-adds (0 for a default
+  // suited to typical task dispatch costs).
+  unsigned IntraOpChunks(const Matrix &weights, unsigned batchSize, unsigned maxChunks = 0,
+                         size_t minChunkWork = 0);
+  unsigned IntraOpChunks(size_t numWeights, unsigned batchSize, unsigned maxChunks = 0,
+                         size_t minChunkWork = 0);
+
+  // Calls fn(startRow, numRows) for each chunk of [0, totalRows).
+  template<typename Func>
+  void ForRowChunks(unsigned totalRows, unsigned numChunks, Func fn);
+
+  // Fills a layer's weights (bias in column 0) from the calling thread's random stream. fanOut
+  // is given separately as the weights may stack the layers of several models.
+  void InitWeights(Matrix &weights, unsigned fanOut, WeightInit init);
+
+  // Inverted dropout of a layer's outputs, applied as they are computed: each output is kept with
+  // probability keepProb and scaled by 1/keepProb. Column c of a batch draws its mask from stream
+  // (stream + c) of seed, so the mask doesn't depend on how the work is split up.
+  struct Dropout {
+    float keepProb = 1.0f;
+    uint64_t seed = 0;
+    uint64_t stream = 0;
+  };
+
+  // The dropout of a layer's outputs for a batch starting at firstSample of the minibatch.
+  Dropout LayerDropout(const LayerRegularization &regularization, unsigned layer,
+                       uint64_t seed, unsigned firstSample);
+
+  // out = dropout(sigmoid(weights * [1; in]))
+  void Forward(const Matrix &weights, const Matrix &in, Matrix &out, unsigned numChunks = 1,
+               const Dropout &dropout = Dropout());
+
+  // out = weights * [1; in], the output layer's logits, activated according to the loss by
+  // ActivateOutputs or consumed directly by OutputDelta.
+  void Logits(const Matrix &weights, const Matrix &in, Matrix &out, unsigned numChunks = 1);
+
+  // Propagates the deltas of a layer back to the previous layer, prevOut being the previous
+  // layer's activations and prevKeepProb the dropout keep probability they were produced with.
+  // The mask needs no storing, as dropped activations are zero and kept ones are scaled.
+  void Backward(const Matrix &weights, const Matrix &delta, const Matrix &prevOut,
+                Matrix &prevDelta, unsigned numChunks = 1, float prevKeepProb = 1.0f);
+
+  // gradient += delta * [1; in]^T
+  void AccumulateGradient(
+      const Matrix &delta, const Matrix &in, Matrix &gradient, unsigned numChunks = 1);
+
+  // Turns a summed gradient into the gradient of the regularized mean error, in a single pass:
+  // gradient = gradient * scale + weight decay. A gradient holding only the given weight columns
+  // (see LayerUpdateFunc) only decays those weights.
+  void FinishGradient(Matrix &gradient, float scale, const Matrix &weights,
+                      const LayerRegularization &regularization, const vector<unsigned> &columns);
+
+  // Versions of Forward and AccumulateGradient for a layer fed by sparse inputs, only touching
+  // the weight columns of the non-zero inputs. The gradient only holds the weight columns given in
+  // columns (sorted, see LayerUpdateFunc), which must cover the bias and all non-zero inputs.
+  void SparseForward(const Matrix &weights, const SparseMatrix &in, Matrix &out,
+                     const Dropout &dropout = Dropout());
+  void SparseLogits(const Matrix &weights, const SparseMatrix &in, Matrix &out);
+  void SparseAccumulateGradient(const Matrix &delta, const SparseMatrix &in,
+                                const vector<unsigned> &columns, Matrix &gradient);
+
+  // Keeps normalized values finite however small the variance they're normalized by.
+  static const float NORMALIZATION_EPSILON = 1e-5f;
+
+  // What back-propagating through a normalized layer needs from its forward pass: the normalized
+  // pre-activations, and the inverse standard deviations they were normalized by (one per row for
+  // batch normalization, one per column for layer normalization). Batch normalization also
+  // leaves the batch's mean and variance of each row.
+  struct NormalizationCache {
+    Matrix normalized;
+    Vector invStd;
+    Vector mean;
+    Vector variance;
+  };
+
+  // out = dropout(sigmoid(scale * normalize(weights[:, 1:] * in) + weights[:, 0])), a hidden layer
+  // with batch or layer normalization (see Normalization), scale having a row per output. After
+  // the product, normalization, scale, shift and activation are a single pass over each column
+  // of out (batch normalization taking one more for its statistics). The cache may only be null
+  // for layer normalization, when nothing is to be back-propagated.
+  void NormalizedForward(const Matrix &weights, const Matrix &scale, Normalization normalization,
+                         const Matrix &in, Matrix &out, NormalizationCache *cache,
+                         unsigned numChunks = 1, const Dropout &dropout = Dropout());
+
+  // AccumulateGradient for a layer run by NormalizedForward. delta holds the gradient with respect
+  // to the scaled and shifted values (as written by Backward) and is turned, in a single pass for
+  // layer normalization or two for batch normalization, into the gradient with respect to the
+  // product, for Backward to propagate on. The shifts' gradient is added to column 0 of gradient,
+  // the weights' to the other columns, and the scales' to scaleGradient.
+  void NormalizedAccumulateGradient(const Matrix &scale, Normalization normalization,
+                                    const NormalizationCache &cache, const Matrix &in,
+                                    Matrix &delta, Matrix &gradient, Matrix &scaleGradient,
+                                    unsigned numChunks = 1);
+
+  // Folds a batch normalized layer, for inference with the given mean and variance, into plain
+  // weights for Forward: normalizing and scaling become a scaling of each row of weights, and the
+  // mean is taken out through the bias.
+  void FoldBatchNormalization(const Matrix &weights, const Matrix &scale, const Vector &mean,
+                              const Vector &variance, Matrix &folded);
+
+  // Turns output layer logits into the network's outputs, in place.
+  void ActivateOutputs(Matrix &logits, const Loss &loss);
+
+  // Writes the output layer deltas (the gradient of the loss with respect to the logits) and
+  // returns the loss summed over the batch. Each loss is computed from the logits together with
+  // its gradient, in a form that stays finite however saturated the outputs are. If given,
+  // sampleWeights scale each sample's delta and its share of the returned loss, and each sample's
+  // unweighted loss is written to sampleLosses (both having an entry per column).
+  float OutputDelta(const Matrix &logits, const Matrix &targets, const Loss &loss, Matrix &delta,
+                    const float *sampleWeights = nullptr, float *sampleLosses = nullptr);
+}
+
+template<typename Func>
+void LayerKernels::ForRowChunks(unsigned totalRows, unsigned numChunks, Func fn) {
+  unsigned alignedRows = (totalRows + CHUNK_ROW_ALIGN - 1) / CHUNK_ROW_ALIGN;
+  numChunks = max(1u, min(numChunks, alignedRows));
+
+  if (numChunks == 1) {
+    fn(0, totalRows);
+    return;
+  }
+
+  auto chunkStart = [=](unsigned i) {
+    return min(totalRows, ((i * alignedRows) / numChunks) * CHUNK_ROW_ALIGN);
+  };
+
+  vector<future<void>> futures;
+  futures.reserve(numChunks - 1);
+  for (unsigned i = 1; i < numChunks; i++) {
+    unsigned start = chunkStart(i);
+    unsigned end = chunkStart(i + 1);
+    futures.push_back(ThreadPool::instance().Execute([fn, start, end]() {
+      fn(start, end - start);
+    }));
+  }
+
+  fn(0, chunkStart(1));
+  for (auto& f : futures) {
+    f.get();
+  }
+}
@@ -0,0 +1,71 @@
+
+#include "MemoryPlanner.hpp"
+#include <cassert>
+#include <limits>
+
+
+static size_t alignedSize(size_t size) {
+  return (size + MemoryPlanner::BUFFER_ALIGN - 1) / MemoryPlanner::BUFFER_ALIGN *
+      MemoryPlanner::BUFFER_ALIGN;
+}
+
+static bool overlap(const BufferLifetime &a, const BufferLifetime &b) {
+  return a.firstUse <= b.lastUse && b.firstUse <= a.lastUse;
+}
+
+MemoryPlan MemoryPlanner::Plan(const vector<BufferLifetime> &buffers) {
+  MemoryPlan result;
+  result.offsets.assign(buffers.size(), 0);
+  result.arenaSize = 0;
+  result.unplannedSize = 0;
+
+  vector<unsigned> order(buffers.size());
+  for (unsigned i = 0; i < buffers.size(); i++) {
+    assert(buffers[i].firstUse <= buffers[i].lastUse);
+    order[i] = i;
+    result.unplannedSize += alignedSize(buffers[i].size);
+  }
+
+  stable_sort(order.begin(), order.end(), [&buffers](unsigned a, unsigned b) {
+    return buffers[a].size > buffers[b].size;
+  });
+
+  vector<unsigned> placed;
+  vector<pair<size_t, size_t>> occupied;
+  for (unsigned b : order) {
+    const size_t size = alignedSize(buffers[b].size);
+
+    occupied.clear();
+    for (unsigned p : placed) {
+      if (overlap(buffers[b], buffers[p])) {
+        occupied.emplace_back(result.offsets[p], result.offsets[p] + alignedSize(buffers[p].size));
+      }
+    }
+    sort(occupied.begin(), occupied.end());
+
+    size_t bestOffset = 0;
+    size_t bestGap = numeric_limits<size_t>::max();
+    size_t gapStart = 0;
+    for (const auto& range : occupied) {
+      if (range.first > gapStart) {
+        size_t gap = range.first - gapStart;
+        if (gap >= size && gap < bestGap) {
+          bestOffset = gapStart;
+          bestGap = gap;
+        }
+      }
+      gapStart = max(gapStart, range.second);
+    }
+
+    // Nothing fits between the live buffers, so it goes after all of them.
+    if (bestGap == numeric_limits<size_t>::max()) {
+      bestOffset = gapStart;
+    }
+
+    result.offsets[b] = bestOffset;
+    result.arenaSize = max(result.arenaSize, bestOffset + size);
+    placed.push_back(b);
+  }
+
+  return result;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "../common/Common.hpp"
+#include <cstddef>
+#include <vector>
+
+
+// A buffer that must hold its contents from step firstUse to step lastUse inclusive. Sizes are in
+// floats.
+struct BufferLifetime {
+  size_t size;
+  unsigned firstUse;
+  unsigned lastUse;
+};
+
+// Offsets (in floats) of each buffer within a single arena of arenaSize floats. Buffers with
+// overlapping lifetimes never overlap in the arena.
+struct MemoryPlan {
+  vector<size_t> offsets;
+  size_t arenaSize;
+
+  // The arena size if every buffer had memory of its own.
+  size_t unplannedSize;
+};
+
+namespace MemoryPlanner {
+
+  // Offsets are kept to multiples of this many floats, so that every buffer starts on a cache
+  // line and can be mapped as aligned.
+  static const unsigned BUFFER_ALIGN = 16;
+
+  // Greedy by size: the largest buffers are placed first, each at the smallest gap between the
+  // already placed buffers that it is live at the same time as which is big enough to hold it.
+  MemoryPlan Plan(const vector<BufferLifetime> &buffers);
+}
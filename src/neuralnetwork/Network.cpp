@@ -1,8 +1,13 @@
 
 #include "Network.hpp"
-#include "../util/Util.hpp"
+#include "InferenceCache.hpp"
+#include "LayerKernels.hpp"
+#include "PipelineExecutor.hpp"
+#include "../common/RcuPointer.hpp"
 #include "../common/ThreadPool.hpp"
+#include "../util/Random.hpp"
 #include <cassert>
+#include <chrono>
 #include <cmath>
 #include <future>
 #include <iostream>
@@ -10,12 +15,45 @@
 #include <atomic>
 
 
-static const float INIT_WEIGHT_RANGE = 0.1f;
+// With fewer samples than this per thread, splitting a batch across the threads leaves each too
+// little work, so for large layers the individual layer products are split across threads instead.
+static const unsigned MIN_SAMPLES_PER_WORKER = 16;
 
+// The weight of each minibatch's statistics in the running averages batch normalization
+// inference uses.
+static const float BATCH_STATISTICS_MOMENTUM = 0.1f;
 
+// Of the normalization scales, which are never decayed.
+static const LayerRegularization NO_REGULARIZATION{0.0f, 0.0f, 0.0f};
+
+
+// Per worker state, each worker processing its subset of the samples as a single batch.
 struct NetworkContext {
-  vector<Vector> layerOutputs;
-  vector<Vector> layerDeltas;
+  bool sparseInputs;
+  Matrix inputs;
+  SparseMatrix sparse;
+  Matrix targets;
+
+  // Layers whose outputs (or deltas) aren't currently held are left empty, see
+  // SetCheckpointInterval. Unless activation memory is limited, they're all kept from one batch to
+  // the next, so that the same sized batches reuse their storage.
+  vector<Matrix> layerOutputs;
+  vector<Matrix> layerDeltas;
+  bool limitActivations;
+
+  // What the subset's forward pass was run with, for recomputing layer outputs identically.
+  uint64_t dropoutSeed;
+  unsigned firstSample;
+
+  // For each normalized layer, what back-propagation needs from the forward pass (held along with
+  // the layer's outputs). For batch normalization, the sums over the subset's batches of each
+  // batch's means and mean squares, weighted by its size.
+  vector<LayerKernels::NormalizationCache> normalization;
+  vector<Vector> batchMeanSums;
+  vector<Vector> batchSquareSums;
+
+  Tensor gradient;
+  float error;
 };
 
 
@@ -24,71 +62,536 @@ struct Network::NetworkImpl {
   unsigned numOutputs;
   unsigned numLayers;
 
+  // The layers' weights, followed by the scales of the normalized layers in layer order.
   Tensor layerWeights;
   Tensor zeroGradient;
+  vector<LayerRegularization> regularization;
+  Loss loss;
+
+  // For each layer, its normalization and the index of its scales in layerWeights (-1 for none).
+  // Batch normalization keeps running averages of the batch statistics for inference, whose
+  // weights (with batch normalization folded in) are kept in inferenceWeights.
+  vector<Normalization> normalization;
+  vector<int> scaleIndex;
+  vector<Vector> runningMean;
+  vector<Vector> runningVariance;
+  Tensor inferenceWeights;
+
+  // Empty unless updates are restricted by SetWeightMask.
+  Tensor weightMask;
+
+  ParallelMode parallelMode;
+  uptr<PipelineExecutor> pipeline;
+  ExecutionConfig execution;
+
+  unsigned checkpointInterval;
+  size_t activationBudget;
 
+  // Kept between minibatches so that the workers' gradient accumulators (each the size of the
+  // weights) and input buffers are reused rather than reallocated for every step.
+  vector<NetworkContext> workerContexts;
 
-  NetworkImpl(const vector<unsigned> &layerSizes) {
+  // Incremented whenever the weights change.
+  atomic<unsigned long> modelVersion;
+  uptr<InferenceCache> resultCache;
+
+  // With EnableWeightPublication, inference reads the published copies of the weights instead of
+  // layerWeights, which then belong to the trainer alone.
+  uptr<RcuPointer<Tensor>> publishedWeights;
+  unsigned updatesPerVersion;
+  unsigned unpublishedUpdates;
+
+  NetworkImpl(const vector<unsigned> &layerSizes, WeightInit weightInit) :
+      parallelMode(ParallelMode::DATA), checkpointInterval(1), activationBudget(0),
+      modelVersion(0), updatesPerVersion(1), unpublishedUpdates(0) {
     assert(layerSizes.size() >= 2);
     this->numLayers = layerSizes.size() - 1;
     this->numInputs = layerSizes[0];
     this->numOutputs = layerSizes[layerSizes.size() - 1];
 
     for (unsigned i = 0; i < numLayers; i++) {
-      layerWeights.AddLayer(createLayer(layerSizes[i], layerSizes[i+1]));
+      layerWeights.AddLayer(createLayer(layerSizes[i], layerSizes[i+1], weightInit));
     }
 
     zeroGradient = layerWeights;
     for (unsigned i = 0; i < zeroGradient.NumLayers(); i++) {
       zeroGradient(i).setZero();
     }
+
+    regularization.assign(numLayers, NO_REGULARIZATION);
+    normalization.assign(numLayers, Normalization::NONE);
+    scaleIndex.assign(numLayers, -1);
+    runningMean.resize(numLayers);
+    runningVariance.resize(numLayers);
+    loss = Loss{LossType::BINARY_CROSS_ENTROPY, 1.0f};
+    execution = ExecutionConfig{GradientSplit::AUTO, 0, 0, 0};
   }
 
   Vector Process(const Vector &input) {
     assert(input.rows() == numInputs);
+    return ProcessBatch(input);
+  }
 
-    NetworkContext ctx;
-    return process(input, ctx);
+  Matrix ProcessBatch(const Matrix &inputs) {
+    assert(inputs.rows() == numInputs);
+    if (resultCache) {
+      return processBatchCached(inputs);
+    }
+    return readWeights([&](const Tensor &weights) { return forwardLayers(weights, inputs, 0); });
   }
 
-  pair<Tensor, float> ComputeGradient(const TrainingProvider &samplesProvider) {
-    // Single threaded code below
-
-    // auto gradient = make_pair(zeroGradient, 0.0f);
-    // Tensor& netGradient{gradient.first};
-    // float& error{gradient.second};
-    //
-    // for (unsigned i = 0; i < NUM_THREADS; i++) {
-    //   unsigned start = (i * samplesProvider.NumSamples()) / NUM_THREADS;
-    //   unsigned end = ((i+1) * samplesProvider.NumSamples()) / NUM_THREADS;
-    //
-    //   auto subsetGradient = computeGradientSubset(samplesProvider, start, end);
-    //   netGradient += subsetGradient.first;
-    //   error += subsetGradient.second;
-    // }
-
-    const unsigned numSubsets = ThreadPool::instance().NumThreads();
+  Vector Process(const SparseVector &input) {
+    assert(input.size() == numInputs);
+    assert(normalization[0] != Normalization::LAYER);
+
+    return readWeights([&](const Tensor &weights) -> Matrix {
+      Matrix firstLayer;
+      if (numLayers == 1) {
+        LayerKernels::SparseLogits(weights(0), SparseMatrix(input), firstLayer);
+        LayerKernels::ActivateOutputs(firstLayer, loss);
+        return firstLayer;
+      }
+
+      LayerKernels::SparseForward(weights(0), SparseMatrix(input), firstLayer);
+      return forwardLayers(weights, firstLayer, 1);
+    });
+  }
 
+  void EnableWeightPublication(unsigned updates) {
+    assert(updates > 0);
+    updatesPerVersion = updates;
+    unpublishedUpdates = 0;
+    publishedWeights = make_unique<RcuPointer<Tensor>>(make_unique<Tensor>(inferenceTensor()));
+  }
+
+  unsigned long NumPublishedVersions(void) const {
+    return publishedWeights ? publishedWeights->NumPublished() : 0;
+  }
+
+  void EnableResultCache(unsigned capacity, float quantizationStep) {
+    resultCache = make_unique<InferenceCache>(capacity, quantizationStep);
+  }
+
+  CacheStats GetResultCacheStats(void) const {
+    return resultCache ? resultCache->GetStats() : CacheStats{};
+  }
+
+  void SetParallelMode(ParallelMode mode) {
+    assert(mode != ParallelMode::PIPELINE || !hasNormalization());
+    parallelMode = mode;
+    if (mode == ParallelMode::PIPELINE) {
+      pipeline = make_unique<PipelineExecutor>(layerWeights, ThreadPool::instance().NumThreads());
+    } else {
+      pipeline.reset();
+    }
+  }
+
+  void SetRegularization(unsigned layer, const LayerRegularization &layerRegularization) {
+    assert(layer < numLayers);
+    assert(layerRegularization.dropoutRate >= 0.0f && layerRegularization.dropoutRate < 1.0f);
+    assert(layer < numLayers - 1 || layerRegularization.dropoutRate == 0.0f);
+    assert(layerRegularization.l2Decay >= 0.0f && layerRegularization.l1Decay >= 0.0f);
+
+    regularization[layer] = layerRegularization;
+  }
+
+  void SetNormalization(unsigned layer, Normalization layerNormalization) {
+    assert(layer < numLayers - 1);
+    assert(parallelMode != ParallelMode::PIPELINE);
+
+    // The scales are rebuilt in layer order, keeping those of layers that stay normalized.
+    Tensor weights;
+    for (unsigned i = 0; i < numLayers; i++) {
+      weights.AddLayer(layerWeights(i));
+    }
+
+    const unsigned rows = layerWeights(layer).rows();
+    for (unsigned i = 0; i < numLayers; i++) {
+      const Normalization n = i == layer ? layerNormalization : normalization[i];
+      if (n == Normalization::NONE) {
+        scaleIndex[i] = -1;
+        continue;
+      }
+
+      weights.AddLayer(scaleIndex[i] >= 0 ? layerWeights(scaleIndex[i])
+                                          : Matrix::Ones(layerWeights(i).rows(), 1));
+      scaleIndex[i] = weights.NumLayers() - 1;
+    }
+
+    normalization[layer] = layerNormalization;
+    runningMean[layer] = Vector::Zero(rows);
+    runningVariance[layer] = Vector::Ones(rows);
+
+    layerWeights = weights;
+    zeroGradient = layerWeights;
+    for (unsigned i = 0; i < zeroGradient.NumLayers(); i++) {
+      zeroGradient(i).setZero();
+    }
+    assert(weightMask.NumLayers() == 0);
+    weightsChanged(true);
+  }
+
+  Tensor GetInferenceWeights(void) const {
+    Tensor result;
+    for (unsigned i = 0; i < numLayers; i++) {
+      assert(normalization[i] != Normalization::LAYER);
+      result.AddLayer(inferenceTensor()(i));
+    }
+    return result;
+  }
+
+  void SetLoss(const Loss &newLoss) {
+    assert(newLoss.type != LossType::HUBER || newLoss.huberDelta > 0.0f);
+    assert(newLoss.type != LossType::SOFTMAX_CROSS_ENTROPY || numOutputs > 1);
+
+    loss = newLoss;
+    modelVersion++;
+  }
+
+  Loss GetLoss(void) const {
+    return loss;
+  }
+
+  void SetCheckpointInterval(unsigned interval) {
+    assert(interval > 0);
+    checkpointInterval = interval;
+  }
+
+  void SetActivationMemoryBudget(size_t budgetBytes) {
+    activationBudget = budgetBytes;
+  }
+
+  unsigned CheckpointInterval(unsigned batchSize) const {
+    if (activationBudget == 0) {
+      return checkpointInterval;
+    }
+
+    unsigned leastMemoryInterval = 1;
+    for (unsigned interval = 1; interval <= numLayers; interval++) {
+      if (activationBytes(batchSize, interval) <= activationBudget) {
+        return interval;
+      }
+      if (activationBytes(batchSize, interval) < activationBytes(batchSize, leastMemoryInterval)) {
+        leastMemoryInterval = interval;
+      }
+    }
+    return leastMemoryInterval;
+  }
+
+  size_t ActivationMemoryBytes(unsigned batchSize) const {
+    return activationBytes(batchSize, CheckpointInterval(batchSize));
+  }
+
+  pair<Tensor, float> ComputeGradient(const TrainingProvider &samplesProvider) {
     auto gradient = make_pair(zeroGradient, 0.0f);
     Tensor& netGradient{gradient.first};
-    float& error{gradient.second};
 
-    mutex gradientMutex;
+    gradient.second = computeGradient(samplesProvider,
+        [&netGradient](unsigned layer, Matrix &layerGradient, const vector<unsigned> &columns) {
+          if (columns.empty()) {
+            netGradient(layer).swap(layerGradient);
+          } else {
+            for (unsigned i = 0; i < columns.size(); i++) {
+              netGradient(layer).col(columns[i]) = layerGradient.col(i);
+            }
+          }
+        }, false);
+
+    // The running batch statistics have changed, and with them the inference weights.
+    if (hasBatchNormalization()) {
+      weightsChanged(false);
+    }
+    return gradient;
+  }
+
+  float ComputeAndApplyGradient(
+      const TrainingProvider &samplesProvider, const LayerUpdateFunc &updateFunc) {
+    float error;
+    if (weightMask.NumLayers() == 0) {
+      error = computeGradient(samplesProvider, updateFunc, true);
+    } else {
+      error = computeGradient(samplesProvider,
+          [this, &updateFunc](unsigned layer, Matrix &gradient, const vector<unsigned> &columns) {
+            updateFunc(layer, gradient, columns);
+            maskUpdate(layer, gradient, columns);
+          }, true);
+    }
+
+    weightsChanged(false);
+    return error;
+  }
+
+  void ApplyUpdate(const Tensor &weightUpdates) {
+    if (weightMask.NumLayers() == 0) {
+      layerWeights += weightUpdates;
+    } else {
+      for (unsigned i = 0; i < layerWeights.NumLayers(); i++) {
+        layerWeights(i) += weightUpdates(i).cwiseProduct(weightMask(i));
+      }
+    }
+    weightsChanged(false);
+  }
+
+  void SetWeightMask(const Tensor &mask) {
+    assert(mask.NumLayers() == 0 || mask.NumLayers() == layerWeights.NumLayers());
+    for (unsigned i = 0; i < mask.NumLayers(); i++) {
+      assert(mask(i).rows() == layerWeights(i).rows());
+      assert(mask(i).cols() == layerWeights(i).cols());
+    }
+
+    weightMask = mask;
+  }
+
+  Tensor GetWeightMask(void) const {
+    return weightMask;
+  }
+
+  void SetWeights(const Tensor &weights) {
+    assert(weights.NumLayers() == layerWeights.NumLayers());
+    for (unsigned i = 0; i < weights.NumLayers(); i++) {
+      assert(weights(i).rows() == layerWeights(i).rows());
+      assert(weights(i).cols() == layerWeights(i).cols());
+    }
+
+    layerWeights = weights;
+    weightsChanged(true);
+  }
+
+private:
+
+  // Publishes the weights (if enabled) every updatesPerVersion updates, or straight away if
+  // forced. The version is bumped after publishing, so that the result cache never files results
+  // from older weights under a newer version.
+  void weightsChanged(bool forcePublish) {
+    if (hasBatchNormalization()) {
+      foldBatchNormalization();
+    }
+    if (publishedWeights && (forcePublish || ++unpublishedUpdates >= updatesPerVersion)) {
+      publishedWeights->Publish(make_unique<Tensor>(inferenceTensor()));
+      unpublishedUpdates = 0;
+    }
+    modelVersion++;
+  }
+
+  bool hasNormalization(void) const {
+    return layerWeights.NumLayers() > numLayers;
+  }
+
+  bool hasBatchNormalization(void) const {
+    return find(normalization.begin(), normalization.end(), Normalization::BATCH) !=
+           normalization.end();
+  }
+
+  // The weights inference runs with, see forwardLayers.
+  const Tensor& inferenceTensor(void) const {
+    return hasBatchNormalization() ? inferenceWeights : layerWeights;
+  }
+
+  // Brings inferenceWeights up to date, reusing its matrices.
+  void foldBatchNormalization(void) {
+    if (inferenceWeights.NumLayers() != layerWeights.NumLayers()) {
+      inferenceWeights = layerWeights;
+    }
+
+    for (unsigned i = 0; i < layerWeights.NumLayers(); i++) {
+      if (i < numLayers && normalization[i] == Normalization::BATCH) {
+        LayerKernels::FoldBatchNormalization(layerWeights(i), layerWeights(scaleIndex[i]),
+                                             runningMean[i], runningVariance[i],
+                                             inferenceWeights(i));
+      } else {
+        inferenceWeights(i) = layerWeights(i);
+      }
+    }
+  }
+
+  // Returns fn(weights) for the weights inference should use.
+  template<typename Func>
+  Matrix readWeights(Func fn) const {
+    return publishedWeights ? publishedWeights->Read(fn) : fn(inferenceTensor());
+  }
+
+  // Runs the given activations through the layers from firstLayer onwards, with inference weights
+  // (in which batch normalized layers are plain layers).
+  Matrix forwardLayers(const Tensor &layerWeights, const Matrix &activations, unsigned firstLayer) {
+    Matrix output = activations;
+    Matrix layerOutput;
+    for (unsigned i = firstLayer; i < numLayers; i++) {
+      const Matrix &weights = layerWeights(i);
+      const unsigned chunks = LayerKernels::IntraOpChunks(weights, output.cols());
+      if (i == numLayers - 1) {
+        LayerKernels::Logits(weights, output, layerOutput, chunks);
+        LayerKernels::ActivateOutputs(layerOutput, loss);
+      } else if (normalization[i] == Normalization::LAYER) {
+        LayerKernels::NormalizedForward(weights, layerWeights(scaleIndex[i]), normalization[i],
+                                        output, layerOutput, nullptr, chunks);
+      } else {
+        LayerKernels::Forward(weights, output, layerOutput, chunks);
+      }
+      output.swap(layerOutput);
+    }
+
+    assert(output.rows() == numOutputs);
+    return output;
+  }
+
+  // Serves what it can from the result cache, running the remaining inputs as a smaller batch.
+  Matrix processBatchCached(const Matrix &inputs) {
+    using Clock = std::chrono::steady_clock;
+    auto start = Clock::now();
+    const unsigned long version = modelVersion.load();
+
+    Matrix result(numOutputs, inputs.cols());
+    vector<unsigned> misses;
+
+    Vector cached;
+    for (unsigned i = 0; i < inputs.cols(); i++) {
+      if (resultCache->Lookup(inputs.col(i), version, cached)) {
+        result.col(i) = cached;
+      } else {
+        misses.push_back(i);
+      }
+    }
+
+    auto lookupDone = Clock::now();
+    unsigned numHits = inputs.cols() - misses.size();
+    if (numHits > 0) {
+      auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(lookupDone - start);
+      resultCache->RecordHitLatency(elapsed.count() * numHits / inputs.cols());
+    }
+
+    if (misses.empty()) {
+      return result;
+    }
+
+    Matrix missInputs(numInputs, misses.size());
+    for (unsigned i = 0; i < misses.size(); i++) {
+      missInputs.col(i) = inputs.col(misses[i]);
+    }
+
+    Matrix missOutputs = readWeights(
+        [&](const Tensor &weights) { return forwardLayers(weights, missInputs, 0); });
+    for (unsigned i = 0; i < misses.size(); i++) {
+      result.col(misses[i]) = missOutputs.col(i);
+      resultCache->Insert(missInputs.col(i), version, missOutputs.col(i));
+    }
+
+    // Misses are charged for their share of the lookups as well as the forward pass.
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start);
+    auto lookupElapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(lookupDone - start);
+    resultCache->RecordMissLatency(
+        elapsed.count() - lookupElapsed.count() * numHits / inputs.cols());
+
+    return result;
+  }
+
+  Matrix createLayer(unsigned inputSize, unsigned layerSize, WeightInit weightInit) {
+    assert(inputSize > 0 && layerSize > 0);
+
+    unsigned numRows = layerSize;
+    unsigned numCols = inputSize + 1; // +1 accounts for bias input
+
+    Matrix result(numRows, numCols);
+    LayerKernels::InitWeights(result, layerSize, weightInit);
+    return result;
+  }
+
+  float computeGradient(const TrainingProvider &samplesProvider,
+                        const LayerUpdateFunc &updateFunc, bool applyUpdate) {
+    const unsigned numSamples = samplesProvider.NumSamples();
+    assert(numSamples > 0);
+
+    // Every path draws the same dropout masks for a given seed.
+    PhiloxRng &rng = Random::ThreadStream();
+    const uint64_t dropoutSeed = ((uint64_t) rng() << 32) | rng();
+
+    // Batches of sparse samples always take the data-parallel path, which has sparse kernels.
+    vector<unsigned> inputColumns;
+    if (samplesProvider.IsSparse()) {
+      inputColumns = activeInputColumns(samplesProvider);
+    } else if (parallelMode == ParallelMode::PIPELINE) {
+      return pipeline->ComputeGradient(layerWeights, zeroGradient, regularization, loss,
+                                       dropoutSeed, samplesProvider, updateFunc, applyUpdate);
+    }
+
+    // However the samples are split between the workers, all of their activations are held at
+    // once, so the interval depends on the whole minibatch.
+    const unsigned interval = CheckpointInterval(numSamples);
+
+    if (useIntraOpParallelism(numSamples)) {
+      return computeGradientIntraOp(
+          samplesProvider, inputColumns, dropoutSeed, interval, updateFunc, applyUpdate);
+    }
+
+    const unsigned numSubsets = min(numWorkers(), numSamples);
+    assert(numSubsets > 0);
+
+    if (workerContexts.size() < numSubsets) {
+      workerContexts.resize(numSubsets);
+    }
+    vector<NetworkContext> &contexts = workerContexts;
+
+    // The number of workers that have back-propagated through each layer. The last worker to
+    // finish a layer reduces its gradient and applies the update, overlapping with the other
+    // workers still back-propagating through the earlier layers.
+    vector<atomic<unsigned>> layerDone(numLayers);
+    for (auto& ld : layerDone) {
+      ld = 0;
+    }
+
+    auto reduceLayer = [&](unsigned layer) {
+      for (int index : {(int) layer, scaleIndex[layer]}) {
+        if (index < 0) {
+          continue;
+        }
+
+        Matrix &layerGradient = contexts[0].gradient(index);
+        for (unsigned i = 1; i < numSubsets; i++) {
+          layerGradient += contexts[i].gradient(index);
+        }
+        updateLayer(index, layerGradient, numSamples, inputColumns, updateFunc, applyUpdate);
+      }
+    };
+
     vector<future<void>> futures;
     futures.reserve(numSubsets);
 
     for (unsigned i = 0; i < numSubsets; i++) {
       futures.push_back(ThreadPool::instance().Execute(
-          [this, &gradientMutex, &samplesProvider, &netGradient, &error, i, numSubsets]() {
+          [this, &contexts, &layerDone, &reduceLayer, &samplesProvider, &inputColumns,
+           dropoutSeed, interval, i, numSubsets]() {
         unsigned start = (i * samplesProvider.NumSamples()) / numSubsets;
         unsigned end = ((i+1) * samplesProvider.NumSamples()) / numSubsets;
-        auto subsetGradient = computeGradientSubset(samplesProvider, start, end);
 
-        {
-          std::unique_lock<std::mutex> lock(gradientMutex);
-          netGradient += subsetGradient.first;
-          error += subsetGradient.second;
+        NetworkContext &ctx = contexts[i];
+        zeroSubsetGradient(inputColumns, ctx.gradient);
+        zeroBatchStatistics(ctx);
+
+        // Only the worker's last batch can complete a layer, so the reduction of each layer
+        // still overlaps with the back-propagation of the last batches through earlier layers.
+        // A remainder of under half a batch joins the last full batch rather than running on its
+        // own, as a tiny batch is slow and gives batch normalization meaningless statistics.
+        const unsigned batchSize = execution.workerBatchSize > 0 ? execution.workerBatchSize
+                                                                 : end - start;
+        float error = 0.0f;
+        for (unsigned batchStart = start; batchStart < end; ) {
+          unsigned batchEnd = min(end, batchStart + batchSize);
+          if (end - batchEnd < batchSize / 2) {
+            batchEnd = end;
+          }
+          forwardSubset(samplesProvider, batchStart, batchEnd, dropoutSeed, interval, ctx, false);
+          error += ctx.error;
+
+          for (int l = numLayers - 1; l >= 0; l--) {
+            backwardLayer(l, ctx, inputColumns, false);
+
+            if (batchEnd == end &&
+                layerDone[l].fetch_add(1, std::memory_order_acq_rel) == numSubsets - 1) {
+              reduceLayer(l);
+            }
+          }
+          batchStart = batchEnd;
         }
+        ctx.error = error;
       }));
     }
 
@@ -96,131 +599,485 @@ struct Network::NetworkImpl {
       f.get();
     }
 
-    float scaleFactor = 1.0f / samplesProvider.NumSamples();
-    netGradient *= scaleFactor;
-    error *= scaleFactor;
+    updateRunningStatistics(numSubsets, numSamples);
 
-    return gradient;
+    float error = 0.0f;
+    for (unsigned i = 0; i < numSubsets; i++) {
+      error += contexts[i].error;
+    }
+    return error / numSamples;
   }
 
-  void ApplyUpdate(const Tensor &weightUpdates) {
-    layerWeights += weightUpdates;
+  unsigned numWorkers(void) const {
+    const unsigned numThreads = ThreadPool::instance().NumThreads();
+    return execution.maxWorkers == 0 ? numThreads : min(numThreads, execution.maxWorkers);
   }
 
-private:
+  bool useIntraOpParallelism(unsigned numSamples) {
+    if (execution.split != GradientSplit::AUTO) {
+      return execution.split == GradientSplit::INTRA_OP;
+    }
 
-  Matrix createLayer(unsigned inputSize, unsigned layerSize) {
-    assert(inputSize > 0 && layerSize > 0);
+    if (numSamples >= numWorkers() * MIN_SAMPLES_PER_WORKER) {
+      return false;
+    }
 
-    unsigned numRows = layerSize;
-    unsigned numCols = inputSize + 1; // +1 accounts for bias input
+    for (unsigned i = 0; i < numLayers; i++) {
+      if (LayerKernels::IntraOpChunks(layerWeights(i), numSamples, numWorkers()) > 1) {
+        return true;
+      }
+    }
+    return false;
+  }
 
-    Matrix result(numRows, numCols);
+  // Processes all of the samples as a single batch on the calling thread, splitting each of the
+  // layer operations across the thread pool.
+  float computeGradientIntraOp(const TrainingProvider &samplesProvider,
+                               const vector<unsigned> &inputColumns, uint64_t dropoutSeed,
+                               unsigned interval, const LayerUpdateFunc &updateFunc,
+                               bool applyUpdate) {
+    const unsigned numSamples = samplesProvider.NumSamples();
+
+    if (workerContexts.empty()) {
+      workerContexts.resize(1);
+    }
+    NetworkContext &ctx = workerContexts[0];
+    zeroBatchStatistics(ctx);
+    forwardSubset(samplesProvider, 0, numSamples, dropoutSeed, interval, ctx, true);
+    updateRunningStatistics(1, numSamples);
+
+    zeroSubsetGradient(inputColumns, ctx.gradient);
+    for (int l = numLayers - 1; l >= 0; l--) {
+      backwardLayer(l, ctx, inputColumns, true);
+      updateLayer(l, ctx.gradient(l), numSamples, inputColumns, updateFunc, applyUpdate);
+      if (scaleIndex[l] >= 0) {
+        updateLayer(scaleIndex[l], ctx.gradient(scaleIndex[l]), numSamples, inputColumns,
+                    updateFunc, applyUpdate);
+      }
+    }
 
-    for (unsigned r = 0; r < result.rows(); r++) {
-      for (unsigned c = 0; c < result.cols(); c++) {
-        result(r, c) = Util::RandInterval(-INIT_WEIGHT_RANGE, INIT_WEIGHT_RANGE);
+    return ctx.error / numSamples;
+  }
+
+  // The first layer weight columns touched by a batch of sparse samples: the bias column and the
+  // column of every input that is non-zero in any of the samples.
+  vector<unsigned> activeInputColumns(const TrainingProvider &samplesProvider) {
+    vector<unsigned> result{0};
+    for (unsigned i = 0; i < samplesProvider.NumSamples(); i++) {
+      const SparseVector &input = samplesProvider.GetSample(i).sparseInput;
+      for (SparseVector::InnerIterator it(input); it; ++it) {
+        result.push_back(it.index() + 1);
       }
     }
 
+    sort(result.begin(), result.end());
+    result.erase(unique(result.begin(), result.end()), result.end());
     return result;
   }
 
-  pair<Tensor, float> computeGradientSubset(
-      const TrainingProvider &samplesProvider, unsigned start, unsigned end) {
+  // Zeroes a worker's gradient accumulator in place, where for sparse inputs the first layer only
+  // has the columns of the active inputs. Only the first use (or a change in the number of active
+  // inputs) allocates.
+  void zeroSubsetGradient(const vector<unsigned> &inputColumns, Tensor &gradient) {
+    if (gradient.NumLayers() != layerWeights.NumLayers()) {
+      gradient = zeroGradient;
+    }
 
-    auto gradient = make_pair(zeroGradient, 0.0f);
-    Tensor& netGradient{gradient.first};
-    float& error{gradient.second};
+    for (unsigned i = 0; i < layerWeights.NumLayers(); i++) {
+      const unsigned cols =
+          i == 0 && !inputColumns.empty() ? inputColumns.size() : layerWeights(i).cols();
+      gradient(i).setZero(layerWeights(i).rows(), cols);
+    }
+  }
 
-    NetworkContext ctx;
-    for (unsigned i = start; i < end; i++) {
-      pair<Tensor, float> gradientAndError =
-          computeSampleGradient(samplesProvider.GetSample(i), ctx);
-      netGradient += gradientAndError.first;
-      error += gradientAndError.second;
+  void zeroBatchStatistics(NetworkContext &ctx) {
+    ctx.normalization.resize(numLayers);
+    ctx.batchMeanSums.resize(numLayers);
+    ctx.batchSquareSums.resize(numLayers);
+    for (unsigned l = 0; l < numLayers; l++) {
+      if (normalization[l] == Normalization::BATCH) {
+        ctx.batchMeanSums[l].setZero(layerWeights(l).rows());
+        ctx.batchSquareSums[l].setZero(layerWeights(l).rows());
+      }
     }
+  }
 
-    return gradient;
+  // Blends the statistics of the minibatch, gathered by the first numSubsets workers, into the
+  // running statistics of the batch normalized layers.
+  void updateRunningStatistics(unsigned numSubsets, unsigned numSamples) {
+    for (unsigned l = 0; l < numLayers; l++) {
+      if (normalization[l] != Normalization::BATCH) {
+        continue;
+      }
+
+      Vector mean = workerContexts[0].batchMeanSums[l];
+      Vector meanSquare = workerContexts[0].batchSquareSums[l];
+      for (unsigned i = 1; i < numSubsets; i++) {
+        mean += workerContexts[i].batchMeanSums[l];
+        meanSquare += workerContexts[i].batchSquareSums[l];
+      }
+      mean /= numSamples;
+      meanSquare /= numSamples;
+
+      const Vector variance = (meanSquare - mean.cwiseAbs2()).cwiseMax(0.0f);
+      runningMean[l] += BATCH_STATISTICS_MOMENTUM * (mean - runningMean[l]);
+      runningVariance[l] += BATCH_STATISTICS_MOMENTUM * (variance - runningVariance[l]);
+    }
   }
 
-  Vector process(const Vector &input, NetworkContext &ctx) {
-    assert(input.rows() == numInputs);
+  void updateLayer(unsigned layer, Matrix &layerGradient, unsigned numSamples,
+                   const vector<unsigned> &inputColumns,
+                   const LayerUpdateFunc &updateFunc, bool applyUpdate) {
+    static const vector<unsigned> allColumns;
+    const vector<unsigned> &columns = layer == 0 ? inputColumns : allColumns;
+
+    LayerKernels::FinishGradient(layerGradient, 1.0f / numSamples, layerWeights(layer),
+                                 layer < numLayers ? regularization[layer] : NO_REGULARIZATION,
+                                 columns);
+    updateFunc(layer, layerGradient, columns);
 
-    ctx.layerOutputs.resize(layerWeights.NumLayers());
-    ctx.layerOutputs[0] = getLayerOutput(input, layerWeights(0));
-    for (unsigned i = 1; i < layerWeights.NumLayers(); i++) {
-      ctx.layerOutputs[i] = getLayerOutput(ctx.layerOutputs[i-1], layerWeights(i));
+    if (!applyUpdate) {
+      return;
     }
 
-    assert(ctx.layerOutputs[ctx.layerOutputs.size()-1].rows() == numOutputs);
-    return ctx.layerOutputs[ctx.layerOutputs.size()-1];
+    if (columns.empty()) {
+      layerWeights(layer) += layerGradient;
+    } else {
+      for (unsigned i = 0; i < columns.size(); i++) {
+        layerWeights(layer).col(columns[i]) += layerGradient.col(i);
+      }
+    }
   }
 
-  Vector getLayerOutput(const Vector &prevLayer, const Matrix &layerWeights) {
-    Vector z = layerWeights.topRightCorner(layerWeights.rows(), layerWeights.cols()-1) * prevLayer;
-    for (unsigned i = 0; i < layerWeights.rows(); i++) {
-      z(i) += layerWeights(i, 0);
-      z(i) = activationFunc(z(i));
+  void maskUpdate(unsigned layer, Matrix &update, const vector<unsigned> &columns) {
+    if (columns.empty()) {
+      update.array() *= weightMask(layer).array();
+    } else {
+      for (unsigned i = 0; i < columns.size(); i++) {
+        update.col(i).array() *= weightMask(layer).col(columns[i]).array();
+      }
     }
-    return z;
   }
 
-  float activationFunc(float v) {
-    return 1.0f / (1.0f + expf(-v));
+  unsigned numChunks(unsigned layer, const NetworkContext &ctx, bool intraOp) {
+    if (!intraOp) {
+      return 1;
+    }
+    return LayerKernels::IntraOpChunks(
+        layerWeights(layer), ctx.targets.cols(), numWorkers(), execution.minChunkWork);
   }
 
-  pair<Tensor, float> computeSampleGradient(const TrainingSample &sample, NetworkContext &ctx) {
-    Vector output = process(sample.input, ctx);
+  // Whether the given layer's outputs are kept through the forward pass with the given
+  // checkpoint interval. The output layer's always are, as the output deltas need them.
+  bool isCheckpoint(unsigned layer, unsigned interval) const {
+    return (layer + 1) % interval == 0 || layer == numLayers - 1;
+  }
 
-    ctx.layerDeltas.resize(numLayers);
-    ctx.layerDeltas[ctx.layerDeltas.size() - 1] = output - sample.expectedOutput; // cross entropy error function.
+  // Upper bound on the activations and deltas held at once for a minibatch: the inputs and
+  // targets, the checkpointed outputs, the longest recomputed run of outputs, and the deltas of
+  // the two layers being back-propagated between. Normalized layers' outputs come with their
+  // normalized values.
+  size_t activationBytes(unsigned batchSize, unsigned interval) const {
+    size_t floatsPerSample = numInputs + numOutputs;
+    size_t run = 0, longestRun = 0, largestLayer = 0;
+    for (unsigned l = 0; l < numLayers; l++) {
+      const size_t rows = layerWeights(l).rows();
+      const size_t held = normalization[l] == Normalization::NONE ? rows : 2 * rows;
+      if (isCheckpoint(l, interval)) {
+        floatsPerSample += held;
+        run = 0;
+      } else {
+        run += held;
+        longestRun = max(longestRun, run);
+      }
+      largestLayer = max(largestLayer, rows);
+    }
 
-    for (int i = ctx.layerDeltas.size() - 2; i >= 0; i--) {
-      Matrix noBiasWeights =
-          layerWeights(i+1).bottomRightCorner(layerWeights(i+1).rows(), layerWeights(i+1).cols()-1);
-      ctx.layerDeltas[i] = noBiasWeights.transpose() * ctx.layerDeltas[i+1];
+    floatsPerSample += longestRun + 2 * largestLayer;
+    return floatsPerSample * batchSize * sizeof(float);
+  }
 
-      assert(ctx.layerDeltas[i].rows() == ctx.layerOutputs[i].rows());
-      for (unsigned r = 0; r < ctx.layerDeltas[i].rows(); r++) {
-        float out = ctx.layerOutputs[i](r);
-        ctx.layerDeltas[i](r) *= out * (1.0f - out);
+  void forwardSubset(const TrainingProvider &samplesProvider, unsigned start, unsigned end,
+                     uint64_t dropoutSeed, unsigned interval, NetworkContext &ctx, bool intraOp) {
+    ctx.sparseInputs = samplesProvider.IsSparse();
+    ctx.limitActivations = interval > 1 || activationBudget > 0;
+    ctx.dropoutSeed = dropoutSeed;
+    ctx.firstSample = start;
+    ctx.targets.resize(numOutputs, end - start);
+    for (unsigned i = start; i < end; i++) {
+      samplesProvider.PackOutput(i, ctx.targets.col(i - start));
+    }
+
+    if (ctx.sparseInputs) {
+      packSparseInputs(samplesProvider, start, end, ctx.sparse);
+    } else {
+      ctx.inputs.resize(numInputs, end - start);
+      for (unsigned i = start; i < end; i++) {
+        samplesProvider.PackInput(i, ctx.inputs.col(i - start));
       }
     }
 
-    auto result = make_pair(Tensor(), 0.0f);
-    for (unsigned i = 0; i < numLayers; i++) {
-      auto inputs = getInputWithBias(i == 0 ? sample.input : ctx.layerOutputs[i-1]);
-      result.first.AddLayer(ctx.layerDeltas[i] * inputs.transpose());
+    ctx.layerOutputs.resize(numLayers);
+    for (unsigned l = 0; l < numLayers; l++) {
+      forwardLayer(l, ctx, intraOp);
+
+      // Recomputed outputs are of the same samples, so only this first pass counts.
+      if (normalization[l] == Normalization::BATCH) {
+        const LayerKernels::NormalizationCache &cache = ctx.normalization[l];
+        ctx.batchMeanSums[l] += (end - start) * cache.mean;
+        ctx.batchSquareSums[l] += (end - start) * (cache.variance + cache.mean.cwiseAbs2());
+      }
+
+      // Only the latest outputs are needed to go on with the forward pass.
+      if (l > 0 && !isCheckpoint(l - 1, interval)) {
+        freeOutputs(l - 1, ctx);
+      }
     }
 
-    for (unsigned i = 0; i < output.rows(); i++) {
-      result.second += (output(i) - sample.expectedOutput(i)) * (output(i) - sample.expectedOutput(i));
+    ctx.layerDeltas.resize(numLayers);
+    ctx.error = LayerKernels::OutputDelta(
+        ctx.layerOutputs[numLayers-1], ctx.targets, loss, ctx.layerDeltas[numLayers-1],
+        samplesProvider.SampleWeights(start), samplesProvider.SampleLosses(start));
+  }
+
+  // The output layer's outputs are left as logits, which the loss is computed from.
+  void forwardLayer(unsigned l, NetworkContext &ctx, bool intraOp) {
+    const bool isOutput = l == numLayers - 1;
+    if (l == 0 && ctx.sparseInputs) {
+      assert(normalization[0] == Normalization::NONE);
+      if (isOutput) {
+        LayerKernels::SparseLogits(layerWeights(0), ctx.sparse, ctx.layerOutputs[0]);
+      } else {
+        LayerKernels::SparseForward(layerWeights(0), ctx.sparse, ctx.layerOutputs[0],
+            LayerKernels::LayerDropout(regularization[0], 0, ctx.dropoutSeed, ctx.firstSample));
+      }
+      return;
     }
 
-    return result;
+    const Matrix &layerInput = l == 0 ? ctx.inputs : ctx.layerOutputs[l-1];
+    const unsigned chunks = numChunks(l, ctx, intraOp);
+    const LayerKernels::Dropout dropout =
+        LayerKernels::LayerDropout(regularization[l], l, ctx.dropoutSeed, ctx.firstSample);
+    if (isOutput) {
+      LayerKernels::Logits(layerWeights(l), layerInput, ctx.layerOutputs[l], chunks);
+    } else if (normalization[l] != Normalization::NONE) {
+      LayerKernels::NormalizedForward(layerWeights(l), layerWeights(scaleIndex[l]),
+                                      normalization[l], layerInput, ctx.layerOutputs[l],
+                                      &ctx.normalization[l], chunks, dropout);
+    } else {
+      LayerKernels::Forward(layerWeights(l), layerInput, ctx.layerOutputs[l], chunks, dropout);
+    }
   }
 
-  Vector getInputWithBias(const Vector &noBiasInput) {
-    Vector result(noBiasInput.rows() + 1);
-    result(0) = 1.0f;
-    result.bottomRightCorner(noBiasInput.rows(), 1) = noBiasInput;
-    return result;
+  // Frees a layer's outputs, and its normalized values if it has any.
+  void freeOutputs(unsigned l, NetworkContext &ctx) {
+    Matrix().swap(ctx.layerOutputs[l]);
+    Matrix().swap(ctx.normalization[l].normalized);
+  }
+
+  // Recomputes the outputs of the given layer and those below it back to the nearest layer whose
+  // outputs are held. The dropout masks are a function of the seed, layer and sample, so the
+  // recomputed outputs match the original ones exactly.
+  void recomputeOutputs(unsigned layer, NetworkContext &ctx, bool intraOp) {
+    unsigned first = layer;
+    while (first > 0 && ctx.layerOutputs[first-1].size() == 0) {
+      first--;
+    }
+
+    for (unsigned l = first; l <= layer; l++) {
+      forwardLayer(l, ctx, intraOp);
+    }
+  }
+
+  // Packs the inputs into a sparse matrix with one column per sample (CSR over the samples).
+  void packSparseInputs(const TrainingProvider &samplesProvider,
+                        unsigned start, unsigned end, SparseMatrix &out) {
+    Eigen::VectorXi nonZeros(end - start);
+    for (unsigned i = start; i < end; i++) {
+      nonZeros(i - start) = samplesProvider.GetSample(i).sparseInput.nonZeros();
+    }
+
+    out.resize(numInputs, end - start);
+    out.reserve(nonZeros);
+    for (unsigned i = start; i < end; i++) {
+      const SparseVector &input = samplesProvider.GetSample(i).sparseInput;
+      assert(input.size() == numInputs);
+
+      for (SparseVector::InnerIterator it(input); it; ++it) {
+        out.insert(it.index(), i - start) = it.value();
+      }
+    }
+    out.makeCompressed();
+  }
+
+  // Accumulates the gradient of the given layer and propagates its deltas to the layer below.
+  void backwardLayer(unsigned l, NetworkContext &ctx,
+                     const vector<unsigned> &inputColumns, bool intraOp) {
+    if (l == 0 && ctx.sparseInputs) {
+      LayerKernels::SparseAccumulateGradient(
+          ctx.layerDeltas[0], ctx.sparse, inputColumns, ctx.gradient(0));
+      return;
+    }
+
+    if (l > 0 && ctx.layerOutputs[l-1].size() == 0) {
+      recomputeOutputs(l - 1, ctx, intraOp);
+    }
+
+    const Matrix &layerInput = l == 0 ? ctx.inputs : ctx.layerOutputs[l-1];
+    const unsigned chunks = numChunks(l, ctx, intraOp);
+
+    if (normalization[l] == Normalization::NONE) {
+      LayerKernels::AccumulateGradient(ctx.layerDeltas[l], layerInput, ctx.gradient(l), chunks);
+    } else {
+      LayerKernels::NormalizedAccumulateGradient(
+          layerWeights(scaleIndex[l]), normalization[l], ctx.normalization[l], layerInput,
+          ctx.layerDeltas[l], ctx.gradient(l), ctx.gradient(scaleIndex[l]), chunks);
+    }
+
+    if (l > 0) {
+      LayerKernels::Backward(layerWeights(l), ctx.layerDeltas[l], layerInput,
+                             ctx.layerDeltas[l-1], chunks, 1.0f - regularization[l-1].dropoutRate);
+    }
+
+    // Back-propagation is done with these, which frees the room for any recomputed outputs. The
+    // previous layer's normalized values are still needed for its own gradient.
+    if (ctx.limitActivations) {
+      Matrix().swap(ctx.layerDeltas[l]);
+      Matrix().swap(ctx.normalization[l].normalized);
+      if (l > 0) {
+        Matrix().swap(ctx.layerOutputs[l-1]);
+      }
+    }
   }
 };
 
 
-Network::Network(const vector<unsigned> &layerSizes) : impl(new NetworkImpl(layerSizes)) {}
+Network::Network(const vector<unsigned> &layerSizes, WeightInit weightInit) :
+    impl(new NetworkImpl(layerSizes, weightInit)) {}
 Network::~Network() = default;
 
+void Network::SetParallelMode(ParallelMode mode) {
+  impl->SetParallelMode(mode);
+}
+
+void Network::SetRegularization(unsigned layer, const LayerRegularization &regularization) {
+  impl->SetRegularization(layer, regularization);
+}
+
+void Network::SetNormalization(unsigned layer, Normalization normalization) {
+  impl->SetNormalization(layer, normalization);
+}
+
+Normalization Network::GetNormalization(unsigned layer) const {
+  assert(layer < impl->numLayers);
+  return impl->normalization[layer];
+}
+
+void Network::SetLoss(const Loss &loss) {
+  impl->SetLoss(loss);
+}
+
+Loss Network::GetLoss(void) const {
+  return impl->GetLoss();
+}
+
+void Network::SetCheckpointInterval(unsigned interval) {
+  impl->SetCheckpointInterval(interval);
+}
+
+void Network::SetActivationMemoryBudget(size_t budgetBytes) {
+  impl->SetActivationMemoryBudget(budgetBytes);
+}
+
+unsigned Network::CheckpointInterval(unsigned batchSize) const {
+  return impl->CheckpointInterval(batchSize);
+}
+
+size_t Network::ActivationMemoryBytes(unsigned batchSize) const {
+  return impl->ActivationMemoryBytes(batchSize);
+}
+
+ParallelMode Network::GetParallelMode(void) const {
+  return impl->parallelMode;
+}
+
+void Network::SetExecutionConfig(const ExecutionConfig &config) {
+  impl->execution = config;
+}
+
+ExecutionConfig Network::GetExecutionConfig(void) const {
+  return impl->execution;
+}
+
+vector<unsigned> Network::LayerSizes(void) const {
+  vector<unsigned> result{impl->numInputs};
+  for (unsigned i = 0; i < impl->numLayers; i++) {
+    result.push_back(impl->layerWeights(i).rows());
+  }
+  return result;
+}
+
+void Network::EnableWeightPublication(unsigned updatesPerVersion) {
+  impl->EnableWeightPublication(updatesPerVersion);
+}
+
+unsigned long Network::NumPublishedVersions(void) const {
+  return impl->NumPublishedVersions();
+}
+
+unsigned Network::NumLayers(void) const {
+  return impl->numLayers;
+}
+
+Tensor Network::GetWeights(void) const {
+  return impl->layerWeights;
+}
+
+void Network::SetWeights(const Tensor &weights) {
+  impl->SetWeights(weights);
+}
+
+Tensor Network::GetInferenceWeights(void) const {
+  return impl->GetInferenceWeights();
+}
+
 Vector Network::Process(const Vector &input) {
   return impl->Process(input);
 }
 
+Vector Network::Process(const SparseVector &input) {
+  return impl->Process(input);
+}
+
+Matrix Network::ProcessBatch(const Matrix &inputs) {
+  return impl->ProcessBatch(inputs);
+}
+
+void Network::EnableResultCache(unsigned capacity, float quantizationStep) {
+  impl->EnableResultCache(capacity, quantizationStep);
+}
+
+CacheStats Network::GetResultCacheStats(void) const {
+  return impl->GetResultCacheStats();
+}
+
+void Network::SetWeightMask(const Tensor &mask) {
+  impl->SetWeightMask(mask);
+}
+
+Tensor Network::GetWeightMask(void) const {
+  return impl->GetWeightMask();
+}
+
 pair<Tensor, float> Network::ComputeGradient(const TrainingProvider &samplesProvider) {
   return impl->ComputeGradient(samplesProvider);
 }
 
+float Network::ComputeAndApplyGradient(
+    const TrainingProvider &samplesProvider, const LayerUpdateFunc &updateFunc) {
+  return impl->ComputeAndApplyGradient(samplesProvider, updateFunc);
+}
+
 void Network::ApplyUpdate(const Tensor &weightUpdates) {
   impl->ApplyUpdate(weightUpdates);
 }
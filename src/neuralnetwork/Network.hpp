@@ -1,23 +1,147 @@
 #pragma once
 
 #include "TrainingProvider.hpp"
+#include "InferenceCache.hpp"
 #include "../common/Common.hpp"
 #include "../common/Math.hpp"
 #include "Tensor.hpp"
 #include <vector>
 
 
+// DATA splits each batch of samples across the thread pool, every thread running all of the
+// layers. PIPELINE instead splits the layers across the thread pool (see PipelineExecutor).
+enum class ParallelMode {
+  DATA,
+  PIPELINE
+};
+
+// How DATA mode parallelises a minibatch's gradient:
+//   AUTO: INTRA_OP when the samples are too few to give every worker a useful share and some
+//     layer is large enough to split, SAMPLES otherwise.
+//   SAMPLES: the samples are split evenly between the workers, each running all of the layers.
+//   INTRA_OP: the minibatch is run as a single batch, each large layer product being split across
+//     the workers.
+enum class GradientSplit {
+  AUTO,
+  SAMPLES,
+  INTRA_OP
+};
+
+// Fine tuning of DATA mode training for a particular topology and host, as chosen by the
+// Autotuner. Zero fields keep the defaults.
+struct ExecutionConfig {
+  GradientSplit split;
+
+  // The most thread pool threads used (0 for all of them).
+  unsigned maxWorkers;
+
+  // With SAMPLES, each worker runs its share in batches of at most this many samples (0 for a
+  // single batch), trading larger products for activations that stay in cache.
+  unsigned workerBatchSize;
+
+  // With INTRA_OP, the fewest multiply-adds in each split off piece of a layer product.
+  unsigned minChunkWork;
+};
+
 class Network {
 public:
   static void OutputDebugging(void);
 
-  Network(const vector<unsigned> &layerSizes);
+  Network(const vector<unsigned> &layerSizes, WeightInit weightInit = WeightInit::UNIFORM);
   virtual ~Network();
 
+  void SetParallelMode(ParallelMode mode);
+  ParallelMode GetParallelMode(void) const;
+
+  // Defaults to AUTO with every other field 0.
+  void SetExecutionConfig(const ExecutionConfig &config);
+  ExecutionConfig GetExecutionConfig(void) const;
+
+  // Regularization applied when computing gradients, none by default. The output layer can't use
+  // dropout. Dropout only applies to training, Process and ProcessBatch are unaffected.
+  void SetRegularization(unsigned layer, const LayerRegularization &regularization);
+
+  // Normalization of a hidden layer (see Normalization), none by default. Normalized layers add
+  // their scales to the weights, so this must be set before training starts, and not combined
+  // with PIPELINE mode, a weight mask or sparse inputs to a normalized first layer.
+  void SetNormalization(unsigned layer, Normalization normalization);
+  Normalization GetNormalization(unsigned layer) const;
+
+  // The loss training minimises, which also sets the output layer's activation (see LossType).
+  // Binary cross entropy by default.
+  void SetLoss(const Loss &loss);
+  Loss GetLoss(void) const;
+
+  unsigned NumLayers(void) const;
+
+  // The sizes the network was constructed with, inputs first.
+  vector<unsigned> LayerSizes(void) const;
+
+  // A matrix per layer (bias in column 0), followed by a column of scales per normalized layer,
+  // in layer order.
+  Tensor GetWeights(void) const;
+  void SetWeights(const Tensor &weights);
+
+  // The weights of an equivalent network without normalization, as inference runs with: batch
+  // normalized layers folded into plain layers. Layer normalization can't be folded, so the
+  // network mustn't have any.
+  Tensor GetInferenceWeights(void) const;
+
+  // Large layers are split across the thread pool, so neither of these may be called from a
+  // thread pool task. ProcessBatch takes one sample per column and returns the outputs in the
+  // same layout.
   Vector Process(const Vector &input);
+  Vector Process(const SparseVector &input);
+  Matrix ProcessBatch(const Matrix &inputs);
+
+  // Caches Process/ProcessBatch results for up to capacity distinct inputs, which are rounded to
+  // multiples of quantizationStep (0 for exact matches) before lookup. Any change to the weights
+  // invalidates the cached results.
+  void EnableResultCache(unsigned capacity, float quantizationStep);
+  CacheStats GetResultCacheStats(void) const;
+
+  // Online learning: inference reads versions of the weights that training publishes every
+  // updatesPerVersion updates (and on SetWeights), rather than the weights being trained. Process
+  // and ProcessBatch may then be called from any number of threads while a single thread trains,
+  // each call seeing one consistent version without taking locks, and neither side waiting for
+  // the other. Publishing copies the weights. Must be enabled before any concurrent use.
+  void EnableWeightPublication(unsigned updatesPerVersion = 1);
+  unsigned long NumPublishedVersions(void) const;
+
+  // Restricts the weight updates (from ApplyUpdate and ComputeAndApplyGradient) to the weights
+  // where mask is 1, the others being held at their current values, such as zero after pruning.
+  // An empty mask removes the restriction.
+  void SetWeightMask(const Tensor &mask);
+  Tensor GetWeightMask(void) const;
+
+  // Gradient checkpointing: training keeps only the outputs of every interval-th layer (and the
+  // output layer) for back-propagation, recomputing the others from the nearest kept layer below
+  // once back-propagation reaches them. This costs up to one extra forward pass, and holds about
+  // numLayers/interval + interval layers of activations rather than numLayers. Defaults to 1,
+  // keeping every layer. Doesn't apply to PIPELINE mode.
+  void SetCheckpointInterval(unsigned interval);
+
+  // Instead chooses the interval for each minibatch, as the smallest (least recomputation) whose
+  // activations fit in budgetBytes, or the one needing the least memory if none fit. 0 returns
+  // to the fixed interval.
+  void SetActivationMemoryBudget(size_t budgetBytes);
+
+  // The checkpoint interval used for a minibatch of the given size, and an upper bound on the
+  // activation memory it then needs.
+  unsigned CheckpointInterval(unsigned batchSize) const;
+  size_t ActivationMemoryBytes(unsigned batchSize) const;
+
   pair<Tensor, float> ComputeGradient(const TrainingProvider &samplesProvider);
   void ApplyUpdate(const Tensor &weightUpdates);
 
+  // Computes the gradient over the given samples and updates the weights layer by layer, each
+  // layer being updated as soon as all of the workers have back-propagated through it rather than
+  // once the whole gradient is done. updateFunc turns a layer's gradient (in place) into the
+  // update added to that layer's weights, and may be called concurrently for different layers.
+  // Returns the error over the samples.
+  float ComputeAndApplyGradient(
+      const TrainingProvider &samplesProvider, const LayerUpdateFunc &updateFunc);
+
   std::ostream& Output(std::ostream& stream);
 
 private:
@@ -0,0 +1,184 @@
+
+#include "PipelineExecutor.hpp"
+#include "LayerKernels.hpp"
+#include "../common/ThreadPool.hpp"
+#include <atomic>
+#include <cassert>
+#include <future>
+#include <thread>
+
+
+// Number of micro-batches in flight per stage, trades the pipeline fill/drain bubble against
+// the per micro-batch overhead.
+static const unsigned MICRO_BATCHES_PER_STAGE = 4;
+
+struct MicroBatch {
+  unsigned start, end;
+
+  // activations[0] holds the inputs, activations[i+1] the outputs of layer i.
+  vector<Matrix> activations;
+  vector<Matrix> deltas;
+
+  // Number of stages that have completed the forward/backward pass of this micro-batch.
+  atomic<unsigned> forwardDone;
+  atomic<unsigned> backwardDone;
+};
+
+static void waitFor(const atomic<unsigned> &counter, unsigned value) {
+  while (counter.load(std::memory_order_acquire) < value) {
+    std::this_thread::yield();
+  }
+}
+
+PipelineExecutor::PipelineExecutor(const Tensor &layerWeights, unsigned numStages) {
+  assert(numStages > 0);
+  const unsigned numLayers = layerWeights.NumLayers();
+  numStages = min(numStages, numLayers);
+
+  unsigned totalParams = 0;
+  for (unsigned i = 0; i < numLayers; i++) {
+    totalParams += layerWeights(i).size();
+  }
+
+  // Greedily close a stage once it holds its share of the remaining parameters, while leaving
+  // at least one layer for each of the remaining stages.
+  stageStart.push_back(0);
+  unsigned remainingParams = totalParams;
+  unsigned curParams = 0;
+  for (unsigned i = 0; i < numLayers; i++) {
+    unsigned stagesLeft = numStages - (stageStart.size() - 1);
+    unsigned layersLeft = numLayers - i;
+
+    if (i > stageStart.back() && stagesLeft > 1 &&
+        (layersLeft == stagesLeft - 1 ||
+         (curParams + layerWeights(i).size() / 2) > remainingParams / stagesLeft)) {
+      stageStart.push_back(i);
+      remainingParams -= curParams;
+      curParams = 0;
+    }
+    curParams += layerWeights(i).size();
+  }
+  stageStart.push_back(numLayers);
+  assert(stageStart.size() == numStages + 1);
+}
+
+unsigned PipelineExecutor::NumStages(void) const {
+  return stageStart.size() - 1;
+}
+
+float PipelineExecutor::ComputeGradient(Tensor &layerWeights, const Tensor &zeroGradient,
+                                        const vector<LayerRegularization> &regularization,
+                                        const Loss &loss, uint64_t dropoutSeed,
+                                        const TrainingProvider &samplesProvider,
+                                        const LayerUpdateFunc &updateFunc, bool applyUpdate) {
+
+  const unsigned numStages = NumStages();
+  const unsigned numLayers = layerWeights.NumLayers();
+  const unsigned numSamples = samplesProvider.NumSamples();
+  assert(numStages <= ThreadPool::instance().NumThreads());
+
+  const unsigned numMicroBatches = min(numSamples, numStages * MICRO_BATCHES_PER_STAGE);
+  vector<MicroBatch> microBatches(numMicroBatches);
+  for (unsigned i = 0; i < numMicroBatches; i++) {
+    microBatches[i].start = (i * numSamples) / numMicroBatches;
+    microBatches[i].end = ((i+1) * numSamples) / numMicroBatches;
+    microBatches[i].activations.resize(numLayers + 1);
+    microBatches[i].deltas.resize(numLayers);
+    microBatches[i].forwardDone = 0;
+    microBatches[i].backwardDone = 0;
+  }
+
+  Tensor netGradient = zeroGradient;
+  float error = 0.0f;
+
+  auto forward = [&](unsigned stage, MicroBatch &mb) {
+    waitFor(mb.forwardDone, stage);
+
+    if (stage == 0) {
+      const unsigned inputSize = layerWeights(0).cols() - 1;
+      mb.activations[0].resize(inputSize, mb.end - mb.start);
+      for (unsigned i = mb.start; i < mb.end; i++) {
+        samplesProvider.PackInput(i, mb.activations[0].col(i - mb.start));
+      }
+    }
+
+    // The output layer is left as logits, which the loss is computed from.
+    for (unsigned l = stageStart[stage]; l < stageStart[stage+1]; l++) {
+      if (l == numLayers - 1) {
+        LayerKernels::Logits(layerWeights(l), mb.activations[l], mb.activations[l+1]);
+      } else {
+        LayerKernels::Forward(layerWeights(l), mb.activations[l], mb.activations[l+1], 1,
+            LayerKernels::LayerDropout(regularization[l], l, dropoutSeed, mb.start));
+      }
+    }
+
+    if (stage == numStages - 1) {
+      Matrix targets(layerWeights(numLayers-1).rows(), mb.end - mb.start);
+      for (unsigned i = mb.start; i < mb.end; i++) {
+        samplesProvider.PackOutput(i, targets.col(i - mb.start));
+      }
+      error += LayerKernels::OutputDelta(
+          mb.activations[numLayers], targets, loss, mb.deltas[numLayers-1],
+          samplesProvider.SampleWeights(mb.start), samplesProvider.SampleLosses(mb.start));
+    }
+
+    mb.forwardDone.store(stage + 1, std::memory_order_release);
+  };
+
+  auto backward = [&](unsigned stage, MicroBatch &mb) {
+    waitFor(mb.backwardDone, numStages - 1 - stage);
+
+    for (int l = stageStart[stage+1] - 1; l >= (int) stageStart[stage]; l--) {
+      LayerKernels::AccumulateGradient(mb.deltas[l], mb.activations[l], netGradient(l));
+      if (l > 0) {
+        LayerKernels::Backward(layerWeights(l), mb.deltas[l], mb.activations[l], mb.deltas[l-1], 1,
+                               1.0f - regularization[l-1].dropoutRate);
+      }
+
+      // Nothing downstream needs these anymore, so release them to bound the memory in flight.
+      mb.activations[l+1].resize(0, 0);
+      mb.deltas[l].resize(0, 0);
+    }
+
+    mb.backwardDone.store(numStages - stage, std::memory_order_release);
+  };
+
+  vector<future<void>> futures;
+  futures.reserve(numStages);
+
+  for (unsigned s = 0; s < numStages; s++) {
+    futures.push_back(ThreadPool::instance().Execute([&, s]() {
+      // 1F1B: fill the pipeline with enough forward passes for the downstream stages, then
+      // alternate forward and backward passes, finally draining the remaining backward passes.
+      unsigned numWarmup = min(numStages - 1 - s, numMicroBatches);
+      unsigned nextForward = 0, nextBackward = 0;
+
+      for (; nextForward < numWarmup; nextForward++) {
+        forward(s, microBatches[nextForward]);
+      }
+      for (; nextForward < numMicroBatches; nextForward++, nextBackward++) {
+        forward(s, microBatches[nextForward]);
+        backward(s, microBatches[nextBackward]);
+      }
+      for (; nextBackward < numMicroBatches; nextBackward++) {
+        backward(s, microBatches[nextBackward]);
+      }
+
+      const vector<unsigned> allColumns;
+      for (unsigned l = stageStart[s]; l < stageStart[s+1]; l++) {
+        LayerKernels::FinishGradient(netGradient(l), 1.0f / numSamples, layerWeights(l),
+                                     regularization[l], allColumns);
+        updateFunc(l, netGradient(l), allColumns);
+        if (applyUpdate) {
+          layerWeights(l) += netGradient(l);
+        }
+      }
+    }));
+  }
+
+  for (auto& f : futures) {
+    f.get();
+  }
+
+  return error / numSamples;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "TrainingProvider.hpp"
+#include "Tensor.hpp"
+#include "../common/Common.hpp"
+#include "../common/Math.hpp"
+#include <cstdint>
+#include <vector>
+
+
+// Computes network gradients by assigning contiguous ranges of layers to pipeline stages, each
+// running on its own thread pool thread, and streaming micro-batches of samples through them
+// using a 1F1B (one forward, one backward) schedule. Each stage only ever touches the weights of
+// its own layers, keeping them hot in that core's cache.
+class PipelineExecutor {
+public:
+
+  // Layers are split into at most numStages stages, balanced by parameter count. All stages must
+  // be able to run concurrently, so numStages should not exceed the thread pool size.
+  PipelineExecutor(const Tensor &layerWeights, unsigned numStages);
+
+  unsigned NumStages(void) const;
+
+  // Each stage hands its layers' gradients to updateFunc (optionally applying the resulting update)
+  // as soon as it has drained its last micro-batch, as no other stage reads its weights. Returns
+  // the error over the samples.
+  float ComputeGradient(Tensor &layerWeights, const Tensor &zeroGradient,
+                        const vector<LayerRegularization> &regularization, const Loss &loss,
+                        uint64_t dropoutSeed, const TrainingProvider &samplesProvider,
+                        const LayerUpdateFunc &updateFunc, bool applyUpdate);
+
+private:
+  // Stage i processes layers [stageStart[i], stageStart[i+1]).
+  vector<unsigned> stageStart;
+};
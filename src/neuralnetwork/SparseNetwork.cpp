@@ -0,0 +1,106 @@
+
+#include "SparseNetwork.hpp"
+#include "LayerKernels.hpp"
+#include <cassert>
+
+
+// Above roughly this fraction of stored strips the blocked sparse product is no faster than the
+// dense one for batched inputs (single samples break even nearer 0.7).
+static const float MAX_SPARSE_BLOCK_DENSITY = 0.4f;
+
+static_assert(LayerKernels::CHUNK_ROW_ALIGN % BlockCsrMatrix::BLOCK_ROWS == 0,
+              "chunks must cover whole block rows");
+
+SparseNetwork::SparseNetwork(const Network &network) : loss(network.GetLoss()) {
+  Tensor weights = network.GetInferenceWeights();
+
+  for (unsigned l = 0; l < weights.NumLayers(); l++) {
+    const Matrix &w = weights(l);
+
+    Layer layer;
+    layer.inputSize = w.cols() - 1;
+    layer.outputSize = w.rows();
+
+    auto sparse = make_unique<BlockCsrMatrix>(w.rightCols(layer.inputSize));
+    if (sparse->BlockDensity() <= MAX_SPARSE_BLOCK_DENSITY) {
+      layer.bias = Vector::Zero(sparse->PaddedRows());
+      layer.bias.head(layer.outputSize) = w.col(0);
+      layer.sparse = move(sparse);
+    } else {
+      layer.bias = w.col(0);
+      layer.dense = w.rightCols(layer.inputSize);
+    }
+
+    layers.push_back(move(layer));
+  }
+}
+
+Vector SparseNetwork::Process(const Vector &input) const {
+  return ProcessBatch(input);
+}
+
+Matrix SparseNetwork::ProcessBatch(const Matrix &inputs) const {
+  assert(inputs.rows() == layers.front().inputSize);
+
+  RowMajorMatrix activations = inputs;
+  RowMajorMatrix layerOutput;
+  for (unsigned l = 0; l < layers.size(); l++) {
+    forwardLayer(layers[l], activations, layerOutput, l + 1 < layers.size());
+    activations.swap(layerOutput);
+  }
+
+  Matrix result = activations.topRows(layers.back().outputSize);
+  LayerKernels::ActivateOutputs(result, loss);
+  return result;
+}
+
+unsigned SparseNetwork::NumSparseLayers(void) const {
+  unsigned result = 0;
+  for (const auto& layer : layers) {
+    result += layer.sparse ? 1 : 0;
+  }
+  return result;
+}
+
+size_t SparseNetwork::SizeBytes(void) const {
+  size_t result = 0;
+  for (const auto& layer : layers) {
+    result += layer.outputSize * sizeof(float);
+    result += layer.sparse ? layer.sparse->SizeBytes() : layer.dense.size() * sizeof(float);
+  }
+  return result;
+}
+
+void SparseNetwork::forwardLayer(const Layer &layer, const RowMajorMatrix &in, RowMajorMatrix &out,
+                                 bool sigmoid) const {
+
+  const unsigned batchSize = in.cols();
+  if (layer.sparse) {
+    const BlockCsrMatrix &weights = *layer.sparse;
+    out.resize(weights.PaddedRows(), batchSize);
+
+    unsigned numChunks = LayerKernels::IntraOpChunks(weights.NumStoredValues(), batchSize);
+    LayerKernels::ForRowChunks(weights.PaddedRows(), numChunks, [&](unsigned start, unsigned rows) {
+      const unsigned startBlockRow = start / BlockCsrMatrix::BLOCK_ROWS;
+      weights.Multiply(in, out, startBlockRow, startBlockRow + rows / BlockCsrMatrix::BLOCK_ROWS);
+
+      auto z = out.middleRows(start, rows);
+      z.colwise() += layer.bias.segment(start, rows);
+      if (sigmoid) {
+        z = (1.0f + (-z.array()).exp()).inverse().matrix();
+      }
+    });
+  } else {
+    out.resize(layer.outputSize, batchSize);
+
+    unsigned numChunks = LayerKernels::IntraOpChunks(layer.dense, batchSize);
+    LayerKernels::ForRowChunks(layer.outputSize, numChunks, [&](unsigned start, unsigned rows) {
+      auto z = out.middleRows(start, rows);
+      z.noalias() = layer.dense.middleRows(start, rows) * in.topRows(layer.inputSize);
+      z.colwise() += layer.bias.segment(start, rows);
+      if (sigmoid) {
+        z = (1.0f + (-z.array()).exp()).inverse().matrix();
+      }
+    });
+  }
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "BlockCsrMatrix.hpp"
+#include "Network.hpp"
+#include "../common/Common.hpp"
+#include "../common/Math.hpp"
+#include <vector>
+
+
+// Inference only copy of a (typically pruned) network. Layers whose weights are sparse enough for
+// it to pay off are stored as BlockCsrMatrix, the rest stay dense. Later changes to the source
+// network are not reflected.
+class SparseNetwork {
+public:
+
+  SparseNetwork(const Network &network);
+
+  // As for Network, large layers are split across the thread pool, so these must not be called
+  // from a thread pool task.
+  Vector Process(const Vector &input) const;
+  Matrix ProcessBatch(const Matrix &inputs) const;
+
+  unsigned NumSparseLayers(void) const;
+
+  // Bytes of weight storage, including the sparse layers' indices.
+  size_t SizeBytes(void) const;
+
+private:
+  struct Layer {
+    unsigned inputSize;
+    unsigned outputSize;
+    Vector bias;
+
+    // Exactly one of these is used.
+    uptr<BlockCsrMatrix> sparse;
+    Matrix dense;
+  };
+
+  vector<Layer> layers;
+  Loss loss;
+
+  // Activations are kept row major between layers, each input row then being contiguous for the
+  // sparse kernels. The sparse layers' outputs are padded to whole block rows. The output layer
+  // skips the sigmoid, its logits being activated according to the loss.
+  void forwardLayer(const Layer &layer, const RowMajorMatrix &in, RowMajorMatrix &out,
+                    bool sigmoid) const;
+};
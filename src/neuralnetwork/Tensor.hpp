@@ -2,8 +2,71 @@
 
 #include "../common/Common.hpp"
 #include "../common/Math.hpp"
+#include <functional>
+#include <vector>
 
 
+// Turns the gradient of the given layer into an update for its weights. If columns is non-empty
+// the gradient is sparse, holding only the weight columns listed in columns (the rest of the
+// gradient being zero), as for a first layer fed by sparse inputs.
+using LayerUpdateFunc =
+    function<void(unsigned layer, Matrix &gradient, const vector<unsigned> &columns)>;
+
+// How layer weights are initialised. UNIFORM draws every weight from a small fixed range. XAVIER
+// (Glorot uniform) suits sigmoid layers and HE (Gaussian, sd sqrt(2/fanIn)) suits ReLU layers,
+// both of these starting the biases at zero.
+enum class WeightInit {
+  UNIFORM,
+  XAVIER,
+  HE
+};
+
+// Regularization of a single layer. dropoutRate is the fraction of the layer's outputs dropped
+// (zeroed) in each training pass, the decays add l2Decay * w + l1Decay * sign(w) to the gradient of
+// each non-bias weight w.
+struct LayerRegularization {
+  float dropoutRate;
+  float l2Decay;
+  float l1Decay;
+};
+
+// The loss minimised in training, which also decides the activation of the output layer:
+//   BINARY_CROSS_ENTROPY: sigmoid outputs, each an independent probability. The default.
+//   SOFTMAX_CROSS_ENTROPY: a softmax over the outputs, the targets being a distribution over the
+//     classes (typically one-hot).
+//   MSE: linear outputs, half the squared error.
+//   HUBER: linear outputs, half the squared error within huberDelta of the target and linear
+//     beyond it, so outliers contribute a bounded gradient.
+// The error reported by training is the mean of this loss over the samples.
+enum class LossType {
+  BINARY_CROSS_ENTROPY,
+  SOFTMAX_CROSS_ENTROPY,
+  MSE,
+  HUBER
+};
+
+struct Loss {
+  LossType type;
+  float huberDelta;
+};
+
+// Normalization of a hidden layer's pre-activations, which makes training far less sensitive to
+// the scale of the weights, so that deep sigmoid networks train at higher learning rates.
+//   NONE: the default.
+//   BATCH: each unit is normalized over the samples of the batch (in DATA mode, over each batch a
+//     worker runs, so the ExecutionConfig is part of the model). Inference instead uses running
+//     averages of the training batches' statistics, which fold into the layer's weights, so
+//     inference costs nothing extra.
+//   LAYER: each sample is normalized over the units of the layer, the same in training and
+//     inference.
+// The normalized values are then scaled and shifted per unit: the layer's bias weights are the
+// shifts (a bias before normalization being redundant), the scales are extra weights.
+enum class Normalization {
+  NONE,
+  BATCH,
+  LAYER
+};
+
 class Tensor {
 public:
 
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "CompressedDataset.hpp"
 #include "TrainingSample.hpp"
 #include "../common/Common.hpp"
 #include <vector>
@@ -13,14 +14,121 @@ public:
       const vector<TrainingSample> &allSamples,
       unsigned numSamples,
       unsigned offset) :
-        allSamples(allSamples),
+        allSamples(&allSamples),
+        compressedSamples(nullptr),
+        sequenceLength(allSamples.size()),
         numSamples(numSamples),
-        offset(offset) {}
+        order(nullptr),
+        offset(offset),
+        sampleWeights(nullptr),
+        sampleLosses(nullptr) {}
 
+  // Reads the samples through the given permutation of their indices, so that callers can shuffle
+  // the samples without modifying them.
+  TrainingProvider(
+      const vector<TrainingSample> &allSamples,
+      const vector<unsigned> &order,
+      unsigned numSamples,
+      unsigned offset) :
+        allSamples(&allSamples),
+        compressedSamples(nullptr),
+        sequenceLength(allSamples.size()),
+        numSamples(numSamples),
+        order(&order),
+        offset(offset),
+        sampleWeights(nullptr),
+        sampleLosses(nullptr) {
+    assert(order.size() == allSamples.size());
+  }
+
+  // As above, over a compressed training set, which is decoded as the samples are packed.
+  TrainingProvider(
+      const CompressedDataset &allSamples,
+      const vector<unsigned> &order,
+      unsigned numSamples,
+      unsigned offset) :
+        allSamples(nullptr),
+        compressedSamples(&allSamples),
+        sequenceLength(allSamples.NumSamples()),
+        numSamples(numSamples),
+        order(&order),
+        offset(offset),
+        sampleWeights(nullptr),
+        sampleLosses(nullptr) {
+    assert(order.size() == allSamples.NumSamples());
+  }
+
+  // Reads just the samples at the given indices, which may repeat, as for a sampled minibatch.
+  TrainingProvider(
+      const vector<TrainingSample> &allSamples,
+      const vector<unsigned> &indices) :
+        allSamples(&allSamples),
+        compressedSamples(nullptr),
+        sequenceLength(indices.size()),
+        numSamples(indices.size()),
+        order(&indices),
+        offset(0),
+        sampleWeights(nullptr),
+        sampleLosses(nullptr) {}
+
+  // As above, over a compressed training set.
+  TrainingProvider(
+      const CompressedDataset &allSamples,
+      const vector<unsigned> &indices) :
+        allSamples(nullptr),
+        compressedSamples(&allSamples),
+        sequenceLength(indices.size()),
+        numSamples(indices.size()),
+        order(&indices),
+        offset(0),
+        sampleWeights(nullptr),
+        sampleLosses(nullptr) {}
+
+  // For importance sampling: each sample's gradient and error are scaled by its entry in weights,
+  // and its unweighted loss is written to its entry in losses (either may be null). Both have an
+  // entry per sample, indexed as for GetSample, and must outlive the provider.
+  void SetImportance(const float *weights, float *losses) {
+    sampleWeights = weights;
+    sampleLosses = losses;
+  }
+
+  // The entries for the samples from the given index onwards, or null if there are none.
+  const float* SampleWeights(unsigned index) const {
+    return sampleWeights ? sampleWeights + index : nullptr;
+  }
+
+  float* SampleLosses(unsigned index) const {
+    return sampleLosses ? sampleLosses + index : nullptr;
+  }
+
+  // Only for uncompressed samples, see PackInput and PackOutput.
   const TrainingSample& GetSample(unsigned index) const {
-    assert(index < numSamples);
-    unsigned i = (index + offset) % allSamples.size();
-    return allSamples[i];
+    assert(allSamples != nullptr);
+    return (*allSamples)[sampleIndex(index)];
+  }
+
+  bool IsSparse(void) const {
+    return allSamples != nullptr && GetSample(0).IsSparse();
+  }
+
+  // Write the given (dense) sample's input or expected output to column, which must be
+  // contiguous, as is any column of a column major matrix or a block of its whole rows.
+  template<typename Column>
+  void PackInput(unsigned index, Column &&column) const {
+    if (compressedSamples) {
+      compressedSamples->DecodeInput(sampleIndex(index), column.data());
+    } else {
+      column = GetSample(index).input;
+    }
+  }
+
+  template<typename Column>
+  void PackOutput(unsigned index, Column &&column) const {
+    if (compressedSamples) {
+      compressedSamples->DecodeOutput(sampleIndex(index), column.data());
+    } else {
+      column = GetSample(index).expectedOutput;
+    }
   }
 
   unsigned NumSamples(void) const {
@@ -28,7 +136,21 @@ public:
   }
 
 private:
-  const vector<TrainingSample> &allSamples;
+  const vector<TrainingSample> *allSamples;
+  const CompressedDataset *compressedSamples;
+
+  // Samples are read cyclically from a sequence of this length, the whole set or the indices.
+  unsigned sequenceLength;
   unsigned numSamples;
+  const vector<unsigned> *order;
   unsigned offset;
+
+  const float *sampleWeights;
+  float *sampleLosses;
+
+  unsigned sampleIndex(unsigned index) const {
+    assert(index < numSamples);
+    unsigned i = (index + offset) % sequenceLength;
+    return order == nullptr ? i : (*order)[i];
+  }
 };
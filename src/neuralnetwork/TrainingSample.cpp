@@ -5,6 +5,10 @@
 
 
 std::ostream& operator<<(std::ostream& stream, const TrainingSample& ts) {
-  stream << ts.input << " : " << ts.expectedOutput;
+  if (ts.IsSparse()) {
+    stream << ts.sparseInput << " : " << ts.expectedOutput;
+  } else {
+    stream << ts.input << " : " << ts.expectedOutput;
+  }
   return stream;
 }
@@ -3,12 +3,22 @@
 #include "../common/Common.hpp"
 #include "../common/Math.hpp"
 
+// The input is held either as a dense vector or, for high dimensional inputs that are mostly
+// zeros, as a sparse vector (leaving the dense input empty).
 struct TrainingSample {
   Vector input;
+  SparseVector sparseInput;
   Vector expectedOutput;
 
   TrainingSample(const Vector &input, const Vector &expectedOutput) :
     input(input), expectedOutput(expectedOutput) {}
+
+  TrainingSample(const SparseVector &sparseInput, const Vector &expectedOutput) :
+    sparseInput(sparseInput), expectedOutput(expectedOutput) {}
+
+  bool IsSparse(void) const {
+    return sparseInput.size() > 0;
+  }
 };
 
 std::ostream& operator<<(std::ostream& stream, const TrainingSample& ts);
@@ -0,0 +1,171 @@
+
+#include "Random.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+
+static const uint32_t PHILOX_M0 = 0xD2511F53;
+static const uint32_t PHILOX_M1 = 0xCD9E8D57;
+static const uint32_t PHILOX_W0 = 0x9E3779B9;
+static const uint32_t PHILOX_W1 = 0xBB67AE85;
+static const unsigned PHILOX_ROUNDS = 10;
+
+// Number of blocks generated side by side in a bulk fill, one per vector lane.
+static const unsigned FILL_LANES = 16;
+
+// Blocks generated per pass of a bulk fill, bounding the size of its stack buffer.
+static const unsigned FILL_CHUNK_BLOCKS = 256;
+
+static const uint64_t DEFAULT_SEED = 0x853c49e6748fea9bULL;
+
+static const float TWO_PI = 6.283185307179586f;
+
+static std::atomic<uint64_t> globalSeed(DEFAULT_SEED);
+static std::atomic<uint64_t> nextStream(0);
+
+// Top 24 bits scaled to [0, 1).
+static inline float toUniform(uint32_t x) {
+  return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+// As toUniform, but in (0, 1], so that it is safe to take the log of.
+static inline float toUniformNonZero(uint32_t x) {
+  return ((x >> 8) + 1) * (1.0f / 16777216.0f);
+}
+
+// Writes numBlocks consecutive blocks starting at the given counter to out, 4 outputs per block.
+// The lanes of a group are laid out as separate arrays so that each round is a loop over
+// independent lanes.
+static void generateBlocks(uint64_t seed, uint64_t stream, uint64_t counter,
+                           unsigned numBlocks, uint32_t *out) {
+  for (unsigned base = 0; base < numBlocks; base += FILL_LANES) {
+    uint32_t x0[FILL_LANES], x1[FILL_LANES], x2[FILL_LANES], x3[FILL_LANES];
+    for (unsigned l = 0; l < FILL_LANES; l++) {
+      uint64_t c = counter + base + l;
+      x0[l] = (uint32_t) c;
+      x1[l] = (uint32_t) (c >> 32);
+      x2[l] = (uint32_t) stream;
+      x3[l] = (uint32_t) (stream >> 32);
+    }
+
+    uint32_t k0 = (uint32_t) seed;
+    uint32_t k1 = (uint32_t) (seed >> 32);
+    for (unsigned r = 0; r < PHILOX_ROUNDS; r++) {
+      for (unsigned l = 0; l < FILL_LANES; l++) {
+        uint64_t p0 = (uint64_t) PHILOX_M0 * x0[l];
+        uint64_t p1 = (uint64_t) PHILOX_M1 * x2[l];
+        uint32_t n0 = (uint32_t) (p1 >> 32) ^ x1[l] ^ k0;
+        uint32_t n2 = (uint32_t) (p0 >> 32) ^ x3[l] ^ k1;
+        x1[l] = (uint32_t) p1;
+        x3[l] = (uint32_t) p0;
+        x0[l] = n0;
+        x2[l] = n2;
+      }
+      k0 += PHILOX_W0;
+      k1 += PHILOX_W1;
+    }
+
+    unsigned numLanes = std::min(FILL_LANES, numBlocks - base);
+    for (unsigned l = 0; l < numLanes; l++) {
+      uint32_t *block = out + (base + l) * 4;
+      block[0] = x0[l];
+      block[1] = x1[l];
+      block[2] = x2[l];
+      block[3] = x3[l];
+    }
+  }
+}
+
+std::array<uint32_t, 4> PhiloxRng::Block(uint64_t seed, uint64_t stream, uint64_t counter) {
+  std::array<uint32_t, 4> result;
+  generateBlocks(seed, stream, counter, 1, result.data());
+  return result;
+}
+
+PhiloxRng::PhiloxRng(uint64_t seed, uint64_t stream) :
+    seed(seed), stream(stream), counter(0), bufferIndex(4) {}
+
+PhiloxRng::result_type PhiloxRng::operator()(void) {
+  if (bufferIndex == 4) {
+    buffer = Block(seed, stream, counter++);
+    bufferIndex = 0;
+  }
+  return buffer[bufferIndex++];
+}
+
+void PhiloxRng::Seek(uint64_t blockCounter) {
+  counter = blockCounter;
+  bufferIndex = 4;
+}
+
+float PhiloxRng::Uniform(void) {
+  return toUniform((*this)());
+}
+
+float PhiloxRng::Gaussian(float mean, float sd) {
+  // Box-Muller transform.
+  float r = sqrtf(-2.0f * logf(toUniformNonZero((*this)())));
+  return mean + sd * r * cosf(TWO_PI * Uniform());
+}
+
+void PhiloxRng::FillUniform(float *data, unsigned n, float lo, float hi) {
+  uint32_t bits[FILL_CHUNK_BLOCKS * 4];
+
+  for (unsigned start = 0; start < n; start += FILL_CHUNK_BLOCKS * 4) {
+    unsigned count = std::min(FILL_CHUNK_BLOCKS * 4, n - start);
+    unsigned numBlocks = (count + 3) / 4;
+    generateBlocks(seed, stream, counter, numBlocks, bits);
+    counter += numBlocks;
+
+    for (unsigned i = 0; i < count; i++) {
+      data[start + i] = lo + (hi - lo) * toUniform(bits[i]);
+    }
+  }
+  bufferIndex = 4;
+}
+
+void PhiloxRng::FillGaussian(float *data, unsigned n, float mean, float sd) {
+  uint32_t bits[FILL_CHUNK_BLOCKS * 4];
+
+  for (unsigned start = 0; start < n; start += FILL_CHUNK_BLOCKS * 4) {
+    unsigned count = std::min(FILL_CHUNK_BLOCKS * 4, n - start);
+    unsigned numBlocks = (count + 3) / 4;
+    generateBlocks(seed, stream, counter, numBlocks, bits);
+    counter += numBlocks;
+
+    // Each pair of outputs gives a pair of samples by the Box-Muller transform.
+    for (unsigned i = 0; i < count; i += 2) {
+      float r = sd * sqrtf(-2.0f * logf(toUniformNonZero(bits[i])));
+      float theta = TWO_PI * toUniform(bits[i + 1]);
+      data[start + i] = mean + r * cosf(theta);
+      if (i + 1 < count) {
+        data[start + i + 1] = mean + r * sinf(theta);
+      }
+    }
+  }
+  bufferIndex = 4;
+}
+
+void PhiloxRng::FillUniform(Matrix &m, float lo, float hi) {
+  FillUniform(m.data(), m.size(), lo, hi);
+}
+
+void PhiloxRng::FillGaussian(Matrix &m, float mean, float sd) {
+  FillGaussian(m.data(), m.size(), mean, sd);
+}
+
+void Random::Seed(uint64_t seed) {
+  globalSeed = seed;
+  nextStream = 0;
+  ThreadStream() = NewStream();
+}
+
+PhiloxRng Random::NewStream(void) {
+  return PhiloxRng(globalSeed.load(), nextStream++);
+}
+
+PhiloxRng& Random::ThreadStream(void) {
+  thread_local PhiloxRng stream = NewStream();
+  return stream;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "../common/Math.hpp"
+#include <array>
+#include <cstdint>
+
+
+// Philox4x32-10 counter-based generator (Salmon et al., "Parallel Random Numbers: As Easy as
+// 1, 2, 3"). Every block of four outputs is a pure function of (seed, stream, counter), so
+// streams need no shared state, and bulk fills generate their blocks independently of each other
+// in a loop the compiler can vectorize. Satisfies UniformRandomBitGenerator, for use with shuffle.
+class PhiloxRng {
+public:
+  using result_type = uint32_t;
+
+  PhiloxRng(uint64_t seed, uint64_t stream);
+
+  static constexpr result_type min(void) { return 0; }
+  static constexpr result_type max(void) { return UINT32_MAX; }
+
+  result_type operator()(void);
+
+  // Continues the stream from the start of the given block.
+  void Seek(uint64_t blockCounter);
+
+  // Uniform in [0, 1).
+  float Uniform(void);
+  float Gaussian(float mean, float sd);
+
+  // Overwrite every element of data/m. These consume whole blocks, skipping past any buffered
+  // outputs.
+  void FillUniform(float *data, unsigned n, float lo, float hi);
+  void FillGaussian(float *data, unsigned n, float mean, float sd);
+  void FillUniform(Matrix &m, float lo, float hi);
+  void FillGaussian(Matrix &m, float mean, float sd);
+
+  static std::array<uint32_t, 4> Block(uint64_t seed, uint64_t stream, uint64_t counter);
+
+private:
+  uint64_t seed;
+  uint64_t stream;
+  uint64_t counter;
+
+  std::array<uint32_t, 4> buffer;
+  unsigned bufferIndex;
+};
+
+namespace Random {
+
+  // Streams created after this derive from the given seed. The calling thread's stream is reset,
+  // so single threaded programs are reproducible after seeding.
+  void Seed(uint64_t seed);
+
+  // Returns a stream independent of all others created since the last Seed.
+  PhiloxRng NewStream(void);
+
+  // Per thread stream, created on first use.
+  PhiloxRng& ThreadStream(void);
+
+}